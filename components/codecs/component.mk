@@ -10,10 +10,10 @@ COMPONENT_ADD_LDFLAGS=-l$(COMPONENT_NAME) 	\
 	$(COMPONENT_PATH)/lib/libogg.a			\
 	$(COMPONENT_PATH)/lib/libalac.a			\
 	$(COMPONENT_PATH)/lib/libresample16.a	\
-	$(COMPONENT_PATH)/lib/libopusfile.a		\
 	$(COMPONENT_PATH)/lib/libopus.a 		
 	
 	#$(COMPONENT_PATH)/lib/libFLAC.a
+	#$(COMPONENT_PATH)/lib/libopusfile.a
 	#$(COMPONENT_PATH)/lib/libesp-flac.a
 	#$(COMPONENT_PATH)/lib/libsoxr.a		
 	#$(COMPONENT_PATH)/lib/libfaad.a 	
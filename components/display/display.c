@@ -13,6 +13,7 @@
 #include "esp_log.h"
 #include "globdefs.h"
 #include "config.h"
+#include "accessors.h"
 #include "tools.h"
 #include "display.h"
 #include "gds.h"
@@ -123,7 +124,9 @@ void display_init(char *welcome) {
 		displayer.by = 2;
 		displayer.pause = 3600;
 		displayer.speed = 33;
-		displayer.task = xTaskCreateStatic( (TaskFunction_t) displayer_task, "displayer_thread", DISPLAYER_STACK_SIZE, NULL, ESP_TASK_PRIO_MIN + 1, xStack, &xTaskBuffer);
+		task_config_t task;
+		config_task_get(&task, "displayer", tskNO_AFFINITY, ESP_TASK_PRIO_MIN + 1, DISPLAYER_STACK_SIZE);
+		displayer.task = xTaskCreateStaticPinnedToCore( (TaskFunction_t) displayer_task, "displayer_thread", DISPLAYER_STACK_SIZE, NULL, task.priority, xStack, &xTaskBuffer, task.core);
 		
 		// set lines for "fixed" text mode
 		GDS_TextSetFontAuto(display, 1, GDS_FONT_LINE_1, -3);
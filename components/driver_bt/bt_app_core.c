@@ -17,6 +17,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
+#include "accessors.h"
 
 static const char * TAG = "btappcore";
 
@@ -105,7 +106,9 @@ void bt_app_task_start_up(void)
 
     s_bt_app_task_queue = xQueueCreate(10, sizeof(bt_app_msg_t));
     assert(s_bt_app_task_queue!=NULL);
-    assert(xTaskCreate(bt_app_task_handler, "BtAppT", 4096, NULL, configMAX_PRIORITIES - 3, &s_bt_app_task_handle)==pdPASS);
+    task_config_t task;
+    config_task_get(&task, "bt", tskNO_AFFINITY, configMAX_PRIORITIES - 3, 4096);
+    assert(xTaskCreatePinnedToCore(bt_app_task_handler, "BtAppT", task.stack_size, NULL, task.priority, &s_bt_app_task_handle, task.core)==pdPASS);
     return;
 }
 
@@ -53,6 +53,7 @@
 #else
 #include "esp_pthread.h"
 #include "esp_system.h"
+#include "accessors.h"
 #include <mbedtls/version.h>
 #include <mbedtls/aes.h>
 #include "alac_wrapper.h"
@@ -278,9 +279,11 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 #ifdef WIN32
 	pthread_create(&ctx->thread, NULL, rtp_thread_func, (void *) ctx);
 #else
+	task_config_t task;
+	config_task_get(&task, "rtp", tskNO_AFFINITY, CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, RTP_STACK_SIZE);
 	ctx->xTaskBuffer = (StaticTask_t*) heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
-	ctx->thread = xTaskCreateStatic( (TaskFunction_t) rtp_thread_func, "RTP_thread", RTP_STACK_SIZE, ctx,
-									 CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, ctx->xStack, ctx->xTaskBuffer );
+	ctx->thread = xTaskCreateStaticPinnedToCore( (TaskFunction_t) rtp_thread_func, "RTP_thread", RTP_STACK_SIZE, ctx,
+									 task.priority, ctx->xStack, ctx->xTaskBuffer, task.core );
 #endif
 	
 	// cleanup everything if we failed
@@ -11,6 +11,7 @@
 #include "driver/gpio.h"
 #include "driver/i2c.h"
 #include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
 #include "config.h"
 #include "accessors.h"
 #include "globdefs.h"
@@ -18,6 +19,7 @@
 static const char *TAG = "services";
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
 
 /****************************************************************************************
  * 
@@ -104,4 +106,36 @@ void parse_set_GPIO(void (*cb)(int gpio, char *value)) {
 	} while (p++);
 	
 	free(nvs_item);
-}	
\ No newline at end of file
+}	
+
+/****************************************************************************************
+ * Placement of a task, from "task_config" <name>=<core>[:<priority>[:<stack>]],... 
+ * where core -1 means no affinity. Defaults are the ones set by the task creator and
+ * overrides are clamped so that a typo cannot starve the idle task or exhaust memory
+ */
+void config_task_get(task_config_t *task, const char *name, int core, int priority, int stack_size) {
+	char *nvs_item, *p;
+	size_t len = strlen(name);
+
+	task->core = core;
+	task->priority = priority;
+	task->stack_size = stack_size;
+	
+	if ((nvs_item = config_alloc_get(NVS_TYPE_STR, "task_config")) == NULL) return;
+	
+	for (p = nvs_item; (p = strcasestr(p, name)) != NULL; p += len) {
+		// whole name only
+		if ((p != nvs_item && p[-1] != ',' && p[-1] != ' ') || p[len] != '=') continue;
+		sscanf(p + len + 1, "%d:%d:%d", &task->core, &task->priority, &task->stack_size);
+		if (task->core < 0 || task->core >= portNUM_PROCESSORS) task->core = tskNO_AFFINITY;
+		if (task->priority < 1 || task->priority >= configMAX_PRIORITIES || task->stack_size < TASK_STACK_MIN || task->stack_size > TASK_STACK_MAX) {
+			ESP_LOGW(TAG, "task %s priority %d or stack %d out of range", name, task->priority, task->stack_size);
+			task->priority = min(max(task->priority, 1), configMAX_PRIORITIES - 1);
+			task->stack_size = min(max(task->stack_size, TASK_STACK_MIN), TASK_STACK_MAX);
+		}	
+		ESP_LOGI(TAG, "task %s on core %d with priority %d and stack %d", name, task->core, task->priority, task->stack_size);
+		break;
+	}	
+	
+	free(nvs_item);
+}
@@ -12,7 +12,17 @@
 #include "driver/i2c.h"
 #include "driver/spi_master.h"
 
+typedef struct {
+	int core;			// tskNO_AFFINITY when not pinned
+	int priority;
+	int stack_size;		// bytes
+} task_config_t;
+
+#define TASK_STACK_MIN		2048
+#define TASK_STACK_MAX		(64*1024)
+
 esp_err_t 					config_i2c_set(const i2c_config_t * config, int port);
 const i2c_config_t * 		config_i2c_get(int * i2c_port);
 const spi_bus_config_t * 	config_spi_get(spi_host_device_t * spi_host);
 void 						parse_set_GPIO(void (*cb)(int gpio, char *value));
+void 						config_task_get(task_config_t *task, const char *name, int core, int priority, int stack_size);
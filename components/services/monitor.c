@@ -64,10 +64,17 @@ static void task_stats( void ) {
 	for(int i = 0, n = 0; i < current.n; i++ ) {
 		for (int j = 0; j < previous.n; j++) {
 			if (current.tasks[i].xTaskNumber == previous.tasks[j].xTaskNumber) {
-				n += snprintf(scratch + n, SCRATCH_SIZE - n, "%16s (%u) %2u%% s:%5u", current.tasks[i].pcTaskName, 
+				// load is a share of one core, placement can be changed with "task_config"
+				n += snprintf(scratch + n, SCRATCH_SIZE - n, "%16s (%u) %2u%% s:%5u c:%d p:%u", current.tasks[i].pcTaskName, 
 																		   current.tasks[i].eCurrentState,
 																		   100 * (current.tasks[i].ulRunTimeCounter - previous.tasks[j].ulRunTimeCounter) / elapsed, 
-																		   current.tasks[i].usStackHighWaterMark);
+																		   current.tasks[i].usStackHighWaterMark,
+#ifdef CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+																		   current.tasks[i].xCoreID == tskNO_AFFINITY ? -1 : current.tasks[i].xCoreID,
+#else
+																		   -1,
+#endif
+																		   current.tasks[i].uxCurrentPriority);
 				if (i % 3 == 2 || i == current.n - 1) {
 					ESP_LOGI(TAG, "%s", scratch);
 					n = 0;
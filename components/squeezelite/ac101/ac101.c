@@ -23,6 +23,8 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include <esp_log.h>
 #include <esp_types.h>
 #include <esp_system.h>
@@ -42,6 +44,8 @@ static const char TAG[] = "AC101";
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
 
+#define VOLUME_STEPS	16		// max writes per volume change, so that large ones are a short ramp
+
 #define AC_ASSERT(a, format, b, ...) \
     if ((a) != 0) { \
         ESP_LOGE(TAG, format, ##__VA_ARGS__); \
@@ -65,6 +69,7 @@ static void ac101_set_earph_volume(uint8_t volume);
 static void ac101_set_spk_volume(uint8_t volume);
 	
 static int i2c_port;
+static int dac_volume[2] = { 0xa0, 0xa0 };
 
 /****************************************************************************************
  * init
@@ -148,6 +153,11 @@ static bool init(char *config, int i2c_port_num, i2s_config_t *i2s_config) {
 	ac101_set_spk_volume(100);
 	ac101_set_earph_volume(100);
 	
+	// DAC volume is stepped from where it is
+	uint16_t vol = i2c_read_reg(DAC_VOL_CTRL);
+	dac_volume[0] = vol >> 8;
+	dac_volume[1] = vol & 0xff;
+	
 	ESP_LOGI(TAG, "AC101 uses I2C sda:%d, scl:%d", i2c_config.sda_io_num, i2c_config.scl_io_num);
 
 	return (res == ESP_OK);
@@ -164,8 +174,30 @@ static void deinit(void)	{
  * change volume
  */
 static bool volume(unsigned left, unsigned right) {
-	// nothing at that point, volume is handled by backend
-	return false;
+	// DAC digital volume is 0.75 dB steps from -119.25 dB (0x00), 0 dB is 0xa0 (gain is 16.16)
+	int value[2] = { left, right }, from[2] = { dac_volume[0], dac_volume[1] }, steps;
+	for (int i = 0; i < 2; i++) {
+		value[i] = value[i] ? 0xa0 + lround(20 * log10(value[i] / 65536.0) / 0.75) : 0;
+		value[i] = min(max(value[i], 0), 0xff);
+	}	
+	
+	/* DAC has no volume ramp and output's digital ramp is bypassed, so walk the register in 
+	   1.5 dB writes (I2C pace makes it a few ms), with larger steps when it needs more than VOLUME_STEPS */
+	steps = max(abs(value[0] - dac_volume[0]), abs(value[1] - dac_volume[1]));
+	steps = min(max((steps + 1) / 2, 1), VOLUME_STEPS);
+	
+	for (int n = 1; n <= steps; n++) {
+		int l = from[0] + (value[0] - from[0]) * n / steps;
+		int r = from[1] + (value[1] - from[1]) * n / steps;
+		if (i2c_write_reg(DAC_VOL_CTRL, (l << 8) | r) != ESP_OK) {
+			ESP_LOGE(TAG, "can't set volume");
+			return false;
+		}	
+		dac_volume[0] = l;
+		dac_volume[1] = r;
+	}	
+	
+	return true;
 } 
 
 /****************************************************************************************
@@ -37,30 +37,19 @@
 
 #define BLOCK_SIZE (4096 * BYTES_PER_FRAME)
 #define MIN_READ    BLOCK_SIZE
+// encoder default is 4096, anything much larger is a corrupted cookie
+#define ALAC_MAX_FRAME_LENGTH	16384
 #define MIN_SPACE  (MIN_READ * 4)
 
-struct chunk_table {
-	u32_t sample, offset;
-};
-
 struct alac {
 	void *decoder;
-	u8_t *writebuf;
-	// following used for mp4 only
-	u32_t consume;
-	u32_t pos;
-	u32_t sample;
-	u32_t nextchunk;
-	void *stsc;
-	u32_t skip;
-	u64_t samples;
-	u64_t sttssamples;
+	u8_t *writebuf, *scratch;
+	u32_t writebuf_size, scratch_size;
+	u32_t allocs;
+	struct mp4 mp4;
 	bool  empty;
-	struct chunk_table *chunkinfo;
-	u32_t  *block_size, default_block_size, block_index;
 	unsigned sample_rate;
 	unsigned char channels, sample_size;
-	unsigned trak, play;
 };
 
 static struct alac *l;
@@ -94,216 +83,47 @@ extern struct processstate process;
 #define IF_PROCESS(x)
 #endif
 
-// read mp4 header to extract config data
-static int read_mp4_header(void) {
-	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	char type[5];
-	u32_t len;
-
-	while (bytes >= 8) {
-		// count trak to find the first playable one
-		u32_t consume;
-
-		len = unpackN((u32_t *)streambuf->readp);
-		memcpy(type, streambuf->readp + 4, 4);
-		type[4] = '\0';
+// persistent buffers only grow, allocations are counted to verify there is none while decoding
+static bool _reserve(u8_t **buf, u32_t *size, u32_t want) {
+	if (*size >= want) return true;
+	free(*buf);
+	*buf = malloc(want);
+	*size = *buf ? want : 0;
+	l->allocs++;
+	return *buf != NULL;
+}
 
-		if (!strcmp(type, "moov")) {
-			l->trak = 0;
-			l->play = 0;
-		}
-		if (!strcmp(type, "trak")) {
-			l->trak++;
-		}
+// extract audio config from within alac box and size buffers from the magic cookie
+static bool alac_config(u8_t *box, u32_t len) {
+	u8_t *cookie = box + 36;
+	u32_t frame_length, max_frame_bytes, pcm_bytes;
 
-		// extract audio config from within alac
-		if (!strcmp(type, "alac") && bytes > len) {
-			u8_t *ptr = streambuf->readp + 36;
-			l->decoder = alac_create_decoder(len - 36, ptr, &l->sample_size, &l->sample_rate, &l->channels);
-			l->play = l->trak;
-		}
+	// ALACSpecificConfig is 24 bytes and may be preceded by its atom header
+	if (len < 36 + 24 || (!memcmp(cookie + 4, "alac", 4) && len < 36 + 12 + 24)) return false;
 
-		// extract the total number of samples from stts
-		if (!strcmp(type, "stsz") && bytes > len) {
-			u32_t i;
-			u8_t *ptr = streambuf->readp + 12;
-			l->default_block_size = unpackN((u32_t *) ptr); ptr += 4;
-			if (!l->default_block_size) {
-				u32_t entries = unpackN((u32_t *)ptr); ptr += 4;
-				l->block_size = malloc((entries + 1)* 4);
-				for (i = 0; i < entries; i++) {
-					l->block_size[i] = unpackN((u32_t *)ptr); ptr += 4;
-				}
-				l->block_size[entries] = 0;
-				LOG_DEBUG("total blocksize contained in stsz %u", entries);
-			} else {
-				LOG_DEBUG("fixed blocksize in stsz %u", l->default_block_size);
-            }
-		}
+	l->decoder = alac_create_decoder(len - 36, cookie, &l->sample_size, &l->sample_rate, &l->channels);
+	if (!l->decoder) return false;
 
-		// extract the total number of samples from stts
-		if (!strcmp(type, "stts") && bytes > len) {
-			u32_t i;
-			u8_t *ptr = streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			for (i = 0; i < entries; ++i) {
-				u32_t count = unpackN((u32_t *)ptr);
-				u32_t size = unpackN((u32_t *)(ptr + 4));
-				l->sttssamples += count * size;
-				ptr += 8;
-			}
-			LOG_DEBUG("total number of samples contained in stts: " FMT_u64, l->sttssamples);
-		}
-
-		// stash sample to chunk info, assume it comes before stco
-		if (!strcmp(type, "stsc") && bytes > len && !l->chunkinfo) {
-			l->stsc = malloc(len - 12);
-			if (l->stsc == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			memcpy(l->stsc, streambuf->readp + 12, len - 12);
-		}
-
-		// build offsets table from stco and stored stsc
-		if (!strcmp(type, "stco") && bytes > len && l->play == l->trak) {
-			u32_t i;
-			// extract chunk offsets
-			u8_t *ptr = streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			l->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
-			if (l->chunkinfo == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			for (i = 0; i < entries; ++i) {
-				l->chunkinfo[i].offset = unpackN((u32_t *)ptr);
-				l->chunkinfo[i].sample = 0;
-				ptr += 4;
-			}
-			l->chunkinfo[i].sample = 0;
-			l->chunkinfo[i].offset = 0;
-			// fill in first sample id for each chunk from stored stsc
-			if (l->stsc) {
-				u32_t stsc_entries = unpackN((u32_t *)l->stsc);
-				u32_t sample = 0;
-				u32_t last = 0, last_samples = 0;
-				u8_t *ptr = (u8_t *)l->stsc + 4;
-				while (stsc_entries--) {
-					u32_t first = unpackN((u32_t *)ptr);
-					u32_t samples = unpackN((u32_t *)(ptr + 4));
-					if (last) {
-						for (i = last - 1; i < first - 1; ++i) {
-							l->chunkinfo[i].sample = sample;
-							sample += last_samples;
-						}
-					}
-					if (stsc_entries == 0) {
-						for (i = first - 1; i < entries; ++i) {
-							l->chunkinfo[i].sample = sample;
-							sample += samples;
-						}
-					}
-					last = first;
-					last_samples = samples;
-					ptr += 12;
-				}
-				free(l->stsc);
-				l->stsc = NULL;
-			}
-		}
+	if (!memcmp(cookie + 4, "alac", 4)) cookie += 12;
+	frame_length = unpackN((u32_t *)cookie);
+	max_frame_bytes = unpackN((u32_t *)(cookie + 12));
 
-		// found media data, advance to start of first chunk and return
-		if (!strcmp(type, "mdat")) {
-			_buf_inc_readp(streambuf, 8);
-			l->pos += 8;
-			bytes  -= 8;
-			if (l->play) {
-				LOG_DEBUG("type: mdat len: %u pos: %u", len, l->pos);
-				if (l->chunkinfo && l->chunkinfo[0].offset > l->pos) {
-					u32_t skip = l->chunkinfo[0].offset - l->pos;
-					LOG_DEBUG("skipping: %u", skip);
-					if (skip <= bytes) {
-						_buf_inc_readp(streambuf, skip);
-						l->pos += skip;
-					} else {
-						l->consume = skip;
-					}
-				}
-				l->sample = l->nextchunk = 1;
-				l->block_index = 0;
-				return 1;
-			} else {
-				LOG_DEBUG("type: mdat len: %u, no playable track found", len);
-				return -1;
-			}
-		}
-
-		// parse key-value atoms within ilst ---- entries to get encoder padding within iTunSMPB entry for gapless
-		if (!strcmp(type, "----") && bytes > len) {
-			u8_t *ptr = streambuf->readp + 8;
-			u32_t remain = len - 8, size;
-			if (!memcmp(ptr + 4, "mean", 4) && (size = unpackN((u32_t *)ptr)) < remain) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "name", 4) && (size = unpackN((u32_t *)ptr)) < remain && !memcmp(ptr + 12, "iTunSMPB", 8)) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "data", 4) && remain > 16 + 48) {
-				// data is stored as hex strings: 0 start end samples
-				u32_t b, c; u64_t d;
-				if (sscanf((const char *)(ptr + 16), "%x %x %x " FMT_x64, &b, &b, &c, &d) == 4) {
-					LOG_DEBUG("iTunSMPB start: %u end: %u samples: " FMT_u64, b, c, d);
-					if (l->sttssamples && l->sttssamples < b + c + d) {
-						LOG_DEBUG("reducing samples as stts count is less");
-						d = l->sttssamples - (b + c);
-					}
-					l->skip = b;
-					l->samples = d;
-				}
-			}
-		}
+	if (!frame_length || frame_length > ALAC_MAX_FRAME_LENGTH || !l->channels || l->sample_size > 32) {
+		LOG_ERROR("invalid cookie: frame length %u, channels %u, sample size %u", frame_length, l->channels, l->sample_size);
+		return false;
+	}
 
-		// default to consuming entire box
-		consume = len;
+	// decoder always writes 2 channels, packed 24 bits samples are read 4 bytes at a time
+	pcm_bytes = frame_length * 2 * ((l->sample_size + 7) / 8) + (l->sample_size == 24 ? 1 : 0);
 
-		// read into these boxes so reduce consume
-		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl") ||
-			!strcmp(type, "udta") || !strcmp(type, "ilst")) {
-			consume = 8;
-		}
-		// special cases which mix mix data in the enclosing box which we want to read into
-		if (!strcmp(type, "stsd")) consume = 16;
-		if (!strcmp(type, "mp4a")) consume = 36;
-		if (!strcmp(type, "meta")) consume = 12;
-
-		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
-		if (bytes >= consume) {
-			LOG_DEBUG("type: %s len: %u consume: %u", type, len, consume);
-			_buf_inc_readp(streambuf, consume);
-			l->pos += consume;
-			bytes -= consume;
-		} else if ( !(!strcmp(type, "esds") || !strcmp(type, "stts") || !strcmp(type, "stsc") ||
-					  !strcmp(type, "stsz") || !strcmp(type, "stco") || !strcmp(type, "----")) ) {
-			LOG_DEBUG("type: %s len: %u consume: %u - partial consume: %u", type, len, consume, bytes);
-			_buf_inc_readp(streambuf, bytes);
-			l->pos += bytes;
-			l->consume = consume - bytes;
-			break;
-		} else if (len > streambuf->size) {
- 			// can't process an atom larger than streambuf!
-			LOG_ERROR("atom %s too large for buffer %u %u", type, len, streambuf->size);
-			return -1;
-		 } else {
-			 // make sure there is 'len' contiguous space
-			_buf_unwrap(streambuf, len); 
-			break;
-		 }
+	// 0 means unknown, then use uncompressed size plus headers, which also bounds what the cookie says
+	if (!max_frame_bytes || max_frame_bytes > frame_length * l->channels * 4 + 64) {
+		max_frame_bytes = frame_length * l->channels * ((l->sample_size + 7) / 8) + 64;
 	}
+	LOG_DEBUG("frame length: %u, max frame bytes: %u", frame_length, max_frame_bytes);
 
-	return 0;
+	return _reserve(&l->writebuf, &l->writebuf_size, pcm_bytes) &&
+		   _reserve(&l->scratch, &l->scratch_size, max_frame_bytes);
 }
 
 static decode_state alac_decode(void) {
@@ -314,13 +134,8 @@ static decode_state alac_decode(void) {
 
 	LOCK_S;
 
-		// data not reached yet
-	if (l->consume) {
-		u32_t consume = min(l->consume, _buf_used(streambuf));
-		LOG_DEBUG("consume: %u of %u", consume, l->consume);
-		_buf_inc_readp(streambuf, consume);
-		l->pos += consume;
-		l->consume -= consume;
+	// data not reached yet
+	if (_mp4_consume(&l->mp4)) {
 		UNLOCK_S;
 		return DECODE_RUNNING;
 	}
@@ -329,10 +144,11 @@ static decode_state alac_decode(void) {
 		int found = 0;
 
 		// mp4 - read header
-		found = read_mp4_header();
+		found = mp4_read_header(&l->mp4);
 
 		if (found == 1) {
 			bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
+			l->allocs = 0;
 
 			LOG_INFO("setting track_start");
 			LOCK_O;
@@ -355,12 +171,12 @@ static decode_state alac_decode(void) {
 	}
 
 	bytes = _buf_used(streambuf);
-	block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
+	block_size = mp4_sample_size(&l->mp4);
 
 	// stream terminated
 	if (stream.state <= DISCONNECT && (bytes == 0 || block_size == 0)) {
 		UNLOCK_S;
-		LOG_DEBUG("end of stream");
+		LOG_INFO("end of stream, allocations while decoding: %u", l->allocs);
 		return DECODE_COMPLETE;
 	}
 
@@ -368,16 +184,20 @@ static decode_state alac_decode(void) {
 	if (bytes < block_size) {
 		UNLOCK_S;
 		return DECODE_RUNNING;
-	} else if (block_size != l->default_block_size) l->block_index++;
+	}
 
 	bytes = min(bytes, _buf_cont_read(streambuf));
 
 	// need to create a buffer with contiguous data
 	if (bytes < block_size) {
-		u8_t *buffer = malloc(block_size);
-		memcpy(buffer, streambuf->readp, bytes);
-		memcpy(buffer + bytes, streambuf->buf, block_size - bytes);
-		iptr = buffer;
+		if (!_reserve(&l->scratch, &l->scratch_size, block_size)) {
+			LOG_ERROR("can't allocate %u bytes", block_size);
+			UNLOCK_S;
+			return DECODE_ERROR;
+		}
+		memcpy(l->scratch, streambuf->readp, bytes);
+		memcpy(l->scratch + bytes, streambuf->buf, block_size - bytes);
+		iptr = l->scratch;
 	} else iptr = streambuf->readp;
 
 	if (!alac_to_pcm(l->decoder, iptr, l->writebuf, 2, &frames)) {
@@ -386,34 +206,10 @@ static decode_state alac_decode(void) {
 		return DECODE_ERROR;
 	}
 
-	// and free it
-	if (bytes < block_size) free(iptr);
-
 	LOG_SDEBUG("block of %u bytes (%u frames)", block_size, frames);
 
-	endstream = false;
-	// mp4 end of chunk - skip to next offset
-	if (l->chunkinfo && l->chunkinfo[l->nextchunk].offset && l->sample++ == l->chunkinfo[l->nextchunk].sample) {
-		 if (l->chunkinfo[l->nextchunk].offset > l->pos) {
-			u32_t skip = l->chunkinfo[l->nextchunk].offset - l->pos;
-			if (_buf_used(streambuf) >= skip) {
-				_buf_inc_readp(streambuf, skip);
-				l->pos += skip;
-			} else {
-				l->consume = skip;
-			}
-			l->nextchunk++;
-		 } else {
-			LOG_ERROR("error: need to skip backwards!");
-			endstream = true;
-		 }
-	// mp4 when not at end of chunk
-	} else if (frames) {
-		_buf_inc_readp(streambuf, block_size);
-		l->pos += block_size;
-	} else {
-		endstream = true;
-	}
+	// move to next sample, skipping to next chunk if needed
+	endstream = !frames || !_mp4_next_sample(&l->mp4, block_size);
 
 	UNLOCK_S;
 
@@ -425,26 +221,26 @@ static decode_state alac_decode(void) {
 	// now point at the beginning of decoded samples
 	iptr = l->writebuf;
 
-	if (l->skip) {
+	if (l->mp4.skip) {
 		u32_t skip;
 		if (l->empty) {
 			l->empty = false;
-			l->skip -= frames;
+			l->mp4.skip -= frames;
 			LOG_DEBUG("gapless: first frame empty, skipped %u frames at start", frames);
 		}
-		skip = min(frames, l->skip);
+		skip = min(frames, l->mp4.skip);
 		LOG_DEBUG("gapless: skipping %u frames at start", skip);
 		frames -= skip;
-		l->skip -= skip;
-		iptr += skip * l->channels * l->sample_size;
+		l->mp4.skip -= skip;
+		iptr += skip * 2 * ((l->sample_size + 7) / 8);
 	}
 
-	if (l->samples) {
-		if (l->samples < frames) {
-			LOG_DEBUG("gapless: trimming %u frames from end", frames - l->samples);
-			frames = (u32_t) l->samples;
+	if (l->mp4.samples) {
+		if (l->mp4.samples < frames) {
+			LOG_DEBUG("gapless: trimming %u frames from end", frames - l->mp4.samples);
+			frames = (u32_t) l->mp4.samples;
 		}
-		l->samples -= frames;
+		l->mp4.samples -= frames;
 	}
 
 	LOCK_O_direct;
@@ -510,26 +306,21 @@ static decode_state alac_decode(void) {
 }
 
 static void alac_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
+	// writebuf and scratch are kept across tracks and resized from the next cookie if needed
 	if (l->decoder)	alac_delete_decoder(l->decoder);
-	else l->writebuf = malloc(BLOCK_SIZE * 2);
-	
-	if (l->chunkinfo) free(l->chunkinfo);
-	if (l->block_size) free(l->block_size);
-	if (l->stsc) free(l->stsc);
-	l->decoder = l->chunkinfo = l->stsc = l->block_size = NULL;
-	l->skip = 0;
-	l->samples = l->sttssamples = 0;
+	l->decoder = NULL;
 	l->empty = false;
-	l->pos = l->consume = l->sample = l->nextchunk = 0;
+	mp4_init(&l->mp4, "alac", alac_config, true);
 }
 
 static void alac_close(void) {
 	if (l->decoder) alac_delete_decoder(l->decoder);
-	if (l->chunkinfo) free(l->chunkinfo);
-	if (l->block_size) free(l->block_size);
-	if (l->stsc) free(l->stsc);
-	l->decoder = l->chunkinfo = l->stsc = l->block_size = NULL;
+	l->decoder = NULL;
+	mp4_close(&l->mp4);
 	free(l->writebuf);
+	free(l->scratch);
+	l->writebuf = l->scratch = NULL;
+	l->writebuf_size = l->scratch_size = 0;
 }
 
 struct codec *register_alac(void) {
@@ -541,15 +332,14 @@ struct codec *register_alac(void) {
 		alac_open,      // open
 		alac_close,     // close
 		alac_decode,    // decode
+		true,         // keep warm
 	};
 	
-	l =  malloc(sizeof(struct alac));
+	l =  calloc(1, sizeof(struct alac));
 	if (!l) {
 		return NULL;
 	}	
 	
-	l->decoder = l->chunkinfo = l->stsc = l->block_size = NULL;
-	
 	LOG_INFO("using alac to decode alc");
 	return &ret;
 }
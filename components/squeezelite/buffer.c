@@ -152,6 +152,13 @@ void _buf_unwrap(struct buffer *buf, size_t cont) {
 	}
 }
 
+// contiguous read window of up to want bytes at readp, unwrapping if needed, caller consumes with _buf_inc_readp
+size_t _buf_read_window(struct buffer *buf, size_t want) {
+	want = min(want, _buf_used(buf));
+	if (_buf_cont_read(buf) < want) _buf_unwrap(buf, want);
+	return min(want, _buf_cont_read(buf));
+}
+
 void buf_init(struct buffer *buf, size_t size) {
 	buf->buf    = malloc(size);
 	buf->readp  = buf->buf;
@@ -0,0 +1,433 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "squeezelite.h"
+#include "convolver.h"
+#include "esp_dsp.h"
+#include "esp_http_client.h"
+
+/*
+ Uniformly partitioned overlap-save convolution. The impulse response is cut in K partitions of P taps whose
+ spectra (FFT size N = 2P) are computed once. Every P frames, the last N frames are transformed into a slot of
+ a frequency-domain delay line, each slot is multiplied by the matching partition and summed, and the inverse
+ transform gives the next P frames. Both channels go through one complex FFT (left real, right imaginary) and
+ are separated using the symmetry of the spectrum of real signals, so whatever the IR length there is one
+ forward and one inverse transform per block. Latency is P frames. Inverse FFT is done by conjugating before
+ and after a forward FFT, and all scaling is folded into the partitions.
+ The impulse response is fetched by a short-lived thread so that init does not wait for the network, audio
+ goes through untouched until the output thread adopts it between two buffers.
+*/
+
+#define MAX_TAPS			8192
+#define MIN_PARTITION		32
+#define DEFAULT_PARTITION	256
+#define MAX_WAV				(MAX_TAPS * 2 * 4 + 1024)
+#define LOAD_STACK_SIZE		(6*1024)
+
+#define LE16(p) ((p)[0] | (p)[1] << 8)
+#define LE32(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (u32_t) (p)[3] << 24)
+
+typedef struct { float re, im; } cplx;
+
+struct conv {
+	int P, N, K;			// partition, fft size and number of partitions
+	int bins;				// P + 1 bins per channel, left then right
+	cplx *H, *X;			// K * bins * 2, partitions spectra and delay line
+	cplx *work, *acc;		// N points and bins * 2
+	float *hist;			// previous P frames
+	s16_t *fifo;			// P frames, input is swapped with output
+	int head, pos;
+};
+
+static log_level loglevel = lINFO;
+
+static struct {
+	float *ir;				// taps * 2, interleaved
+	int taps, partition;
+	u32_t rate;
+	struct conv *conv;
+	bool bypass;
+	struct {
+		char *url;			// set while loading
+		float *ir;
+		int taps;
+		u32_t rate;
+		volatile bool ready;	// set by loader, cleared once adopted by output thread
+	} load;
+} convolver;
+
+/****************************************************************************************
+ * forward FFT of work buffer and separation into left and right spectra (x2)
+ */
+static void _transform(struct conv *c, cplx *L, cplx *R) {
+	cplx *w = c->work;
+
+	dsps_fft2r_fc32_ae32((float*) w, c->N);
+	dsps_bit_rev_fc32_ansi((float*) w, c->N);
+
+	for (int k = 0; k <= c->P; k++) {
+		cplx a = w[k], b = w[(c->N - k) & (c->N - 1)];
+		L[k].re = a.re + b.re; L[k].im = a.im - b.im;
+		R[k].re = a.im + b.im; R[k].im = b.re - a.re;
+	}
+}
+
+/****************************************************************************************
+ * process one block of P frames from fifo, output replaces input
+ */
+static void _block(struct conv *c) {
+	cplx *w = c->work, *acc = c->acc, *X;
+	s16_t *fifo = c->fifo;
+	float *hist = c->hist;
+	int bins = c->bins;
+
+	// last N frames, left in real part and right in imaginary part
+	for (int n = 0; n < c->P; n++) {
+		w[n].re = hist[2*n]; w[n].im = hist[2*n+1];
+		w[c->P + n].re = hist[2*n] = fifo[2*n];
+		w[c->P + n].im = hist[2*n+1] = fifo[2*n+1];
+	}
+
+	c->head = (c->head + 1) % c->K;
+	X = c->X + c->head * bins * 2;
+	_transform(c, X, X + bins);
+
+	// multiply-accumulate delay line with partitions, both channels in a row
+	memset(acc, 0, bins * 2 * sizeof(cplx));
+	for (int p = 0, s = c->head; p < c->K; p++, s = s ? s - 1 : c->K - 1) {
+		cplx *x = c->X + s * bins * 2, *h = c->H + p * bins * 2;
+		for (int k = 0; k < bins * 2; k++) {
+			acc[k].re += x[k].re * h[k].re - x[k].im * h[k].im;
+			acc[k].im += x[k].re * h[k].im + x[k].im * h[k].re;
+		}
+	}
+
+	// recombine as conj(YL + i.YR) over the full spectrum
+	for (int k = 0; k <= c->P; k++) {
+		cplx l = acc[k], r = acc[bins + k];
+		w[k].re = l.re - r.im; w[k].im = -l.im - r.re;
+		if (k && k < c->P) {
+			w[c->N - k].re = l.re + r.im;
+			w[c->N - k].im = l.im - r.re;
+		}
+	}
+
+	dsps_fft2r_fc32_ae32((float*) w, c->N);
+	dsps_bit_rev_fc32_ansi((float*) w, c->N);
+
+	// second half is valid, conjugate back
+	for (int n = 0; n < c->P; n++) {
+		float l = w[c->P + n].re, r = -w[c->P + n].im;
+		fifo[2*n] = l > 32767 ? 32767 : (l < -32768 ? -32768 : lrintf(l));
+		fifo[2*n+1] = r > 32767 ? 32767 : (r < -32768 ? -32768 : lrintf(r));
+	}
+}
+
+/****************************************************************************************
+ * run frames through convolution, delayed by P frames
+ */
+static void _run(struct conv *c, s16_t *ptr, frames_t frames) {
+	while (frames) {
+		frames_t count = min(frames, c->P - c->pos);
+		s16_t *f = c->fifo + c->pos * 2;
+
+		frames -= count;
+		c->pos += count;
+
+		for (count *= 2; count--; ptr++, f++) {
+			s16_t sample = *ptr;
+			*ptr = *f;
+			*f = sample;
+		}
+
+		if (c->pos == c->P) {
+			_block(c);
+			c->pos = 0;
+		}
+	}
+}
+
+/****************************************************************************************
+ * free convolution
+ */
+static void _free(struct conv *c) {
+	if (!c) return;
+	free(c->H);
+	free(c->X);
+	free(c->work);
+	free(c->acc);
+	free(c->hist);
+	free(c->fifo);
+	free(c);
+}
+
+/****************************************************************************************
+ * prepare convolution for an interleaved stereo impulse response
+ */
+static struct conv *_alloc(float *ir, int taps, int partition) {
+	struct conv *c = calloc(1, sizeof(struct conv));
+
+	if (!c) return NULL;
+
+	// FFT table is shared with display, initialize it for the largest size
+	dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
+
+	for (c->P = MIN_PARTITION; c->P < partition && c->P * 2 < CONFIG_DSP_MAX_FFT_SIZE; c->P *= 2);
+	c->N = c->P * 2;
+	c->K = (taps + c->P - 1) / c->P;
+	c->bins = c->P + 1;
+
+	c->H = malloc(c->K * c->bins * 2 * sizeof(cplx));
+	c->X = calloc(c->K * c->bins * 2, sizeof(cplx));
+	c->work = malloc(c->N * sizeof(cplx));
+	c->acc = malloc(c->bins * 2 * sizeof(cplx));
+	c->hist = calloc(c->P * 2, sizeof(float));
+	c->fifo = calloc(c->P * 2, sizeof(s16_t));
+
+	if (!c->H || !c->X || !c->work || !c->acc || !c->hist || !c->fifo) {
+		LOG_ERROR("can't allocate convolution for %d partitions of %d", c->K, c->P);
+		_free(c);
+		return NULL;
+	}
+
+	// zero-padded partitions, scaled by 1/2 for separation, 1/2 for the input one and 1/N for inverse FFT
+	for (int p = 0; p < c->K; p++) {
+		cplx *H = c->H + p * c->bins * 2;
+		float scale = 1.0f / (4 * c->N);
+
+		memset(c->work, 0, c->N * sizeof(cplx));
+		for (int n = 0; n < c->P && p * c->P + n < taps; n++) {
+			c->work[n].re = ir[2 * (p * c->P + n)];
+			c->work[n].im = ir[2 * (p * c->P + n) + 1];
+		}
+
+		_transform(c, H, H + c->bins);
+		for (int k = 0; k < c->bins * 2; k++) {
+			H[k].re *= scale;
+			H[k].im *= scale;
+		}
+	}
+
+	return c;
+}
+
+/****************************************************************************************
+ * parse a 16/24/32 bits pcm or float wav in memory, mono or stereo
+ */
+static bool _parse_wav(u8_t *data, size_t len, float **ir, int *taps, u32_t *rate) {
+	u16_t format = 0, channels = 0, bits = 0;
+	u8_t *p = data + 12;
+
+	if (len < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+		LOG_ERROR("not a wav file");
+		return false;
+	}
+
+	while (p + 8 <= data + len) {
+		u32_t size = LE32(p + 4);
+		u8_t *chunk = p + 8;
+
+		if (size > data + len - chunk) size = data + len - chunk;
+
+		if (!memcmp(p, "fmt ", 4) && size >= 16) {
+			format = LE16(chunk);
+			channels = LE16(chunk + 2);
+			*rate = LE32(chunk + 4);
+			bits = LE16(chunk + 14);
+			// extensible format has the actual one at the start of the GUID
+			if (format == 0xfffe && size >= 26) format = LE16(chunk + 24);
+		} else if (!memcmp(p, "data", 4)) {
+			int width = bits / 8;
+
+			if ((format != 1 && format != 3) || (format == 3 && bits != 32) || (bits != 16 && bits != 24 && bits != 32) ||
+				channels < 1 || channels > 2) {
+				LOG_ERROR("unsupported format %u, %u channels of %u bits", format, channels, bits);
+				return false;
+			}
+
+			*taps = min(size / (width * channels), MAX_TAPS);
+			*ir = malloc(*taps * 2 * sizeof(float));
+			if (!*ir) return false;
+
+			for (int i = 0; i < *taps * 2; i++) {
+				u8_t *s = chunk + (i / 2 * channels + (channels == 2 ? i % 2 : 0)) * width;
+				if (format == 3) {
+					u32_t v = LE32(s);
+					memcpy(*ir + i, &v, sizeof(float));
+				} else if (bits == 16) {
+					(*ir)[i] = (s16_t) LE16(s) / 32768.0f;
+				} else if (bits == 24) {
+					(*ir)[i] = (s32_t) (s[0] << 8 | s[1] << 16 | (u32_t) s[2] << 24) / 2147483648.0f;
+				} else {
+					(*ir)[i] = (s32_t) LE32(s) / 2147483648.0f;
+				}
+			}
+
+			return true;
+		}
+
+		p = chunk + size + (size & 1);
+	}
+
+	LOG_ERROR("no data in wav file");
+	return false;
+}
+
+/****************************************************************************************
+ * fetch impulse response wav, runs in its own thread
+ */
+static void *_load_thread(void *arg) {
+	esp_http_client_config_t config = { .url = convolver.load.url, .timeout_ms = 5000 };
+	esp_http_client_handle_t client = esp_http_client_init(&config);
+	u8_t *data = NULL;
+	int len = 0, bytes;
+	bool ok = false;
+
+	if (client && esp_http_client_open(client, 0) == ESP_OK && (len = esp_http_client_fetch_headers(client)) > 0 &&
+		len <= MAX_WAV && (data = malloc(len)) != NULL) {
+		for (bytes = 0; bytes < len; ) {
+			int n = esp_http_client_read(client, (char*) data + bytes, len - bytes);
+			if (n <= 0) break;
+			bytes += n;
+		}
+		ok = bytes == len && _parse_wav(data, len, &convolver.load.ir, &convolver.load.taps, &convolver.load.rate);
+	}
+
+	if (client) esp_http_client_cleanup(client);
+	free(data);
+
+	if (ok) {
+		LOG_INFO("loaded %d taps at %u from %s", convolver.load.taps, convolver.load.rate, convolver.load.url);
+		convolver.load.ready = true;
+	} else {
+		LOG_ERROR("can't load impulse response from %s (%d bytes)", convolver.load.url, len);
+		free(convolver.load.ir);
+		convolver.load.ir = NULL;
+	}
+
+	free(convolver.load.url);
+	convolver.load.url = NULL;
+
+	return NULL;
+}
+
+/****************************************************************************************
+ * load impulse response wav from url in background, audio is not filtered until it's there
+ */
+bool convolver_load(const char *url, unsigned partition) {
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (convolver.load.url || convolver.load.ready) {
+		LOG_WARN("impulse response already loading");
+		return false;
+	}
+
+	convolver.partition = partition ? partition : DEFAULT_PARTITION;
+	convolver.load.url = strdup(url);
+	convolver.load.ir = NULL;
+	if (!convolver.load.url) return false;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, LOAD_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create_name(&thread, &attr, _load_thread, NULL, "convolver")) {
+		LOG_ERROR("can't start impulse response loader");
+		free(convolver.load.url);
+		convolver.load.url = NULL;
+	}
+	pthread_attr_destroy(&attr);
+
+	return convolver.load.url != NULL;
+}
+
+/****************************************************************************************
+ * close convolution, impulse response is kept
+ */
+void convolver_close(void) {
+	_free(convolver.conv);
+	convolver.conv = NULL;
+	convolver.bypass = false;
+}
+
+/****************************************************************************************
+ * process convolution in place, output is delayed by partition size
+ */
+void convolver_process(u8_t *buf, u32_t bytes, u32_t sample_rate) {
+	// impulse response loaded in background, swap it in between two buffers
+	if (convolver.load.ready) {
+		convolver_close();
+		free(convolver.ir);
+		convolver.ir = convolver.load.ir;
+		convolver.taps = convolver.load.taps;
+		convolver.rate = convolver.load.rate;
+		convolver.load.ir = NULL;
+		convolver.load.ready = false;
+	}
+
+	if (!convolver.ir || convolver.bypass) return;
+
+	if (!convolver.conv) {
+		// impulse response is only valid at its own sample rate
+		if (sample_rate != convolver.rate) {
+			LOG_WARN("impulse response is for %u, not %u", convolver.rate, sample_rate);
+			convolver.bypass = true;
+			return;
+		}
+		convolver.conv = _alloc(convolver.ir, convolver.taps, convolver.partition);
+		convolver.bypass = !convolver.conv;
+		if (convolver.conv) LOG_INFO("convolution with %d partitions of %d", convolver.conv->K, convolver.conv->P);
+	}
+
+	if (convolver.conv) _run(convolver.conv, (s16_t*) buf, bytes / BYTES_PER_FRAME);
+}
+
+/****************************************************************************************
+ * latency added to output
+ */
+frames_t convolver_delay(void) {
+	return convolver.conv ? convolver.conv->P : 0;
+}
+
+/****************************************************************************************
+ * cycles per frame for a few impulse response lengths, on a private instance
+ */
+void convolver_bench(unsigned partition) {
+	static const int lengths[] = { 512, 1024, 2048, 4096, 8192 };
+	frames_t frames = 44100, chunk = 512;
+	s16_t *buf = malloc(chunk * BYTES_PER_FRAME);
+	float *ir = malloc(MAX_TAPS * 2 * sizeof(float));
+
+	if (!buf || !ir) goto out;
+
+	for (int i = 0; i < MAX_TAPS * 2; i++) ir[i] = (rand() % 2001 - 1000) / 1000.0f * expf(-i / 2000.0f);
+	for (int i = 0; i < chunk * 2; i++) buf[i] = rand() % 2001 - 1000;
+
+	for (int l = 0; l < sizeof(lengths) / sizeof(*lengths); l++) {
+		struct conv *c = _alloc(ir, lengths[l], partition ? partition : DEFAULT_PARTITION);
+		u64_t start;
+		u32_t us;
+
+		if (!c) break;
+
+		start = gettime_us();
+		for (frames_t n = 0; n < frames; n += chunk) _run(c, buf, chunk);
+		us = gettime_us() - start;
+
+		LOG_INFO("%5d taps, partition %d: %u cycles per frame, %u%% of a core at 44.1kHz", lengths[l], c->P,
+				 (u32_t) ((u64_t) us * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ / frames), us / 10000);
+		_free(c);
+	}
+
+out:
+	free(buf);
+	free(ir);
+}
@@ -0,0 +1,17 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+bool convolver_load(const char *url, unsigned partition);
+void convolver_close(void);
+void convolver_process(u8_t *buf, u32_t bytes, u32_t sample_rate);
+frames_t convolver_delay(void);
+void convolver_bench(unsigned partition);
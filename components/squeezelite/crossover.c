@@ -0,0 +1,240 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "squeezelite.h"
+#include "crossover.h"
+
+/*
+ 2-way crossover: high band replaces input and low band goes to a second buffer (sent to the other I2S port).
+ In 2.1 mode, high band is stereo and low band is the mono sum, on both channels. Filters are 4th order
+ Linkwitz-Riley (two cascaded 2nd order Butterworth), so bands add up flat and in phase. Biquads are direct
+ form I with Q28 coefficients and samples carrying 12 extra fractional bits, which keeps low cutoffs at high
+ sample rates stable and quiet. Each band then has its own gain and delay (to align drivers).
+*/
+
+#define COEF_BITS	28
+#define FRAC_BITS	12
+#define MAX_DELAY_US	20000
+
+enum { LO = 0, HI };
+
+struct coef { s32_t b0, b1, b2, a1, a2; };
+struct state { s32_t x1, x2, y1, y2; };
+
+struct band {
+	struct coef coef;
+	struct state state[2][2];	// channel, stage
+	s32_t gain;					// Q16
+	unsigned delay_us;
+	s16_t *delay;				// frames * 2
+	frames_t frames, pos;
+};
+
+static log_level loglevel = lINFO;
+
+struct crossover {
+	bool enabled, sub;
+	unsigned freq;
+	u32_t rate;
+	struct band band[2];
+};
+
+static struct crossover crossover;
+
+/****************************************************************************************
+ * 2nd order butterworth coefficients (RBJ cookbook)
+ */
+static void _butterworth(struct coef *coef, unsigned freq, u32_t rate, bool high) {
+	double w0 = 2 * M_PI * freq / rate, cosw = cos(w0), alpha = sin(w0) / (2 * M_SQRT1_2), a0 = 1 + alpha;
+	double b0 = (high ? 1 + cosw : 1 - cosw) / 2, b1 = high ? -(1 + cosw) : 1 - cosw;
+	double scale = (1 << COEF_BITS) / a0;
+
+	coef->b0 = coef->b2 = lround(b0 * scale);
+	coef->b1 = lround(b1 * scale);
+	coef->a1 = lround(-2 * cosw * scale);
+	coef->a2 = lround((1 - alpha) * scale);
+}
+
+static inline s32_t _biquad(struct coef *c, struct state *s, s32_t x) {
+	s64_t acc = (s64_t) c->b0 * x + (s64_t) c->b1 * s->x1 + (s64_t) c->b2 * s->x2 - (s64_t) c->a1 * s->y1 - (s64_t) c->a2 * s->y2;
+	s32_t y = acc >> COEF_BITS;
+
+	s->x2 = s->x1; s->x1 = x;
+	s->y2 = s->y1; s->y1 = y;
+
+	return y;
+}
+
+static inline s16_t _output(s32_t y, s32_t gain) {
+	s32_t v = ((s64_t) y * gain + (1LL << (FRAC_BITS + 15))) >> (FRAC_BITS + 16);
+	return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+/****************************************************************************************
+ * run a band through its delay line, in place
+ */
+static void _delay(struct band *band, s16_t *ptr, frames_t frames) {
+	while (frames) {
+		frames_t count = min(frames, band->frames - band->pos);
+		s16_t *d = band->delay + band->pos * 2;
+
+		frames -= count;
+		band->pos = (band->pos + count) % band->frames;
+
+		for (count *= 2; count--; ptr++, d++) {
+			s16_t sample = *ptr;
+			*ptr = *d;
+			*d = sample;
+		}
+	}
+}
+
+/****************************************************************************************
+ * free delay lines
+ */
+static void _close(struct crossover *x) {
+	for (int i = LO; i <= HI; i++) {
+		free(x->band[i].delay);
+		x->band[i].delay = NULL;
+	}
+	x->rate = 0;
+}
+
+/****************************************************************************************
+ * set filters and delay lines for a given sample rate
+ */
+static void _open(struct crossover *x, u32_t sample_rate) {
+	_close(x);
+	x->rate = sample_rate;
+
+	for (int i = LO; i <= HI; i++) {
+		struct band *band = x->band + i;
+
+		_butterworth(&band->coef, x->freq, sample_rate, i == HI);
+		memset(band->state, 0, sizeof(band->state));
+
+		band->pos = 0;
+		band->frames = (u64_t) band->delay_us * sample_rate / 1000000;
+		if (band->frames && (band->delay = calloc(band->frames, BYTES_PER_FRAME)) == NULL) {
+			LOG_ERROR("can't allocate delay of %u frames", band->frames);
+			band->frames = 0;
+		}
+	}
+
+	LOG_INFO("crossover at %u Hz for %u, delays %u/%u frames", x->freq, sample_rate, x->band[LO].frames, x->band[HI].frames);
+}
+
+/****************************************************************************************
+ * split frames into high band (in place) and low band
+ */
+static void _process(struct crossover *x, s16_t *hi, s16_t *lo, frames_t frames) {
+	struct band *L = x->band + LO, *H = x->band + HI;
+	s16_t *ptr = hi, *optr = lo;
+	frames_t count = frames;
+
+	if (x->sub) {
+		while (count--) {
+			s32_t l = ptr[0] << FRAC_BITS, r = ptr[1] << FRAC_BITS;
+			s32_t m = _biquad(&L->coef, &L->state[0][1], _biquad(&L->coef, &L->state[0][0], (l + r) >> 1));
+			optr[0] = optr[1] = _output(m, L->gain);
+			optr += 2;
+			*ptr++ = _output(_biquad(&H->coef, &H->state[0][1], _biquad(&H->coef, &H->state[0][0], l)), H->gain);
+			*ptr++ = _output(_biquad(&H->coef, &H->state[1][1], _biquad(&H->coef, &H->state[1][0], r)), H->gain);
+		}
+	} else {
+		while (count--) {
+			s32_t l = ptr[0] << FRAC_BITS, r = ptr[1] << FRAC_BITS;
+			*optr++ = _output(_biquad(&L->coef, &L->state[0][1], _biquad(&L->coef, &L->state[0][0], l)), L->gain);
+			*optr++ = _output(_biquad(&L->coef, &L->state[1][1], _biquad(&L->coef, &L->state[1][0], r)), L->gain);
+			*ptr++ = _output(_biquad(&H->coef, &H->state[0][1], _biquad(&H->coef, &H->state[0][0], l)), H->gain);
+			*ptr++ = _output(_biquad(&H->coef, &H->state[1][1], _biquad(&H->coef, &H->state[1][0], r)), H->gain);
+		}
+	}
+
+	if (L->delay) _delay(L, lo, frames);
+	if (H->delay) _delay(H, hi, frames);
+}
+
+/****************************************************************************************
+ * close crossover
+ */
+void crossover_close(void) {
+	_close(&crossover);
+}
+
+/****************************************************************************************
+ * parse "freq=<Hz>[,mode=2.1][,gain_lo=<dB>][,gain_hi=<dB>][,delay_lo=<us>][,delay_hi=<us>]"
+ */
+bool crossover_config(char *config) {
+	static const char *keys[] = { "lo", "hi" };
+	char *p, key[16];
+
+	_close(&crossover);
+	crossover.enabled = false;
+	if (!config || (p = strcasestr(config, "freq")) == NULL) return false;
+
+	crossover.freq = atoi(strchr(p, '=') + 1);
+	crossover.sub = (p = strcasestr(config, "mode")) != NULL && !strncmp(strchr(p, '=') + 1, "2.1", 3);
+
+	for (int i = LO; i <= HI; i++) {
+		struct band *band = crossover.band + i;
+
+		sprintf(key, "gain_%s", keys[i]);
+		band->gain = (p = strcasestr(config, key)) != NULL ? to_gain(powf(10, atof(strchr(p, '=') + 1) / 20)) : FIXED_ONE;
+		sprintf(key, "delay_%s", keys[i]);
+		band->delay_us = (p = strcasestr(config, key)) != NULL ? min(atoi(strchr(p, '=') + 1), MAX_DELAY_US) : 0;
+	}
+
+	crossover.enabled = crossover.freq > 0;
+	if (crossover.enabled) LOG_INFO("%s crossover at %u Hz", crossover.sub ? "2.1" : "2-way", crossover.freq);
+
+	return crossover.enabled;
+}
+
+/****************************************************************************************
+ * split frames into high band (in place) and low band
+ */
+void crossover_process(s16_t *hi, s16_t *lo, frames_t frames, u32_t sample_rate) {
+	if (!crossover.enabled) return;
+	if (crossover.rate != sample_rate) _open(&crossover, sample_rate);
+	_process(&crossover, hi, lo, frames);
+}
+
+/****************************************************************************************
+ * cost of the filtering kernel, on a private instance
+ */
+struct bench_ctx {
+	struct crossover *x;
+	s16_t *lo;
+};
+
+static void _bench_kernel(void *ctx, ISAMPLE_T *ptr, frames_t count) {
+	struct bench_ctx *b = ctx;
+	_process(b->x, (s16_t*) ptr, b->lo, count);
+}
+
+void crossover_bench(void) {
+	struct crossover x = { .enabled = true, .freq = 2000, .band = { { .gain = FIXED_ONE, .delay_us = 100 }, { .gain = FIXED_ONE } } };
+	struct bench_ctx ctx = { &x, malloc(BENCH_CHUNK * BYTES_PER_FRAME) };
+
+	for (int mode = 0; ctx.lo && mode < 2; mode++) {
+		u32_t us;
+
+		x.sub = mode;
+		_open(&x, 44100);
+		us = kernel_bench(_bench_kernel, &ctx);
+
+		LOG_INFO("%s crossover: %u us per second at 44.1kHz (%u%% of a core)", mode ? "2.1" : "2-way", us, us / 10000);
+		_close(&x);
+	}
+
+	free(ctx.lo);
+}
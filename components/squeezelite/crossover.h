@@ -0,0 +1,16 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+bool crossover_config(char *config);
+void crossover_close(void);
+void crossover_process(s16_t *hi, s16_t *lo, frames_t frames, u32_t sample_rate);
+void crossover_bench(void);
@@ -53,6 +53,123 @@ static bool running = true;
 #define MAY_PROCESS(x)
 #endif
 
+// codecs are left open when another one is selected so that they restart warm (no allocation of
+// contexts and buffers), they are released when idle for too long or when platform is short of memory
+#define WARM_CODECS		2
+#define WARM_IDLE_MS	(5 * 60 * 1000)
+
+#ifndef CODEC_LOW_MEMORY
+#define CODEC_LOW_MEMORY() false
+#endif
+
+// when the platform can't afford warm codecs, the previous one is closed as soon as another takes over
+#ifndef CODEC_KEEP_WARM
+#define CODEC_KEEP_WARM() true
+#endif
+
+// free heap used to measure codecs memory, 0 when platform can't tell
+#ifndef CODEC_HEAP_FREE
+#define CODEC_HEAP_FREE() 0
+#endif
+
+static int heap_mark;
+
+// stage load is reported for every LOAD_REPORT_SECS of decoded audio
+#define LOAD_REPORT_SECS	10
+
+static unsigned decode_rate;
+
+static struct {
+	struct codec *codec;
+	u32_t since;
+} warm[WARM_CODECS];
+
+// all _codec_* called with decode mutex locked
+static bool _codec_unpark(struct codec *c) {
+	int i;
+	for (i = 0; i < WARM_CODECS; i++) {
+		if (warm[i].codec == c) {
+			warm[i].codec = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void _codec_park(struct codec *c) {
+	int i, slot = 0;
+
+	if (!c->keep || !CODEC_KEEP_WARM()) {
+		LOG_INFO("closing codec: '%c'", c->id);
+		c->close();
+		return;
+	}
+
+	// use a free slot or evict the oldest
+	for (i = 0; i < WARM_CODECS; i++) {
+		if (!warm[i].codec) {
+			slot = i;
+			break;
+		}
+		if (warm[i].since < warm[slot].since) slot = i;
+	}
+
+	if (warm[slot].codec) {
+		LOG_INFO("closing codec: '%c'", warm[slot].codec->id);
+		warm[slot].codec->close();
+	}
+
+	LOG_INFO("keeping codec warm: '%c'", c->id);
+	warm[slot].codec = c;
+	warm[slot].since = gettime_ms();
+}
+
+static void _codec_expire(bool all) {
+	u32_t now = gettime_ms();
+	int i;
+
+	for (i = 0; i < WARM_CODECS; i++) {
+		if (warm[i].codec && (all || now - warm[i].since > WARM_IDLE_MS || CODEC_LOW_MEMORY())) {
+			LOG_INFO("releasing warm codec: '%c'", warm[i].codec->id);
+			warm[i].codec->close();
+			warm[i].codec = NULL;
+		}
+	}
+}
+
+static void _codec_report(void) {
+	int i, j;
+
+	for (i = 0; i < MAX_CODECS; i++) {
+		const char *state = "";
+
+		if (!codecs[i]) continue;
+		if (codecs[i] == codec) state = " (active)";
+		for (j = 0; j < WARM_CODECS; j++) if (warm[j].codec == codecs[i]) state = " (warm)";
+
+		LOG_INFO("codec memory '%c': resident %d open %d peak %d%s", codecs[i]->id, codecs[i]->mem.resident,
+				 codecs[i]->mem.open, codecs[i]->mem.peak, state);
+	}
+}
+
+void stage_load(struct stageload *load, u32_t us, frames_t frames, unsigned rate) {
+	if (load->rate != rate) {
+		load->busy_us = load->frames = 0;
+		load->rate = rate;
+	}
+
+	load->busy_us += us;
+	load->frames += frames;
+
+	if (!rate || load->frames < (u64_t) rate * LOAD_REPORT_SECS) return;
+
+	// busy time over audio duration
+	load->percent = load->busy_us * rate / (load->frames * 10000);
+	LOG_INFO("%s load: %u%% of real time at %u Hz", load->name, load->percent, rate);
+
+	load->busy_us = load->frames = 0;
+}
+
 static void *decode_thread() {
 	
 	while (running) {
@@ -78,13 +195,25 @@ static void *decode_thread() {
 				min_space = codec->min_space;
 			);
 			IF_PROCESS(
-				min_space = process.max_out_frames * BYTES_PER_FRAME;
+				min_space = process_min_space();
 			);
 
 			if (space > min_space && (bytes > codec->min_read_bytes || toend)) {
+				// only this thread moves writep while decode mutex is held
+				u8_t *writep = outputbuf->writep;
+				u64_t start = gettime_us();
+				frames_t frames;
 				
 				decode.state = codec->decode();
 
+				IF_DIRECT(
+					frames = (outputbuf->writep + outputbuf->size - writep) % outputbuf->size / BYTES_PER_FRAME;
+				);
+				IF_PROCESS(
+					frames = process.in_frames;
+				);
+				stage_load(&decode.load, gettime_us() - start, frames, decode_rate);
+
 				IF_PROCESS(
 					if (process.in_frames) {
 						process_samples();
@@ -96,6 +225,9 @@ static void *decode_thread() {
 				);
 
 				if (decode.state != DECODE_RUNNING) {
+					// working set, sampled once per track as walking the heap is not free (other tasks make it approximate)
+					int used = heap_mark - CODEC_HEAP_FREE();
+					if (used > codec->mem.peak) codec->mem.peak = used;
 
 					LOG_INFO("decode %s", decode.state == DECODE_COMPLETE ? "complete" : "error");
 
@@ -109,6 +241,8 @@ static void *decode_thread() {
 				ran = true;
 			}
 		}
+
+		if (!ran) _codec_expire(false);
 		
 		UNLOCK_D;
 
@@ -125,6 +259,10 @@ static void sort_codecs(int pry, struct codec* ptr) {
 	int i, tpry;
 	struct codec* tptr;
 
+	// codec has just been registered, so what it took since previous one is its resident memory
+	if (ptr) ptr->mem.resident = heap_mark - CODEC_HEAP_FREE();
+	heap_mark = CODEC_HEAP_FREE();
+
 	for (i = 0; i < MAX_CODECS; i++) {
 		if (!codecs[i]) {
 			codecs[i] = ptr;
@@ -155,10 +293,14 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 	// register codecs
 	// dsf,dff,alc,wma,wmap,wmal,aac,spt,ogg,ogf,flc,aif,pcm,mp3
 	i = 0;
+	heap_mark = CODEC_HEAP_FREE();
 
 #if DSD
 	if (!strstr(exclude_codecs, "dsd")	&& (!include_codecs || (order_codecs = strstr(include_codecs, "dsd"))))
 		sort_codecs((include_codecs ? order_codecs - include_codecs : i), register_dsd());
+#else
+	if (!strstr(exclude_codecs, "dsd")	&& (!include_codecs || (order_codecs = strstr(include_codecs, "dsd"))))
+		sort_codecs((include_codecs ? order_codecs - include_codecs : i), register_dsd2pcm());
 #endif
 #if FFMPEG
 	if (!strstr(exclude_codecs, "alac") && (!include_codecs || (order_codecs = strstr(include_codecs, "alac"))))
@@ -222,6 +364,7 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 
 	decode.new_stream = true;
 	decode.state = DECODE_STOPPED;
+	decode.load.name = "decode";
 
 	MAY_PROCESS(
 		decode.direct = true;
@@ -236,11 +379,15 @@ void decode_close(void) {
 		codec->close();
 		codec = NULL;
 	}
+	_codec_expire(true);
 	running = false;
 	UNLOCK_D;
 #if LINUX || OSX || FREEBSD || EMBEDDED
 	pthread_join(thread, NULL);
 #endif
+	MAY_PROCESS(
+		process_close();
+	);
 	mutex_destroy(decode.mutex);
 #if EMBEDDED	
 	deregister_external();
@@ -262,6 +409,8 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 	// called with O locked to get sample rate for potentially processed output stream
 	// release O mutex during process_newstream as it can take some time
 
+	decode_rate = sample_rate;
+
 	MAY_PROCESS(
 		if (decode.process) {
 			UNLOCK_O;
@@ -292,14 +441,22 @@ void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels,
 
 		if (codecs[i] && codecs[i]->id == format) {
 
-			if (codec && codec != codecs[i]) {
-				LOG_INFO("closing codec: '%c'", codec->id);
-				codec->close();
-			}
+			bool kept = codec == codecs[i], changed = codec != codecs[i];
+			u64_t start;
+
+			if (codec && changed) _codec_park(codec);
+			kept |= _codec_unpark(codecs[i]);
 			
 			codec = codecs[i];
 			
+			// a warm codec already holds its memory so only a cold open is measured
+			start = gettime_us();
+			heap_mark = CODEC_HEAP_FREE();
 			codec->open(sample_size, sample_rate, channels, endianness);
+			if (!kept) codec->mem.open = heap_mark - CODEC_HEAP_FREE();
+			LOG_INFO("codec '%c' opened %s in %u us", codec->id, kept ? "warm" : "cold", (u32_t) (gettime_us() - start));
+
+			if (changed) _codec_report();
 
 			decode.state = DECODE_READY;
 
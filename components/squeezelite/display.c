@@ -16,6 +16,7 @@
 #include "gds_text.h"
 #include "gds_draw.h"
 #include "gds_image.h"
+#include "accessors.h"
 
 #pragma pack(push, 1)
 
@@ -183,7 +184,7 @@ static EXT_RAM_ATTR struct {
 	int n, col, row, height, width, border, style, max;
 	enum { VISU_BLANK, VISU_VUMETER, VISU_SPECTRUM, VISU_WAVEFORM } mode;
 	int speed, wake;	
-	float fft[FFT_LEN*2], samples[FFT_LEN*2], hanning[FFT_LEN];
+	float samples[FFT_LEN*2], hanning[FFT_LEN];
 	struct {
 		u8_t *frame;
 		int width;
@@ -308,12 +309,15 @@ bool sb_display_init(void) {
 	visu.bar_gap = 1;
 	visu.speed = 100;
 	visu.back.frame = calloc(1, (displayer.width * displayer.height) / 8);
-	dsps_fft2r_init_fc32(visu.fft, FFT_LEN);
+	// FFT table is shared with convolver, so it must be of the largest size
+	dsps_fft2r_init_fc32(NULL, CONFIG_DSP_MAX_FFT_SIZE);
 	dsps_wind_hann_f32(visu.hanning, FFT_LEN);
 		
 	// create scroll management task
 	displayer.mutex = xSemaphoreCreateMutex();
-	displayer.task = xTaskCreateStatic( (TaskFunction_t) displayer_task, "displayer_thread", SCROLL_STACK_SIZE, NULL, ESP_TASK_PRIO_MIN + 1, xStack, &xTaskBuffer);
+	task_config_t task;
+	config_task_get(&task, "displayer", tskNO_AFFINITY, ESP_TASK_PRIO_MIN + 1, SCROLL_STACK_SIZE);
+	displayer.task = xTaskCreateStaticPinnedToCore( (TaskFunction_t) displayer_task, "displayer_thread", SCROLL_STACK_SIZE, NULL, task.priority, xStack, &xTaskBuffer, task.core);
 	
 	// size scroller (width + current screen)
 	scroller.scroll.max = (displayer.width * displayer.height / 8) * (15 + 1);
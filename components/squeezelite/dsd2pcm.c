@@ -0,0 +1,466 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// dsf and dff files converted to pcm when native dsd output (DSD) is not built
+
+#include "squeezelite.h"
+
+#if !DSD
+
+#include <math.h>
+
+/*
+ Decimation is done in fixed point in 3 steps:
+ - a 96 taps FIR over 1 bit samples, evaluated per dsd byte with one lookup table per byte position, which
+   decimates by 8 (DSD64 gives 352.8 kHz)
+ - 2 or 3 halfband filters, each decimating by 2 and where only the center and odd taps are not zero
+ So DSD64 gives 88.2 kHz and DSD128 gives 176.4 kHz, or 88.2 kHz when the output can't do it. Samples are
+ Q28 where 1.0 is the full dsd modulation, which is mapped to pcm full scale
+*/
+
+#define FIR_BYTES	12
+#define FIR_CUTOFF	0.04	// relative to dsd rate, i.e. 113 kHz at DSD64
+#define HB_TAPS		23
+#define HB_CENTER	(HB_TAPS / 2)
+#define HB_PAIRS	((HB_CENTER + 1) / 2)
+#define HB_STAGES	3
+#define DSD_SILENCE	0x69
+
+#define BENCH_SECS	10
+
+#if BYTES_PER_FRAME == 4
+#define PACK(n) 	((n) >> 13 > 32767 ? 32767 : ((n) >> 13 < -32768 ? -32768 : (n) >> 13))
+#else
+#define PACK(n) 	((n) > 0x0fffffff ? 0x7fffffff : ((n) < -0x10000000 ? -0x7fffffff - 1 : (n) << 3))
+#endif
+
+struct halfband {
+	s32_t x[2 * HB_TAPS];
+	unsigned pos;
+	bool odd;
+};
+
+struct channel {
+	u8_t fir[2 * FIR_BYTES];
+	unsigned pos;
+	struct halfband hb[HB_STAGES];
+};
+
+struct dsd {
+	s32_t (*table)[256];
+	s32_t hb_center, hb_coef[HB_PAIRS];
+	struct channel chan[2];
+	enum { HEADER = 0, DSF, DFF } format;
+	unsigned channels, stages;
+	u32_t rate, block, offset;
+	bool lsb_first, audio;
+	u64_t left, consume;
+	// time spent decimating vs audio produced
+	u64_t bench_us;
+	u32_t bench_frames;
+};
+
+static struct dsd *d;
+
+extern log_level loglevel;
+
+extern struct buffer *streambuf;
+extern struct buffer *outputbuf;
+extern struct streamstate stream;
+extern struct outputstate output;
+extern struct decodestate decode;
+extern struct processstate process;
+
+#define LOCK_S   mutex_lock(streambuf->mutex)
+#define UNLOCK_S mutex_unlock(streambuf->mutex)
+#define LOCK_O   mutex_lock(outputbuf->mutex)
+#define UNLOCK_O mutex_unlock(outputbuf->mutex)
+#if PROCESS
+#define LOCK_O_direct   if (decode.direct) mutex_lock(outputbuf->mutex)
+#define UNLOCK_O_direct if (decode.direct) mutex_unlock(outputbuf->mutex)
+#define IF_DIRECT(x)    if (decode.direct) { x }
+#define IF_PROCESS(x)   if (!decode.direct) { x }
+#else
+#define LOCK_O_direct   mutex_lock(outputbuf->mutex)
+#define UNLOCK_O_direct mutex_unlock(outputbuf->mutex)
+#define IF_DIRECT(x)    { x }
+#define IF_PROCESS(x)
+#endif
+
+#define LE32(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (u32_t) (p)[3] << 24)
+#define LE64(p) (LE32(p) | (u64_t) LE32((p) + 4) << 32)
+#define BE32(p) ((u32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+#define BE64(p) ((u64_t) BE32(p) << 32 | BE32((p) + 4))
+
+static double _blackman(int n, int len) {
+	return 0.42 - 0.5 * cos(2 * M_PI * n / (len - 1)) + 0.08 * cos(4 * M_PI * n / (len - 1));
+}
+
+static double _sinc(double x) {
+	return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+}
+
+// first stage table depends on bit order, bit j of byte position p is tap 8 * p + j with tap 0 the newest
+static void _build_table(bool lsb_first) {
+	double h[FIR_BYTES * 8], sum = 0;
+	int n, p, b, j;
+
+	for (n = 0; n < FIR_BYTES * 8; n++) {
+		h[n] = _sinc(2 * FIR_CUTOFF * (n - (FIR_BYTES * 8 - 1) / 2.0)) * _blackman(n, FIR_BYTES * 8);
+		sum += h[n];
+	}
+
+	for (p = 0; p < FIR_BYTES; p++) {
+		for (b = 0; b < 256; b++) {
+			double acc = 0;
+			for (j = 0; j < 8; j++) {
+				int bit = lsb_first ? (b >> (7 - j)) & 1 : (b >> j) & 1;
+				acc += bit ? h[8 * p + j] : -h[8 * p + j];
+			}
+			d->table[p][b] = lrint(acc / sum * (1 << 28));
+		}
+	}
+}
+
+static void _build_halfband(void) {
+	double h[HB_TAPS], sum = 0;
+	int n;
+
+	for (n = 0; n < HB_TAPS; n++) {
+		h[n] = _sinc((n - HB_CENTER) / 2.0) * _blackman(n, HB_TAPS);
+		sum += h[n];
+	}
+
+	d->hb_center = lrint(h[HB_CENTER] / sum * (1 << 30));
+	for (n = 0; n < HB_PAIRS; n++) {
+		d->hb_coef[n] = lrint(h[HB_CENTER - 1 - 2 * n] / sum * (1 << 30));
+	}
+}
+
+static void _reset(void) {
+	int c;
+
+	// start from dsd silence so that there is no initial thump
+	memset(d->chan, 0, sizeof(d->chan));
+	for (c = 0; c < 2; c++) {
+		memset(d->chan[c].fir, DSD_SILENCE, sizeof(d->chan[c].fir));
+	}
+}
+
+static inline bool _halfband(struct halfband *h, s32_t *sample) {
+	s32_t *x;
+	s64_t acc;
+	int k;
+
+	h->x[h->pos] = h->x[h->pos + HB_TAPS] = *sample;
+	x = h->x + h->pos + HB_TAPS;
+	if (++h->pos == HB_TAPS) h->pos = 0;
+
+	if ((h->odd = !h->odd)) return false;
+
+	acc = (s64_t) d->hb_center * x[-HB_CENTER];
+	for (k = 0; k < HB_PAIRS; k++) {
+		acc += (s64_t) d->hb_coef[k] * ((s64_t) x[-(HB_CENTER - 1 - 2 * k)] + x[-(HB_CENTER + 1 + 2 * k)]);
+	}
+
+	*sample = acc >> 30;
+	return true;
+}
+
+// decimate bytes of one channel (stride apart) to every other sample of out, returns frames written
+static frames_t _decimate(struct channel *c, u8_t *in, int stride, size_t bytes, ISAMPLE_T *out) {
+	frames_t frames = 0;
+
+	while (bytes--) {
+		s32_t sample = 0;
+		u8_t *hist;
+		int p;
+		unsigned s;
+
+		c->fir[c->pos] = c->fir[c->pos + FIR_BYTES] = *in;
+		hist = c->fir + c->pos + FIR_BYTES;
+		if (++c->pos == FIR_BYTES) c->pos = 0;
+		in += stride;
+
+		for (p = 0; p < FIR_BYTES; p++) {
+			sample += d->table[p][hist[-p]];
+		}
+
+		for (s = 0; s < d->stages && _halfband(c->hb + s, &sample); s++);
+
+		if (s == d->stages) {
+			*out = PACK(sample);
+			out += 2;
+			frames++;
+		}
+	}
+
+	return frames;
+}
+
+// walk dsf or dff chunks up to audio, 1 when audio is reached, 0 for more, -1 on error
+static int _read_header(void) {
+	while (true) {
+		size_t bytes = _buf_read_window(streambuf, 64);
+		u8_t *ptr = streambuf->readp;
+		u64_t len;
+
+		if (d->consume) {
+			u32_t consume = min(d->consume, min(_buf_used(streambuf), _buf_cont_read(streambuf)));
+			if (!consume) return 0;
+			_buf_inc_readp(streambuf, consume);
+			d->consume -= consume;
+			continue;
+		}
+
+		if (bytes < 16) return 0;
+
+		if (d->format == HEADER) {
+			if (!memcmp(ptr, "DSD ", 4)) {
+				d->format = DSF;
+			} else if (!memcmp(ptr, "FRM8", 4) && !memcmp(ptr + 12, "DSD ", 4)) {
+				d->format = DFF;
+				_buf_inc_readp(streambuf, 16);
+				continue;
+			} else {
+				LOG_WARN("not a dsf or dff file");
+				return -1;
+			}
+		}
+
+		if (d->format == DSF) {
+			len = LE64(ptr + 4);
+			if (!memcmp(ptr, "fmt ", 4)) {
+				if (bytes < 52) return 0;
+				d->channels = LE32(ptr + 24);
+				d->rate = LE32(ptr + 28);
+				d->lsb_first = LE32(ptr + 32) == 1;
+				d->left = LE64(ptr + 36) / 8;
+				d->block = LE32(ptr + 44);
+			} else if (!memcmp(ptr, "data", 4)) {
+				_buf_inc_readp(streambuf, 12);
+				return 1;
+			}
+		} else {
+			len = BE64(ptr + 4);
+			if (!memcmp(ptr, "PROP", 4)) {
+				// property chunk contains the chunks we want
+				_buf_inc_readp(streambuf, 16);
+				continue;
+			} else if (!memcmp(ptr, "FS  ", 4)) {
+				d->rate = BE32(ptr + 12);
+			} else if (!memcmp(ptr, "CHNL", 4)) {
+				d->channels = ptr[12] << 8 | ptr[13];
+			} else if (!memcmp(ptr, "CMPR", 4) && memcmp(ptr + 12, "DSD ", 4)) {
+				LOG_WARN("compressed (dst) dff not supported");
+				return -1;
+			} else if (!memcmp(ptr, "DSD ", 4)) {
+				d->left = len / (d->channels ? d->channels : 1);
+				d->lsb_first = false;
+				_buf_inc_readp(streambuf, 12);
+				return 1;
+			}
+			len += 12 + (len & 1);
+		}
+
+		LOG_DEBUG("skipping chunk %.4s len: " FMT_u64, ptr, len);
+		d->consume = len;
+	}
+}
+
+static bool _supported(u32_t rate) {
+	int i;
+	for (i = 0; i < MAX_SUPPORTED_SAMPLERATES && output.supported_rates[i]; i++) {
+		if (output.supported_rates[i] == rate) return true;
+	}
+	return false;
+}
+
+static decode_state dsd_decode(void) {
+	size_t bytes, window;
+	frames_t space, frames;
+	ISAMPLE_T *optr;
+	u8_t *iptr;
+	int stride, c;
+	u64_t start;
+
+	LOCK_S;
+
+	if (!d->audio) {
+		int found = _read_header();
+
+		if (found == 0) {
+			bool eos = stream.state <= DISCONNECT;
+			UNLOCK_S;
+			return eos ? DECODE_COMPLETE : DECODE_RUNNING;
+		}
+
+		if (found < 0 || !d->table || d->channels < 1 || d->channels > 2 || (d->format == DSF && !d->block) ||
+			(d->rate != 2822400 && d->rate != 5644800)) {
+			LOG_WARN("unsupported dsd: rate %u channels %u", d->rate, d->channels);
+			UNLOCK_S;
+			return DECODE_ERROR;
+		}
+
+		// stay at most at 176.4 kHz and step down to 88.2 kHz when output can't do it
+		for (d->stages = 2; d->stages < HB_STAGES && !_supported(d->rate / (8 << d->stages)); d->stages++);
+
+		_build_table(d->lsb_first);
+		_reset();
+		d->audio = true;
+
+		LOG_INFO("%s: rate %u channels %u -> %u Hz", d->format == DSF ? "dsf" : "dff", d->rate, d->channels,
+				 d->rate / (8 << d->stages));
+
+		LOCK_O;
+		LOG_INFO("setting track_start");
+		output.next_sample_rate = decode_newstream(d->rate / (8 << d->stages), output.supported_rates);
+		output.track_start = outputbuf->writep;
+		if (output.fade_mode) _checkfade(true);
+		decode.new_stream = false;
+		UNLOCK_O;
+	}
+
+	// dsf is interleaved by blocks (all of them needed), dff by byte
+	if (d->format == DSF) {
+		window = _buf_read_window(streambuf, d->block * d->channels);
+		bytes = window == d->block * d->channels ? d->block - d->offset : 0;
+		stride = 1;
+	} else {
+		// a byte per channel straddling the wrap would stall us, so unwrap it first
+		_buf_read_window(streambuf, d->channels);
+		window = min(_buf_used(streambuf), _buf_cont_read(streambuf));
+		bytes = window / d->channels;
+		stride = d->channels;
+	}
+
+	bytes = min(bytes, d->left);
+
+	if (!bytes && (!d->left || stream.state <= DISCONNECT)) {
+		UNLOCK_S;
+		LOG_INFO("end of stream, decimation %u us per second", d->bench_frames ? (u32_t) (d->bench_us * (d->rate / (8 << d->stages)) / d->bench_frames) : 0);
+		return DECODE_COMPLETE;
+	}
+
+	UNLOCK_S;
+
+	LOCK_O_direct;
+	IF_DIRECT(
+		space = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+		optr = (ISAMPLE_T *) outputbuf->writep;
+	);
+	UNLOCK_O_direct;
+	IF_PROCESS(
+		space = process.max_in_frames;
+		optr = (ISAMPLE_T *) process.inbuf;
+	);
+
+	// a frame takes 2^stages bytes of each channel, so this can't overflow output
+	bytes = min(bytes, (size_t) space << d->stages);
+
+	// iptr is not touched by other threads while we hold the decode mutex
+	iptr = streambuf->readp + d->offset;
+	start = gettime_us();
+
+	for (frames = 0, c = 0; c < 2; c++) {
+		if (c < d->channels) {
+			frames = _decimate(d->chan + c, iptr + c * (d->format == DSF ? d->block : 1), stride, bytes, optr + c);
+		} else {
+			frames_t i;
+			for (i = 0; i < frames; i++) optr[2 * i + 1] = optr[2 * i];
+		}
+	}
+
+	d->bench_us += gettime_us() - start;
+	d->bench_frames += frames;
+	if (d->bench_frames >= BENCH_SECS * (d->rate / (8 << d->stages))) {
+		LOG_INFO("decimation %u us per second of audio", (u32_t) (d->bench_us / BENCH_SECS));
+		d->bench_us = 0;
+		d->bench_frames = 0;
+	}
+
+	LOCK_S;
+	d->left -= bytes;
+	if (d->format == DSF) {
+		d->offset += bytes;
+		if (d->offset == d->block || !d->left) {
+			_buf_inc_readp(streambuf, d->block * d->channels);
+			d->offset = 0;
+		}
+	} else {
+		_buf_inc_readp(streambuf, bytes * d->channels);
+	}
+	UNLOCK_S;
+
+	LOCK_O_direct;
+	IF_DIRECT(
+		_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
+	);
+	UNLOCK_O_direct;
+	IF_PROCESS(
+		process.in_frames = frames;
+	);
+
+	LOG_SDEBUG("wrote %u frames", frames);
+
+	return DECODE_RUNNING;
+}
+
+static void dsd_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
+	if (!d->table) d->table = malloc(FIR_BYTES * 256 * sizeof(s32_t));
+	d->format = HEADER;
+	d->audio = false;
+	d->consume = d->left = 0;
+	d->offset = 0;
+	d->channels = d->rate = d->block = 0;
+	d->bench_us = 0;
+	d->bench_frames = 0;
+}
+
+static void dsd_close(void) {
+	free(d->table);
+	d->table = NULL;
+}
+
+struct codec *register_dsd2pcm(void) {
+	static struct codec ret = {
+		'd',          	// id
+		"dsf,dff",     	// types
+		16384,        	// min read (at least one dsf block per channel)
+		16384,        	// min space
+		dsd_open,     	// open
+		dsd_close,    	// close
+		dsd_decode,   	// decode
+		false,        	// keep warm
+	};
+
+	d = calloc(1, sizeof(struct dsd));
+	if (!d) {
+		return NULL;
+	}
+
+	_build_halfband();
+
+	LOG_INFO("using dsd to pcm to decode dsf,dff");
+	return &ret;
+}
+
+#endif
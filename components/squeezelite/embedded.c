@@ -15,9 +15,12 @@
 #include "esp_timer.h"
 #include "esp_wifi.h"
 #include "monitor.h"
+#include "accessors.h"
 
 mutex_type slimp_mutex;
 
+extern struct outputstate output;
+
 void get_mac(u8_t mac[]) {
     esp_read_mac(mac, ESP_MAC_WIFI_STA);
 }
@@ -32,17 +35,52 @@ void *audio_calloc(size_t nmemb, size_t size) {
 
 int	pthread_create_name(pthread_t *thread, _CONST pthread_attr_t  *attr, 
 				   void *(*start_routine)( void * ), void *arg, char *name) {
+	return pthread_create_pinned(thread, attr, start_routine, arg, name, esp_pthread_get_default_config().pin_to_core);
+}
+
+// core, priority and stack can be overridden per thread name with "task_config"
+int	pthread_create_pinned(pthread_t *thread, _CONST pthread_attr_t  *attr, 
+				   void *(*start_routine)( void * ), void *arg, char *name, int core) {
 	esp_pthread_cfg_t cfg = esp_pthread_get_default_config(); 
+	size_t stack_size = cfg.stack_size;
+	int detach = PTHREAD_CREATE_JOINABLE;
+	task_config_t task;
+	pthread_attr_t task_attr;
+	int ret;
+	
+	if (attr) {
+		pthread_attr_getstacksize(attr, &stack_size);
+		pthread_attr_getdetachstate(attr, &detach);
+	}	
+	config_task_get(&task, name, core, cfg.prio, stack_size);
+	
 	cfg.thread_name = name; 
 	cfg.inherit_cfg = true; 
+	cfg.pin_to_core = task.core;
+	cfg.prio = task.priority;
 	esp_pthread_set_cfg(&cfg); 
-	return pthread_create(thread, attr, start_routine, arg);
+	
+	pthread_attr_init(&task_attr);
+	pthread_attr_setstacksize(&task_attr, task.stack_size);
+	// esp-idf only supports stack size and detach state
+	pthread_attr_setdetachstate(&task_attr, detach);
+	ret = pthread_create(thread, &task_attr, start_routine, arg);
+	pthread_attr_destroy(&task_attr);
+	
+	// don't pin next threads created by caller
+	cfg = esp_pthread_get_default_config();
+	esp_pthread_set_cfg(&cfg);
+	return ret;
 }
 
 uint32_t _gettime_ms_(void) {
 	return (uint32_t) (esp_timer_get_time() / 1000);
 }
 
+uint64_t _gettime_us_(void) {
+	return (uint64_t) esp_timer_get_time();
+}
+
 extern void sb_controls_init(void);
 extern bool sb_display_init(void);
 
@@ -54,6 +92,25 @@ void embedded_init(void) {
 	if (sb_display_init()) custom_player_id = 100;
 }
 
+// console entry point, player stops playing and stream is discarded
+int stream_bench_run(const char *url, unsigned seconds) {
+	struct stream_bench result;
+	
+	// flushing would cut what is playing
+	if (output.state > OUTPUT_STOPPED || output.external) {
+		fprintf(stderr, "player is busy, stop playback first\n");
+		return 1;
+	}
+	
+	decode_flush();
+	output_flush();
+	
+	if (!stream_bench(url, seconds, &result)) return 1;
+	stream_bench_report(&result);
+	
+	return 0;
+}
+
 u16_t get_RSSI(void) {
     wifi_ap_record_t wifidata;
     esp_wifi_sta_get_ap_info(&wifidata);
@@ -2,10 +2,12 @@
 #define EMBEDDED_H
 
 #include <inttypes.h>
+#include "esp_heap_caps.h"
 
 /* 	must provide 
 		- mutex_create_p
 		- pthread_create_name
+		- pthread_create_pinned
 		- register_xxx (see below)
 		- stack size
 		- s16_t, s32_t, s64_t and u64_t
@@ -15,6 +17,9 @@
 		- gettime_ms
 		- BASE_CAP
 		- EXT_BSS 		
+		- CODEC_LOW_MEMORY
+		- CODEC_HEAP_FREE
+		- CODEC_KEEP_WARM
 	recommended to add platform specific include(s) here
 */	
 
@@ -31,6 +36,10 @@ typedef unsigned long long u64_t;
 #define DECODE_THREAD_STACK_SIZE 16 * 1024
 #define OUTPUT_THREAD_STACK_SIZE  6 * 1024
 #define IR_THREAD_STACK_SIZE      6 * 1024
+#define PROCESS_THREAD_STACK_SIZE 4 * 1024
+
+// pthreads default to core 1 (decode and output), so processing goes on the other one
+#define PROCESS_THREAD_CORE	0
 
 // number of 5s times search for a server will happen beforee slimproto exits (0 = no limit)
 #define MAX_SERVER_RETRIES	5
@@ -46,12 +55,21 @@ extern u8_t custom_player_id;
 // all exit() calls are made from main thread (or a function called in main thread)
 #define exit(code) { int ret = code; pthread_exit(&ret); }
 #define gettime_ms _gettime_ms_
+#define gettime_us _gettime_us_
 #define mutex_create_p(m) mutex_create(m)
+// release warm codecs when internal memory runs low
+#define CODEC_LOW_MEMORY() (heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < 32 * 1024)
+// measure codecs memory and only keep them warm when there is PSRAM
+#define CODEC_HEAP_FREE() ((int) heap_caps_get_free_size(MALLOC_CAP_8BIT))
+#define CODEC_KEEP_WARM() (heap_caps_get_free_size(MALLOC_CAP_SPIRAM) > 0)
 
 uint32_t 	_gettime_ms_(void);
+u64_t		_gettime_us_(void);
 
 int			pthread_create_name(pthread_t *thread, _CONST pthread_attr_t  *attr, 
 				   void *(*start_routine)( void * ), void *arg, char *name);
+int			pthread_create_pinned(pthread_t *thread, _CONST pthread_attr_t  *attr, 
+				   void *(*start_routine)( void * ), void *arg, char *name, int core);
 
 // must provide	of #define as empty macros		
 void		embedded_init(void);
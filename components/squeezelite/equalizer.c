@@ -8,6 +8,7 @@
  *
  */
  
+#include <math.h>
 #include "squeezelite.h" 
 #include "equalizer.h"
 #include "esp_equalizer.h"
@@ -19,8 +20,9 @@ static log_level loglevel = lINFO;
 static struct {
 	void *handle;
 	float gain[EQ_BANDS];
+	s32_t headroom;
 	bool update;
-} equalizer = { .update = true };
+} equalizer = { .update = true, .headroom = FIXED_ONE };
  
 /****************************************************************************************
  * open equalizer
@@ -38,15 +40,18 @@ void equalizer_open(u32_t sample_rate) {
 	    
 	if (equalizer.handle) {
 		bool active = false;
+		float boost = 0;
 		
 		for (int i = 0; i < EQ_BANDS; i++) {
 			esp_equalizer_set_band_value(equalizer.handle, equalizer.gain[i], i, 0);
 			esp_equalizer_set_band_value(equalizer.handle, equalizer.gain[i], i, 1);
 			active |= equalizer.gain[i] != 0;
+			if (equalizer.gain[i] > boost) boost = equalizer.gain[i];
 		}
 		
 		// do not activate equalizer if all gain are 0
 		if (!active) equalizer_close();
+		else equalizer.headroom = to_gain(powf(10, boost / 20));
 		
 		LOG_INFO("equalizer initialized %u", active);
 	} else {
@@ -58,6 +63,7 @@ void equalizer_open(u32_t sample_rate) {
  * close equalizer
  */
 void equalizer_close(void) {
+	equalizer.headroom = FIXED_ONE;
 	if (equalizer.handle) {
 		esp_equalizer_uninit(equalizer.handle);
 		equalizer.handle = NULL;
@@ -72,6 +78,13 @@ void equalizer_update(s8_t *gain) {
 	equalizer.update = true;
 }
 
+/****************************************************************************************
+ * linear gain of the most boosted band, to be taken away before equalizer
+ */
+s32_t equalizer_headroom(void) {
+	return equalizer.headroom;
+}
+
 /****************************************************************************************
  * process equalizer 
  */
@@ -37,6 +37,10 @@
 struct flac {
 	FLAC__StreamDecoder *decoder;
 	u8_t container;
+	// ogg-flac packets being fed to decoder
+	struct ogg ogg;
+	u8_t *packet;
+	u32_t left;
 #if !LINKALL
 	// FLAC symbols to be dynamically loaded
 	const char **FLAC__StreamDecoderErrorStatusString;
@@ -56,18 +60,6 @@ struct flac {
 		FLAC__StreamDecoderErrorCallback error_callback,
 		void *client_data
 	);
-	FLAC__StreamDecoderInitStatus (* FLAC__stream_decoder_init_ogg_stream)(
-		FLAC__StreamDecoder *decoder,
-		FLAC__StreamDecoderReadCallback read_callback,
-		FLAC__StreamDecoderSeekCallback seek_callback,
-		FLAC__StreamDecoderTellCallback tell_callback,
-		FLAC__StreamDecoderLengthCallback length_callback,
-		FLAC__StreamDecoderEofCallback eof_callback,
-		FLAC__StreamDecoderWriteCallback write_callback,
-		FLAC__StreamDecoderMetadataCallback metadata_callback,
-		FLAC__StreamDecoderErrorCallback error_callback,
-		void *client_data
-	);
 	FLAC__bool (* FLAC__stream_decoder_process_single)(FLAC__StreamDecoder *decoder);
 	FLAC__StreamDecoderState (* FLAC__stream_decoder_get_state)(const FLAC__StreamDecoder *decoder);
 #endif
@@ -108,17 +100,61 @@ extern struct processstate process;
 #define FLAC_A(h, a)     (h)->FLAC__ ## a
 #endif
 
+static bool _probe(u8_t *packet, u32_t len) {
+	return len >= 13 && packet[0] == 0x7f && !memcmp(packet + 1, "FLAC", 4);
+}
+
+// ogg-flac packets are the native stream once the mapping header (0x7f "FLAC" version count) is removed
+static size_t _ogg_read(FLAC__byte *buffer, size_t want) {
+	size_t bytes = 0;
+
+	while (bytes < want) {
+		u32_t n;
+
+		if (!f->left) {
+			if (!_ogg_next_packet(&f->ogg, &f->packet, &f->left)) break;
+
+			if (f->ogg.chained) {
+				// headers of a chained stream are not fed again, frame headers are self sufficient
+				if (f->left > 4 && (f->packet[0] & 0x7f) == 4) {
+					_ogg_comments(f->packet + 4, f->left - 4);
+				}
+				if (f->packet[0] != 0xff) {
+					f->left = 0;
+					continue;
+				}
+				f->ogg.chained = false;
+				decode.new_stream = true;
+			} else if (f->ogg.packetno == 1) {
+				f->packet += 9;
+				f->left -= 9;
+			}
+		}
+
+		n = min(f->left, want - bytes);
+		memcpy(buffer + bytes, f->packet, n);
+		f->packet += n;
+		f->left -= n;
+		bytes += n;
+	}
+
+	return bytes;
+}
+
 static FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *want, void *client_data) {
 	size_t bytes;
 	bool end;
 
 	LOCK_S;
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	bytes = min(bytes, *want);
+	if (f->container == 'o') {
+		bytes = _ogg_read(buffer, *want);
+	} else {
+		bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
+		bytes = min(bytes, *want);
+		memcpy(buffer, streambuf->readp, bytes);
+		_buf_inc_readp(streambuf, bytes);
+	}
 	end = (stream.state <= DISCONNECT && bytes == 0);
-
-	memcpy(buffer, streambuf->readp, bytes);
-	_buf_inc_readp(streambuf, bytes);
 	UNLOCK_S;
 
 	*want = bytes;
@@ -236,6 +272,7 @@ static void error_cb(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErro
 static void flac_close(void) {
 	FLAC(f, stream_decoder_delete, f->decoder);
 	f->decoder = NULL;
+	ogg_close(&f->ogg);
 }
 
 static void flac_open(u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
@@ -252,11 +289,12 @@ static void flac_open(u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t en
 	}
 	
 	if ( f->container == 'o' ) {
-		LOG_INFO("ogg/flac container - using init_ogg_stream");
-		FLAC(f, stream_decoder_init_ogg_stream, f->decoder, &read_cb, NULL, NULL, NULL, NULL, &write_cb, NULL, &error_cb, NULL);
-	} else {
-		FLAC(f, stream_decoder_init_stream, f->decoder, &read_cb, NULL, NULL, NULL, NULL, &write_cb, NULL, &error_cb, NULL);
+		LOG_INFO("ogg/flac container - using ogg demuxer");
+		ogg_init(&f->ogg, _probe);
+		f->left = 0;
 	}
+
+	FLAC(f, stream_decoder_init_stream, f->decoder, &read_cb, NULL, NULL, NULL, NULL, &write_cb, NULL, &error_cb, NULL);
 }
 
 static decode_state flac_decode(void) {
@@ -292,7 +330,6 @@ static bool load_flac() {
 	f->FLAC__stream_decoder_reset = dlsym(handle, "FLAC__stream_decoder_reset");
 	f->FLAC__stream_decoder_delete = dlsym(handle, "FLAC__stream_decoder_delete");
 	f->FLAC__stream_decoder_init_stream = dlsym(handle, "FLAC__stream_decoder_init_stream");
-	f->FLAC__stream_decoder_init_ogg_stream = dlsym(handle, "FLAC__stream_decoder_init_ogg_stream");
 	f->FLAC__stream_decoder_process_single = dlsym(handle, "FLAC__stream_decoder_process_single");
 	f->FLAC__stream_decoder_get_state = dlsym(handle, "FLAC__stream_decoder_get_state");
 
@@ -316,15 +353,14 @@ struct codec *register_flac(void) {
 		flac_open,    // open
 		flac_close,   // close
 		flac_decode,  // decode
+		true,         // keep warm
 	};
 
-	f = malloc(sizeof(struct flac));
+	f = calloc(1, sizeof(struct flac));
 	if (!f) {
 		return NULL;
 	}
 
-	f->decoder = NULL;
-
 	if (!load_flac()) {
 		return NULL;
 	}
@@ -37,26 +37,15 @@
 
 static unsigned rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
 
-struct chunk_table {
-	u32_t sample, offset;
-};
-
 struct helixaac {
 	HAACDecoder hAac;
 	u8_t type;
 	u8_t *write_buf;
 	u8_t *wrap_buf;
-	// following used for mp4 only
-	u32_t consume;
-	u32_t pos;
-	u32_t sample;
-	u32_t nextchunk;
-	void *stsc;
-	u32_t skip;
-	u64_t samples;
-	u64_t sttssamples;
+	struct mp4 mp4;
 	bool  empty;
-	struct chunk_table *chunkinfo;
+	unsigned long samplerate;
+	unsigned char channels;
 #if !LINKALL
 #endif
 };
@@ -94,10 +83,8 @@ extern struct processstate process;
 #define HAAC(h, fn, ...) (h)->AAC##fn(__VA_ARGS__)
 #endif
 
-// minimal code for mp4 file parsing to extract audio config and find media data
-
 // adapted from faad2/common/mp4ff
-u32_t mp4_desc_length(u8_t **buf) {
+static u32_t mp4_desc_length(u8_t **buf) {
 	u8_t b;
 	u8_t num_bytes = 0;
 	u32_t length = 0;
@@ -112,220 +99,32 @@ u32_t mp4_desc_length(u8_t **buf) {
 	return length;
 }
 
-// read mp4 header to extract config data
-static int read_mp4_header(unsigned long *samplerate_p, unsigned char *channels_p) {
-	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	char type[5];
-	u32_t len;
-
-	while (bytes >= 8) {
-		// count trak to find the first playable one
-		static unsigned trak, play;
-		u32_t consume;
-
-		len = unpackN((u32_t *)streambuf->readp);
-		memcpy(type, streambuf->readp + 4, 4);
-		type[4] = '\0';
-
-		if (!strcmp(type, "moov")) {
-			trak = 0;
-			play = 0;
-		}
-		if (!strcmp(type, "trak")) {
-			trak++;
-		}
-
-		// extract audio config from within esds and pass to DecInit2
-		if (!strcmp(type, "esds") && bytes > len) {
-			u8_t *ptr = streambuf->readp + 12;
-			AACFrameInfo info;	
-			if (*ptr++ == 0x03) {
-				mp4_desc_length(&ptr);
-				ptr += 4;
-			} else {
-				ptr += 3;
-			}
-			mp4_desc_length(&ptr);
-			ptr += 13;
-			if (*ptr++ != 0x05) {
-				LOG_WARN("error parsing esds");
-				return -1;
-			}
-			mp4_desc_length(&ptr);
-			info.profile = *ptr >> 3;
-			info.sampRateCore = (*ptr++ & 0x07) << 1;
-			info.sampRateCore |= (*ptr >> 7) & 0x01;
-			info.sampRateCore = rates[info.sampRateCore];
-			info.nChans = (*ptr & 0x7f) >> 3;
-			*channels_p = info.nChans;
-			*samplerate_p = info.sampRateCore;
-			HAAC(a, SetRawBlockParams, a->hAac, 0, &info); 
-			LOG_DEBUG("playable aac track: %u (p:%x, r:%d, c:%d)", trak, info.profile, info.sampRateCore, info.nChans);
-			play = trak;
-		}
+// extract audio config from within esds and pass to DecInit2
+static bool esds_config(u8_t *box, u32_t len) {
+	u8_t *ptr = box + 12;
+	AACFrameInfo info;
 
-		// extract the total number of samples from stts
-		if (!strcmp(type, "stts") && bytes > len) {
-			u32_t i;
-			u8_t *ptr = streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			for (i = 0; i < entries; ++i) {
-				u32_t count = unpackN((u32_t *)ptr);
-				u32_t size = unpackN((u32_t *)(ptr + 4));
-				a->sttssamples += count * size;
-				ptr += 8;
-			}
-			LOG_DEBUG("total number of samples contained in stts: " FMT_u64, a->sttssamples);
-		}
-
-		// stash sample to chunk info, assume it comes before stco
-		if (!strcmp(type, "stsc") && bytes > len && !a->chunkinfo) {
-			a->stsc = malloc(len - 12);
-			if (a->stsc == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			memcpy(a->stsc, streambuf->readp + 12, len - 12);
-		}
-
-		// build offsets table from stco and stored stsc
-		if (!strcmp(type, "stco") && bytes > len && play == trak) {
-			u32_t i;
-			// extract chunk offsets
-			u8_t *ptr = streambuf->readp + 12;
-			u32_t entries = unpackN((u32_t *)ptr);
-			ptr += 4;
-			a->chunkinfo = malloc(sizeof(struct chunk_table) * (entries + 1));
-			if (a->chunkinfo == NULL) {
-				LOG_WARN("malloc fail");
-				return -1;
-			}
-			for (i = 0; i < entries; ++i) {
-				a->chunkinfo[i].offset = unpackN((u32_t *)ptr);
-				a->chunkinfo[i].sample = 0;
-				ptr += 4;
-			}
-			a->chunkinfo[i].sample = 0;
-			a->chunkinfo[i].offset = 0;
-			// fill in first sample id for each chunk from stored stsc
-			if (a->stsc) {
-				u32_t stsc_entries = unpackN((u32_t *)a->stsc);
-				u32_t sample = 0;
-				u32_t last = 0, last_samples = 0;
-				u8_t *ptr = (u8_t *)a->stsc + 4;
-				while (stsc_entries--) {
-					u32_t first = unpackN((u32_t *)ptr);
-					u32_t samples = unpackN((u32_t *)(ptr + 4));
-					if (last) {
-						for (i = last - 1; i < first - 1; ++i) {
-							a->chunkinfo[i].sample = sample;
-							sample += last_samples;
-						}
-					}
-					if (stsc_entries == 0) {
-						for (i = first - 1; i < entries; ++i) {
-							a->chunkinfo[i].sample = sample;
-							sample += samples;
-						}
-					}
-					last = first;
-					last_samples = samples;
-					ptr += 12;
-				}
-				free(a->stsc);
-				a->stsc = NULL;
-			}
-		}
-
-		// found media data, advance to start of first chunk and return
-		if (!strcmp(type, "mdat")) {
-			_buf_inc_readp(streambuf, 8);
-			a->pos += 8;
-			bytes  -= 8;
-			if (play) {
-				LOG_DEBUG("type: mdat len: %u pos: %u", len, a->pos);
-				if (a->chunkinfo && a->chunkinfo[0].offset > a->pos) {
-					u32_t skip = a->chunkinfo[0].offset - a->pos; 	
-					LOG_DEBUG("skipping: %u", skip);
-					if (skip <= bytes) {
-						_buf_inc_readp(streambuf, skip);
-						a->pos += skip;
-					} else {
-						a->consume = skip;
-					}
-				}
-				a->sample = a->nextchunk = 1;
-				return 1;
-			} else {
-				LOG_DEBUG("type: mdat len: %u, no playable track found", len);
-				return -1;
-			}
-		}
-
-		// parse key-value atoms within ilst ---- entries to get encoder padding within iTunSMPB entry for gapless
-		if (!strcmp(type, "----") && bytes > len) {
-			u8_t *ptr = streambuf->readp + 8;
-			u32_t remain = len - 8, size;
-			if (!memcmp(ptr + 4, "mean", 4) && (size = unpackN((u32_t *)ptr)) < remain) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "name", 4) && (size = unpackN((u32_t *)ptr)) < remain && !memcmp(ptr + 12, "iTunSMPB", 8)) {
-				ptr += size; remain -= size;
-			}
-			if (!memcmp(ptr + 4, "data", 4) && remain > 16 + 48) {
-				// data is stored as hex strings: 0 start end samples
-				u32_t b, c; u64_t d;
-				if (sscanf((const char *)(ptr + 16), "%x %x %x " FMT_x64, &b, &b, &c, &d) == 4) {
-					LOG_DEBUG("iTunSMPB start: %u end: %u samples: " FMT_u64, b, c, d);
-					if (a->sttssamples && a->sttssamples < b + c + d) {
-						LOG_DEBUG("reducing samples as stts count is less");
-						d = a->sttssamples - (b + c);
-					}
-					a->skip = b;
-					a->samples = d;
-				}
-			}
-		}
-
-		// default to consuming entire box
-		consume = len;
-
-		// read into these boxes so reduce consume
-		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl") ||
-			!strcmp(type, "udta") || !strcmp(type, "ilst")) {
-			consume = 8;
-		}
-		// special cases which mix mix data in the enclosing box which we want to read into
-		if (!strcmp(type, "stsd")) consume = 16;
-		if (!strcmp(type, "mp4a")) consume = 36;
-		if (!strcmp(type, "meta")) consume = 12;
-
-		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
-		if (bytes >= consume) {
-			LOG_DEBUG("type: %s len: %u consume: %u", type, len, consume);
-			_buf_inc_readp(streambuf, consume);
-			a->pos += consume;
-			bytes -= consume;
-		} else if ( !(!strcmp(type, "esds") || !strcmp(type, "stts") || !strcmp(type, "stsc") || 
-					 !strcmp(type, "stco") || !strcmp(type, "----")) ) {
-			LOG_DEBUG("type: %s len: %u consume: %u - partial consume: %u", type, len, consume, bytes);
-			_buf_inc_readp(streambuf, bytes);
-			a->pos += bytes;
-			a->consume = consume - bytes;
-			break;
-		} else if (len > streambuf->size) {
- 			// can't process an atom larger than streambuf!
-			LOG_ERROR("atom %s too large for buffer %u %u", type, len, streambuf->size);
-			return -1;
-		 } else {
-			 // make sure there is 'len' contiguous space
-			_buf_unwrap(streambuf, len); 
-			break;
-		 }
+	if (*ptr++ == 0x03) {
+		mp4_desc_length(&ptr);
+		ptr += 4;
+	} else {
+		ptr += 3;
 	}
+	mp4_desc_length(&ptr);
+	ptr += 13;
+	if (*ptr++ != 0x05) return false;
+	mp4_desc_length(&ptr);
+	info.profile = *ptr >> 3;
+	info.sampRateCore = (*ptr++ & 0x07) << 1;
+	info.sampRateCore |= (*ptr >> 7) & 0x01;
+	info.sampRateCore = rates[info.sampRateCore];
+	info.nChans = (*ptr & 0x7f) >> 3;
+	a->channels = info.nChans;
+	a->samplerate = info.sampRateCore;
+	HAAC(a, SetRawBlockParams, a->hAac, 0, &info);
+	LOG_DEBUG("aac config (p:%x, r:%d, c:%d)", info.profile, info.sampRateCore, info.nChans);
 
-	return 0;
+	return true;
 }
 
 static decode_state helixaac_decode(void) {
@@ -346,20 +145,13 @@ static decode_state helixaac_decode(void) {
 		return DECODE_COMPLETE;
 	}
 
-	if (a->consume) {
-		u32_t consume = min(a->consume, bytes_wrap);
-		LOG_DEBUG("consume: %u of %u", consume, a->consume);
-		_buf_inc_readp(streambuf, consume);
-		a->pos += consume;
-		a->consume -= consume;
+	if (_mp4_consume(&a->mp4)) {
 		UNLOCK_S;
 		return DECODE_RUNNING;
 	}
 
 	if (decode.new_stream) {
 		int found = 0;
-		static unsigned char channels;
-		static unsigned long samplerate;
 		
 		if (a->type == '2') {
 
@@ -374,8 +166,8 @@ static decode_state helixaac_decode(void) {
 				
 				if (!HAAC(a, Decode, a->hAac, &p, &bytes, (short*) a->write_buf)) {
 					HAAC(a, GetLastFrameInfo, a->hAac, &info);
-					channels = info.nChans;
-					samplerate = info.sampRateOut;
+					a->channels = info.nChans;
+					a->samplerate = info.sampRateOut;
 					found = 1;
 				} else if (n == 0) n++;
 					
@@ -391,19 +183,19 @@ static decode_state helixaac_decode(void) {
 		} else {
 
 			// mp4 - read header
-			found = read_mp4_header(&samplerate, &channels);
+			found = mp4_read_header(&a->mp4);
 		}
 
 		if (found == 1) {
 			LOCK_O;
-			output.next_sample_rate = decode_newstream(samplerate, output.supported_rates);
+			output.next_sample_rate = decode_newstream(a->samplerate, output.supported_rates);
 			IF_DSD( output.next_fmt = PCM; )
 			output.track_start = outputbuf->writep;
 			if (output.fade_mode) _checkfade(true);
 			decode.new_stream = false;
 			UNLOCK_O;
 			
-			LOG_INFO("setting track start, samplerate: %u channels: %u", samplerate, channels);
+			LOG_INFO("setting track start, samplerate: %u channels: %u", a->samplerate, a->channels);
 			
 			bytes_total = _buf_used(streambuf);
 			bytes_wrap  = min(bytes_total, _buf_cont_read(streambuf));
@@ -452,34 +244,8 @@ static decode_state helixaac_decode(void) {
 	HAAC(a, GetLastFrameInfo, a->hAac, &info);
 	iptr = (ISAMPLE_T *) a->write_buf;
 	bytes = bytes_wrap - bytes;
-	endstream = false;
-
-	if (a->chunkinfo && a->chunkinfo[a->nextchunk].offset && a->sample++ == a->chunkinfo[a->nextchunk].sample) {
-		// mp4 end of chunk - skip to next offset
-		if (a->chunkinfo[a->nextchunk].offset > a->pos) {
-			u32_t skip = a->chunkinfo[a->nextchunk].offset - a->pos;
-			if (skip != bytes) {
-				LOG_DEBUG("skipping to next chunk pos: %u consumed: %u != skip: %u", a->pos, bytes, skip);
-			}
-			if (bytes_total >= skip) {
-				_buf_inc_readp(streambuf, skip);
-				a->pos += skip;
-			} else {
-				a->consume = skip;
-			}
-			a->nextchunk++;
-		} else {
-			LOG_ERROR("error: need to skip backwards!");
-			endstream = true;
-		}
-	} else if (bytes > 0) {
-		// adts and mp4 when not at end of chunk 
-		_buf_inc_readp(streambuf, bytes);
-		a->pos += bytes;
-	} else {
-		// error which doesn't advance streambuf - end
-		endstream = true;
-	}
+	// adts and mp4 move to next frame, mp4 skips to next chunk if needed, error which doesn't advance streambuf is the end
+	endstream = bytes <= 0 || !_mp4_next_sample(&a->mp4, bytes);
 
 	UNLOCK_S;
 
@@ -495,26 +261,26 @@ static decode_state helixaac_decode(void) {
 	
 	frames = info.outputSamps / info.nChans;
 
-	if (a->skip) {
+	if (a->mp4.skip) {
 		u32_t skip;
 		if (a->empty) {
 			a->empty = false;
-			a->skip -= frames;
+			a->mp4.skip -= frames;
 			LOG_DEBUG("gapless: first frame empty, skipped %u frames at start", frames);
 		}
-		skip = min(frames, a->skip);
+		skip = min(frames, a->mp4.skip);
 		LOG_DEBUG("gapless: skipping %u frames at start", skip);
 		frames -= skip;
-		a->skip -= skip;
+		a->mp4.skip -= skip;
 		iptr += skip * info.nChans;
 	}
 
-	if (a->samples) {
-		if (a->samples < frames) {
-			LOG_DEBUG("gapless: trimming %u frames from end", frames - a->samples);
-			frames = (frames_t)a->samples;
+	if (a->mp4.samples) {
+		if (a->mp4.samples < frames) {
+			LOG_DEBUG("gapless: trimming %u frames from end", frames - a->mp4.samples);
+			frames = (frames_t)a->mp4.samples;
 		}
-		a->samples -= frames;
+		a->mp4.samples -= frames;
 	}
 
 	LOG_SDEBUG("write %u frames", frames);
@@ -577,22 +343,8 @@ static void helixaac_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	LOG_INFO("opening %s stream", size == '2' ? "adts" : "mp4");
 
 	a->type = size;
-	a->pos = a->consume = a->sample = a->nextchunk = 0;
-	
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-	}
-	
-	if (a->stsc) {
-		free(a->stsc);
-	}
-	
-	a->chunkinfo = NULL;
-	a->stsc = NULL;
-	a->skip = 0;
-	a->samples = 0;
-	a->sttssamples = 0;
 	a->empty = false;
+	mp4_init(&a->mp4, "esds", esds_config, false);
 
 	if (a->hAac) {
 		// always free decoder as flush only works when no parameter has changed
@@ -608,14 +360,7 @@ static void helixaac_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 static void helixaac_close(void) {
 	HAAC(a, FreeDecoder, a->hAac);
 	a->hAac = NULL;
-	if (a->chunkinfo) {
-		free(a->chunkinfo);
-		a->chunkinfo = NULL;
-	}
-	if (a->stsc) {
-		free(a->stsc);
-		a->stsc = NULL;
-	}
+	mp4_close(&a->mp4);
 	free(a->write_buf);
 	free(a->wrap_buf);
 }
@@ -652,17 +397,14 @@ struct codec *register_helixaac(void) {
 		helixaac_open,    // open
 		helixaac_close,   // close
 		helixaac_decode,  // decode
+		true,         // keep warm
 	};
 
-	a = malloc(sizeof(struct helixaac));
+	a = calloc(1, sizeof(struct helixaac));
 	if (!a) {
 		return NULL;
 	}
 
-	a->hAac = NULL;
-	a->chunkinfo = NULL;
-	a->stsc = NULL;
-
 	if (!load_helixaac()) {
 		return NULL;
 	}
@@ -0,0 +1,265 @@
+/* 
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <math.h>
+#include "squeezelite.h"
+#include "equalizer.h"
+#include "limiter.h"
+
+/*
+ When enabled, the positive part of the gain (replay gain above unity, equalizer boost) is taken out of the
+ packing stage so that nothing clips there and it is re-applied here, after the equalizer, as a makeup gain.
+ Samples go through a delay line of a few blocks and the peak of each block is known before it is played, 
+ so the gain of the block being played is set to reach the one of any louder block linearly by the time it
+ arrives (attack) and then goes back up exponentially (release). Gain is only evaluated once per block and 
+ stepped linearly in between. When there is no makeup and no reduction, the delay line is just rotated, so 
+ samples are bit-exact, only delayed. A buffer is made of chunks written with their own gain (e.g. a track 
+ boundary with a different replay gain), so the makeup of each chunk is queued and follows its frames.
+*/
+
+#define BLOCK		32				// frames per gain evaluation
+#define CEILING		(32767LL << 16)	// max sample in Q16
+#define MAX_LOOKAHEAD	10
+#define SEGMENTS	8				// chunks with their own makeup per processed buffer
+
+static log_level loglevel = lINFO;
+
+static struct {
+	bool enabled;
+	unsigned lookahead_ms, release_ms;
+	u32_t rate;
+	s16_t *delay;					// blocks * BLOCK frames
+	s32_t *target, *makeup;			// per block max gain and makeup gain
+	int blocks;
+	frames_t pos;					// frame position in delay line
+	u32_t peak;						// of block being filled
+	bool partial;					// block partly filled without peak detection
+	s32_t gain, end, step, coef;	// Q16, current gain, at end of block and per-frame step
+	s32_t next;						// makeup of incoming frames
+	struct {
+		frames_t frames;
+		s32_t makeup;
+	} segment[SEGMENTS];			// chunks written since last process
+	int segments;
+	u32_t active;					// frames with gain reduction
+	s32_t ratio;					// min ratio of gain over makeup
+} limiter = { .gain = FIXED_ONE, .end = FIXED_ONE, .next = FIXED_ONE, .ratio = FIXED_ONE };
+
+/****************************************************************************************
+ * (re)open limiter for a given sample rate
+ */
+static void limiter_open(u32_t sample_rate) {
+	limiter_close();
+	limiter.rate = sample_rate;
+	
+	// need at least 2 blocks so that the next block's peak is always known
+	limiter.blocks = max((limiter.lookahead_ms * sample_rate / 1000 + BLOCK - 1) / BLOCK, 2);
+	limiter.delay = calloc(limiter.blocks * BLOCK, BYTES_PER_FRAME);
+	limiter.target = malloc(limiter.blocks * sizeof(s32_t) * 2);
+	
+	if (!limiter.delay || !limiter.target) {
+		LOG_ERROR("can't allocate limiter for %u blocks", limiter.blocks);
+		limiter_close();
+		return;
+	}	
+	
+	limiter.makeup = limiter.target + limiter.blocks;
+	for (int i = 0; i < limiter.blocks; i++) limiter.target[i] = limiter.makeup[i] = FIXED_ONE;
+	limiter.pos = limiter.peak = limiter.step = 0;
+	limiter.gain = limiter.end = FIXED_ONE;
+	limiter.coef = to_gain(1 - expf(-(float) BLOCK * 1000 / ((float) sample_rate * max(limiter.release_ms, 1))));
+	
+	LOG_INFO("limiter at %u with %u frames look-ahead", sample_rate, limiter.blocks * BLOCK);
+}	
+
+/****************************************************************************************
+ * set parameters, a look-ahead of 0 disables limiter
+ */
+void limiter_config(unsigned lookahead_ms, unsigned release_ms) {
+	limiter_close();
+	limiter.lookahead_ms = min(lookahead_ms, MAX_LOOKAHEAD);
+	limiter.release_ms = release_ms;
+	limiter.enabled = lookahead_ms != 0;
+	limiter.next = FIXED_ONE;
+	limiter.segments = 0;
+}
+
+/****************************************************************************************
+ * close limiter
+ */
+void limiter_close(void) {
+	free(limiter.delay);
+	free(limiter.target);
+	limiter.delay = NULL;
+	limiter.target = limiter.makeup = NULL;
+	limiter.rate = 0;
+}	
+
+/****************************************************************************************
+ * take positive gain away from packing stage for a chunk of frames (output mutex held)
+ */
+void _limiter_gain(s32_t *gainL, s32_t *gainR, frames_t frames) {
+	s32_t makeup;
+	
+	if (!limiter.enabled) return;
+	
+	makeup = max(max(abs(*gainL), abs(*gainR)), FIXED_ONE);
+	makeup = gain(makeup, equalizer_headroom());
+	
+	if (makeup != FIXED_ONE) {
+		*gainL = ((s64_t) *gainL << 16) / makeup;
+		*gainR = ((s64_t) *gainR << 16) / makeup;
+	}	
+	
+	if (!frames) return;
+	
+	if (limiter.segments && limiter.segment[limiter.segments - 1].makeup == makeup) {
+		limiter.segment[limiter.segments - 1].frames += frames;
+	} else if (limiter.segments < SEGMENTS) {
+		limiter.segment[limiter.segments].makeup = makeup;
+		limiter.segment[limiter.segments++].frames = frames;
+	} else {
+		// out of room, newest makeup takes over last chunk
+		limiter.segment[SEGMENTS - 1].makeup = makeup;
+		limiter.segment[SEGMENTS - 1].frames += frames;
+	}	
+}
+
+/****************************************************************************************
+ * a block has been filled, plan gain of the block to be played next
+ */
+static void _block(void) {
+	int b = limiter.pos / BLOCK - 1, j;
+	s32_t g0, end;
+		
+	// target of incoming block, no reduction possible without makeup
+	limiter.target[b] = limiter.next;
+	if (limiter.next > FIXED_ONE && (s64_t) limiter.peak * limiter.next > CEILING) limiter.target[b] = CEILING / limiter.peak;
+	limiter.makeup[b] = limiter.next;
+	limiter.peak = 0;
+	limiter.partial = false;
+	
+	if (limiter.pos == limiter.blocks * BLOCK) limiter.pos = 0;
+	j = limiter.pos / BLOCK;
+	
+	// release towards makeup (snap when step is too small), then reach all targets ahead in time
+	g0 = limiter.gain = limiter.end;
+	end = limiter.makeup[j] - g0;
+	if (end > 0) {
+		s32_t step = ((s64_t) end * limiter.coef) >> 16;
+		end = g0 + (step ? step : end);
+	} else end = g0;
+	
+	end = min(end, limiter.target[j]);
+	for (int d = 1; d < limiter.blocks; d++) {
+		s32_t t = limiter.target[(j + d) % limiter.blocks];
+		if (t < end) end = min(end, g0 + (t - g0) / d);
+	}
+	
+	limiter.end = end;
+	limiter.step = (end - g0) / BLOCK;
+	
+	if (end < limiter.makeup[j]) {
+		s32_t ratio = ((s64_t) end << 16) / limiter.makeup[j];
+		limiter.active += BLOCK;
+		if (ratio < limiter.ratio) limiter.ratio = ratio;
+	}	
+}
+
+/****************************************************************************************
+ * process limiter in place, output is delayed by look-ahead
+ */
+void limiter_process(u8_t *buf, u32_t bytes, u32_t sample_rate) {
+	s16_t *ptr = (s16_t*) buf;
+	frames_t frames = bytes / BYTES_PER_FRAME, left = 0;
+	int s = 0;
+	
+	if (!limiter.enabled) return;
+	if (limiter.rate != sample_rate) limiter_open(sample_rate);
+	if (!limiter.delay) {
+		limiter.segments = 0;
+		return;
+	}	
+	
+	while (frames) {
+		frames_t count;
+		s16_t *d = limiter.delay + limiter.pos * 2;
+		s16_t *start = d - (limiter.pos % BLOCK) * 2;
+		
+		// makeup follows the chunks it was taken from, the last one extends to frames beyond
+		if (!left) {
+			if (s < limiter.segments) limiter.next = limiter.segment[s].makeup;
+			left = s < limiter.segments ? limiter.segment[s++].frames : frames;
+		}	
+		
+		count = min(min(frames, left), BLOCK - limiter.pos % BLOCK);
+		frames -= count;
+		left -= count;
+		limiter.pos += count;
+		
+		if (limiter.next == FIXED_ONE && limiter.gain == FIXED_ONE && !limiter.step) {
+			// not engaged, just a delay line
+			limiter.partial = true;
+			for (count *= 2; count--; ptr++, d++) {
+				s16_t sample = *ptr;
+				*ptr = *d;
+				*d = sample;
+			}	
+		} else {
+			u32_t peak = limiter.peak;
+			s32_t g = limiter.gain, step = limiter.step;
+			
+			// makeup started within block, get the peak of what has been stored so far
+			if (limiter.partial) {
+				for (; start < d; start++) peak = max(peak, abs(*start));
+				limiter.partial = false;
+			}
+			
+			while (count--) {
+				s16_t l = ptr[0], r = ptr[1];
+				peak = max(peak, abs(l));
+				peak = max(peak, abs(r));
+				g += step;
+				*ptr++ = ((s64_t) *d * g) >> 16;
+				*ptr++ = ((s64_t) d[1] * g) >> 16;
+				*d++ = l;
+				*d++ = r;
+			}
+			
+			limiter.peak = peak;
+			limiter.gain = g;
+		}
+		
+		if (limiter.pos % BLOCK == 0) _block();
+	}
+	
+	limiter.segments = 0;
+}
+
+/****************************************************************************************
+ * latency added to output
+ */
+frames_t limiter_delay(void) {
+	return limiter.delay ? limiter.blocks * BLOCK : 0;
+}	
+
+/****************************************************************************************
+ * gain reduction activity since last call
+ */
+bool limiter_stats(unsigned *active_ms, float *reduction_db) {
+	if (!limiter.enabled || !limiter.rate) return false;
+	
+	*active_ms = (u64_t) limiter.active * 1000 / limiter.rate;
+	*reduction_db = -20 * log10f((float) limiter.ratio / FIXED_ONE);
+	limiter.active = 0;
+	limiter.ratio = FIXED_ONE;
+	
+	return true;
+}	
@@ -0,0 +1,18 @@
+/* 
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+ 
+#pragma once
+
+void limiter_config(unsigned lookahead_ms, unsigned release_ms);
+void limiter_close(void);
+void _limiter_gain(s32_t *gainL, s32_t *gainR, frames_t frames);
+void limiter_process(u8_t *buf, u32_t bytes, u32_t sample_rate);
+frames_t limiter_delay(void);
+bool limiter_stats(unsigned *active_ms, float *reduction_db);
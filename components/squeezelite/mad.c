@@ -25,14 +25,14 @@
 
 #define MAD_DELAY 529
 
-#define READBUF_SIZE 2048 // local buffer used by decoder: FIXME merge with any other decoders needing one?
+#define READBUF_SIZE 2048 // decoding window, frames are read in place from streambuf except the last one
 
 struct mad {
 	u8_t *readbuf;
-	unsigned readbuf_len;
 	struct mad_stream stream;
-	struct mad_frame frame;
-	struct mad_synth synth;
+	// large (~22kB), only allocated while codec is open
+	struct mad_frame *frame;
+	struct mad_synth *synth;
 	enum mad_error last_error;
 	// for lame gapless processing
 	int checktags;
@@ -164,10 +164,24 @@ static void _check_lame_header(size_t bytes) {
 	}
 }
 
+// consume from streambuf what libmad has used in the window
+static void _release_window(u8_t *start, bool eos) {
+	if (eos) return;
+	LOCK_S;
+	_buf_inc_readp(streambuf, m->stream.next_frame - start);
+	UNLOCK_S;
+}
+
 static decode_state mad_decode(void) {
-	size_t bytes;
+	size_t bytes, window;
+	u8_t *start;
 	bool eos = false;
 
+	if (!m->frame) {
+		LOG_WARN("malloc fail");
+		return DECODE_ERROR;
+	}
+
 	LOCK_S;
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 	
@@ -192,26 +206,23 @@ static decode_state mad_decode(void) {
 		}
 	}
 
-	if (m->stream.next_frame && m->readbuf_len) {
-		m->readbuf_len -= m->stream.next_frame - m->readbuf;
-		memmove(m->readbuf, m->stream.next_frame, m->readbuf_len);
-	}
-
-	bytes = min(bytes, READBUF_SIZE - m->readbuf_len);
-	memcpy(m->readbuf + m->readbuf_len, streambuf->readp, bytes);
-	m->readbuf_len += bytes;
-	_buf_inc_readp(streambuf, bytes);
+	// decode in place, only the tail is copied as libmad needs a guard of zeros after the last frame
+	window = _buf_read_window(streambuf, READBUF_SIZE);
+	start = streambuf->readp;
 
-	if (stream.state <= DISCONNECT && _buf_used(streambuf) == 0) {
+	if (stream.state <= DISCONNECT && _buf_used(streambuf) == window) {
 		eos = true;
 		LOG_DEBUG("end of stream");
-		memset(m->readbuf + m->readbuf_len, 0, MAD_BUFFER_GUARD);
-		m->readbuf_len += MAD_BUFFER_GUARD;
+		memcpy(m->readbuf, start, window);
+		memset(m->readbuf + window, 0, MAD_BUFFER_GUARD);
+		_buf_inc_readp(streambuf, window);
+		start = m->readbuf;
+		window += MAD_BUFFER_GUARD;
 	}
 
 	UNLOCK_S;
 
-	MAD(m, stream_buffer, &m->stream, m->readbuf, m->readbuf_len);
+	MAD(m, stream_buffer, &m->stream, start, window);
 
 	while (true) {
 		size_t frames;
@@ -219,7 +230,7 @@ static decode_state mad_decode(void) {
 		s32_t *iptrr;
 		unsigned max_frames;
 
-		if (MAD(m, frame_decode, &m->frame, &m->stream) == -1) {
+		if (MAD(m, frame_decode, m->frame, &m->stream) == -1) {
 			decode_state ret;
 			if (!eos && m->stream.error == MAD_ERROR_BUFLEN) {
 				ret = DECODE_RUNNING;
@@ -237,15 +248,16 @@ static decode_state mad_decode(void) {
 				ret = DECODE_RUNNING;
 			}
 			m->last_error = m->stream.error;
+			_release_window(start, eos);
 			return ret;
 		};
 
-		MAD(m, synth_frame, &m->synth, &m->frame);
+		MAD(m, synth_frame, m->synth, m->frame);
 
 		if (decode.new_stream) {
 			LOCK_O;
 			LOG_INFO("setting track_start");
-			output.next_sample_rate = decode_newstream(m->synth.pcm.samplerate, output.supported_rates);
+			output.next_sample_rate = decode_newstream(m->synth->pcm.samplerate, output.supported_rates);
 			IF_DSD(	output.next_fmt = PCM; )
 			output.track_start = outputbuf->writep;
 			if (output.fade_mode) _checkfade(true);
@@ -262,14 +274,14 @@ static decode_state mad_decode(void) {
 			max_frames = process.max_in_frames - process.in_frames;
 		);
 		
-		if (m->synth.pcm.length > max_frames) {
+		if (m->synth->pcm.length > max_frames) {
 			LOG_WARN("too many samples - dropping samples");
-			m->synth.pcm.length = max_frames;
+			m->synth->pcm.length = max_frames;
 		}
 		
-		frames = m->synth.pcm.length;
-		iptrl = m->synth.pcm.samples[0];
-		iptrr = m->synth.pcm.samples[ m->synth.pcm.channels - 1 ];
+		frames = m->synth->pcm.length;
+		iptrl = m->synth->pcm.samples[0];
+		iptrr = m->synth->pcm.samples[ m->synth->pcm.channels - 1 ];
 
 		if (m->skip) {
 			u32_t skip = min(m->skip, frames);
@@ -334,6 +346,7 @@ static decode_state mad_decode(void) {
 		UNLOCK_O_direct;
 	}
 
+	_release_window(start, eos);
 	return eos ? DECODE_COMPLETE : DECODE_RUNNING;
 }
 
@@ -341,22 +354,43 @@ static void mad_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
 	if (!m->readbuf) {
 		m->readbuf = malloc(READBUF_SIZE + MAD_BUFFER_GUARD);
 	}
+	if (m->frame) {
+		// warm codec, release what libmad allocated for previous stream (main_data, overlap)
+		mad_synth_finish(m->synth);
+		MAD(m, frame_finish, m->frame);
+		MAD(m, stream_finish, &m->stream);
+	} else {
+		m->frame = malloc(sizeof(struct mad_frame));
+		m->synth = malloc(sizeof(struct mad_synth));
+		if (!m->frame || !m->synth) {
+			free(m->frame);
+			free(m->synth);
+			m->frame = NULL;
+			m->synth = NULL;
+			return;
+		}
+	}
 	m->checktags = 1;
 	m->consume = 0;
 	m->skip = MAD_DELAY;
 	m->samples = 0;
-	m->readbuf_len = 0;
 	m->last_error = MAD_ERROR_NONE;
 	MAD(m, stream_init, &m->stream);
-	MAD(m, frame_init, &m->frame);
-	MAD(m, synth_init, &m->synth);
+	MAD(m, frame_init, m->frame);
+	MAD(m, synth_init, m->synth);
 }
 
 static void mad_close(void) {
-	mad_synth_finish(&m->synth); // macro only in current version
-	MAD(m, frame_finish, &m->frame);
-	MAD(m, stream_finish, &m->stream);
+	if (m->frame) {
+		mad_synth_finish(m->synth); // macro only in current version
+		MAD(m, frame_finish, m->frame);
+		MAD(m, stream_finish, &m->stream);
+	}
+	free(m->frame);
+	free(m->synth);
 	free(m->readbuf);
+	m->frame = NULL;
+	m->synth = NULL;
 	m->readbuf = NULL;
 }
 
@@ -400,16 +434,14 @@ struct codec *register_mad(void) {
 		mad_open,     // open
 		mad_close,    // close
 		mad_decode,   // decode
+		true,         // keep warm
 	};
 
-	m = malloc(sizeof(struct mad));
+	m = calloc(1, sizeof(struct mad));
 	if (!m) {
 		return NULL;
 	}
 
-	m->readbuf = NULL;
-	m->readbuf_len = 0;
-
 	if (!load_mad()) {
 		return NULL;
 	}
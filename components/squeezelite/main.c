@@ -99,6 +99,10 @@ static void usage(const char *argv0) {
 #if LINUX || FREEBSD || SUN
 		   "  -P <filename>\t\tStore the process id (PID) in filename\n"
 #endif
+#if !EMBEDDED
+		   "  -B <url>[,<secs>]\tMeasure streaming throughput from http url for secs (default 10) then exit, data is discarded\n"
+#endif
+		   "  -T <confidence>\tStart playback as soon as measured network throughput and jitter give <confidence>%% of no underrun (e.g. 99.9), before server thresholds are met\n"
 		   "  -r <rates>[:<delay>]\tSample rates supported, allows output to be off when squeezelite is started; rates = <maxrate>|<minrate>-<maxrate>|<rate1>,<rate2>,<rate3>; delay = optional delay switching rates in ms\n"
 #if GPIO
 			"  -S <Power Script>\tAbsolute path to script to launch on power commands from LMS\n"
@@ -285,6 +289,11 @@ int main(int argc, char **argv) {
 	char *modelname = NULL;
 	extern bool pcm_check_header;
 	extern bool user_rates;
+	extern float stream_confidence;
+#if !EMBEDDED
+	char *bench_url = NULL;
+	unsigned bench_secs = 10;
+#endif
 	char *logfile = NULL;
 	u8_t mac[6];
 	unsigned stream_buf_size = STREAMBUF_SIZE;
@@ -343,7 +352,10 @@ int main(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("oabcCdefmMnNpPrs"
+		if (strstr("oabcCdefmMnNpPrsT"
+#if !EMBEDDED
+				   "B"
+#endif
 #if ALSA
 				   "UVO"
 #endif
@@ -522,6 +534,24 @@ int main(int argc, char **argv) {
 		case 'W':
 			pcm_check_header = true;
 			break;
+#if !EMBEDDED
+		case 'B':
+			{
+				char *u = next_param(optarg, ',');
+				char *t = next_param(NULL, ',');
+				bench_url = u;
+				if (t) bench_secs = atoi(t);
+			}
+			break;
+#endif
+		case 'T':
+			stream_confidence = atof(optarg);
+			if (stream_confidence < 0 || stream_confidence >= 100) {
+				fprintf(stderr, "\nError: invalid confidence: %s\n\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
 #if ALSA
 		case 'p':
 			rt_priority = atoi(optarg);
@@ -762,6 +792,21 @@ int main(int argc, char **argv) {
 
 	stream_init(log_stream, stream_buf_size);
 
+#if !EMBEDDED
+	if (bench_url) {
+		extern event_event wake_e;
+		struct stream_bench result;
+		int ret;
+		
+		// no controller but stream thread still wants to wake it
+		wake_create(wake_e);
+		ret = stream_bench(bench_url, bench_secs, &result) ? 0 : 1;
+		if (!ret) stream_bench_report(&result);
+		stream_close();
+		exit(ret);
+	}
+#endif
+
 #if EMBEDDED
 	embedded_init();
 	output_init_embedded(log_output, output_device, output_buf_size, output_params, rates, rate_delay, idle);
@@ -0,0 +1,368 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// minimal streaming mp4 demuxer shared by alac and aac to extract audio config and walk media data
+
+#include "squeezelite.h"
+
+extern log_level loglevel;
+
+extern struct buffer *streambuf;
+
+/*
+ Sample tables can't be re-read from a stream so they are kept for the whole track, but in compact form:
+ stco is the only per-chunk table, stsc is kept as runs and walked along chunks instead of being expanded
+ and stsz uses 16 bits entries unless a sample is larger. stsz and stco are parsed incrementally so they
+ don't need to be contiguous in streambuf, whatever their size
+*/
+
+enum { TABLE_NONE = 0, TABLE_STSZ, TABLE_STCO };
+
+void mp4_init(struct mp4 *mp4, const char *config_box, bool (*config)(u8_t *box, u32_t len), bool want_sizes) {
+	mp4_close(mp4);
+	memset(mp4, 0, sizeof(struct mp4));
+	mp4->config_box = config_box;
+	mp4->config = config;
+	mp4->want_sizes = want_sizes;
+}
+
+void mp4_close(struct mp4 *mp4) {
+	free(mp4->chunk_offset);
+	free(mp4->stsc);
+	free(mp4->sizes);
+	mp4->chunk_offset = mp4->stsc = NULL;
+	mp4->sizes = NULL;
+}
+
+// samples in chunk (0-based) walking stsc runs forward
+static u32_t _chunk_samples(struct mp4 *mp4, u32_t chunk) {
+	if (!mp4->stsc) return 0;
+	while (mp4->stsc_index + 1 < mp4->stsc_entries && chunk + 1 >= mp4->stsc[(mp4->stsc_index + 1) * 3]) {
+		mp4->stsc_index++;
+	}
+	return mp4->stsc[mp4->stsc_index * 3 + 1];
+}
+
+static bool _set_size(struct mp4 *mp4, u32_t index, u32_t size) {
+	if (!mp4->sizes32 && size > 0xffff) {
+		u32_t i, *sizes = malloc(mp4->sizes_count * sizeof(u32_t));
+		if (!sizes) return false;
+		for (i = 0; i < index; i++) sizes[i] = ((u16_t*) mp4->sizes)[i];
+		free(mp4->sizes);
+		mp4->sizes = sizes;
+		mp4->sizes32 = true;
+		LOG_DEBUG("sample size %u at %u, using 32 bits stsz", size, index);
+	}
+	if (mp4->sizes32) ((u32_t*) mp4->sizes)[index] = size;
+	else ((u16_t*) mp4->sizes)[index] = size;
+	return true;
+}
+
+static bool _read_table(struct mp4 *mp4, size_t *bytes) {
+	u32_t n = min(*bytes / 4, mp4->table_left);
+	u8_t *ptr = streambuf->readp;
+	u32_t i;
+
+	for (i = 0; i < n; i++, ptr += 4) {
+		u32_t value = unpackN((u32_t *)ptr);
+		if (mp4->table == TABLE_STCO) {
+			mp4->chunk_offset[mp4->table_index++] = value;
+		} else if (!_set_size(mp4, mp4->table_index++, value)) {
+			return false;
+		}
+	}
+
+	mp4->table_left -= n;
+	if (!mp4->table_left) mp4->table = TABLE_NONE;
+
+	_buf_inc_readp(streambuf, n * 4);
+	mp4->pos += n * 4;
+	*bytes -= n * 4;
+
+	return true;
+}
+
+// read mp4 header to extract config data and tables, 1 when media data is reached, 0 for more, -1 on error
+int mp4_read_header(struct mp4 *mp4) {
+	size_t bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
+	char type[5];
+	u32_t len;
+
+	while (true) {
+		u32_t consume;
+
+		// entries of a table being read
+		if (mp4->table) {
+			if (bytes < 4) break;
+			if (!_read_table(mp4, &bytes)) {
+				LOG_WARN("malloc fail");
+				return -1;
+			}
+			continue;
+		}
+
+		if (bytes < 8) break;
+
+		len = unpackN((u32_t *)streambuf->readp);
+		memcpy(type, streambuf->readp + 4, 4);
+		type[4] = '\0';
+
+		// count trak to find the first playable one
+		if (!strcmp(type, "moov")) {
+			mp4->trak = 0;
+			mp4->play = 0;
+		}
+		if (!strcmp(type, "trak")) {
+			mp4->trak++;
+		}
+
+		// codec config (alac or esds)
+		if (!strcmp(type, mp4->config_box) && bytes >= len) {
+			if (!mp4->config(streambuf->readp, len)) {
+				LOG_WARN("error parsing %s", type);
+				return -1;
+			}
+			LOG_DEBUG("playable track: %u", mp4->trak);
+			mp4->play = mp4->trak;
+		}
+
+		// extract the total number of samples from stts
+		if (!strcmp(type, "stts") && bytes >= len) {
+			u32_t i;
+			u8_t *ptr = streambuf->readp + 12;
+			u32_t entries = unpackN((u32_t *)ptr);
+			ptr += 4;
+			for (i = 0; i < entries; ++i) {
+				u32_t count = unpackN((u32_t *)ptr);
+				u32_t size = unpackN((u32_t *)(ptr + 4));
+				mp4->sttssamples += count * size;
+				ptr += 8;
+			}
+			LOG_DEBUG("total number of samples contained in stts: " FMT_u64, mp4->sttssamples);
+		}
+
+		// keep sample to chunk runs (first chunk, samples per chunk, description)
+		if (!strcmp(type, "stsc") && bytes >= len && mp4->play && mp4->play == mp4->trak && !mp4->stsc) {
+			u32_t i;
+			u8_t *ptr = streambuf->readp + 12;
+			mp4->stsc_entries = unpackN((u32_t *)ptr);
+			ptr += 4;
+			mp4->stsc = malloc(mp4->stsc_entries * 3 * sizeof(u32_t));
+			if (!mp4->stsc) {
+				LOG_WARN("malloc fail");
+				return -1;
+			}
+			for (i = 0; i < mp4->stsc_entries * 3; i++, ptr += 4) {
+				mp4->stsc[i] = unpackN((u32_t *)ptr);
+			}
+		}
+
+		// default to consuming entire box
+		consume = len;
+
+		// sample sizes, only header is needed here and entries are read incrementally
+		if (!strcmp(type, "stsz") && mp4->want_sizes && mp4->play && mp4->play == mp4->trak && !mp4->sizes) {
+			if (bytes < 20) {
+				_buf_unwrap(streambuf, 20);
+				break;
+			}
+			mp4->size_default = unpackN((u32_t *)(streambuf->readp + 12));
+			if (!mp4->size_default) {
+				mp4->sizes_count = unpackN((u32_t *)(streambuf->readp + 16));
+				mp4->sizes = malloc(mp4->sizes_count * sizeof(u16_t));
+				if (!mp4->sizes) {
+					LOG_WARN("malloc fail");
+					return -1;
+				}
+				mp4->table = TABLE_STSZ;
+				mp4->table_left = mp4->sizes_count;
+				mp4->table_index = 0;
+				consume = 20;
+				LOG_DEBUG("total blocksize contained in stsz %u", mp4->sizes_count);
+			} else {
+				LOG_DEBUG("fixed blocksize in stsz %u", mp4->size_default);
+			}
+		}
+
+		// chunk offsets, read incrementally as well
+		if (!strcmp(type, "stco") && mp4->play && mp4->play == mp4->trak && !mp4->chunk_offset) {
+			if (bytes < 16) {
+				_buf_unwrap(streambuf, 16);
+				break;
+			}
+			mp4->chunks = unpackN((u32_t *)(streambuf->readp + 12));
+			mp4->chunk_offset = malloc(mp4->chunks * sizeof(u32_t));
+			if (!mp4->chunk_offset) {
+				LOG_WARN("malloc fail");
+				return -1;
+			}
+			mp4->table = TABLE_STCO;
+			mp4->table_left = mp4->chunks;
+			mp4->table_index = 0;
+			consume = 16;
+		}
+
+		// found media data, advance to start of first chunk and return
+		if (!strcmp(type, "mdat")) {
+			_buf_inc_readp(streambuf, 8);
+			mp4->pos += 8;
+			bytes  -= 8;
+			if (mp4->play) {
+				LOG_DEBUG("type: mdat len: %u pos: %u", len, mp4->pos);
+				if (mp4->chunk_offset && mp4->chunks && mp4->chunk_offset[0] > mp4->pos) {
+					u32_t skip = mp4->chunk_offset[0] - mp4->pos;
+					LOG_DEBUG("skipping: %u", skip);
+					if (skip <= bytes) {
+						_buf_inc_readp(streambuf, skip);
+						mp4->pos += skip;
+					} else {
+						mp4->consume = skip;
+					}
+				}
+				mp4->chunk = mp4->sample = 0;
+				mp4->chunk_left = _chunk_samples(mp4, 0);
+				LOG_INFO("mp4 tables: %u chunks, %u samples, %u bytes", mp4->chunks, mp4->sizes_count,
+						 mp4->chunks * 4 + mp4->stsc_entries * 12 + mp4->sizes_count * (mp4->sizes32 ? 4 : 2));
+				return 1;
+			} else {
+				LOG_DEBUG("type: mdat len: %u, no playable track found (moov after mdat?)", len);
+				return -1;
+			}
+		}
+
+		// parse key-value atoms within ilst ---- entries to get encoder padding within iTunSMPB entry for gapless
+		if (!strcmp(type, "----") && bytes >= len) {
+			u8_t *ptr = streambuf->readp + 8;
+			u32_t remain = len - 8, size;
+			if (!memcmp(ptr + 4, "mean", 4) && (size = unpackN((u32_t *)ptr)) < remain) {
+				ptr += size; remain -= size;
+			}
+			if (!memcmp(ptr + 4, "name", 4) && (size = unpackN((u32_t *)ptr)) < remain && !memcmp(ptr + 12, "iTunSMPB", 8)) {
+				ptr += size; remain -= size;
+			}
+			if (!memcmp(ptr + 4, "data", 4) && remain > 16 + 48) {
+				// data is stored as hex strings: 0 start end samples
+				u32_t b, c; u64_t d;
+				if (sscanf((const char *)(ptr + 16), "%x %x %x " FMT_x64, &b, &b, &c, &d) == 4) {
+					LOG_DEBUG("iTunSMPB start: %u end: %u samples: " FMT_u64, b, c, d);
+					if (mp4->sttssamples && mp4->sttssamples < b + c + d) {
+						LOG_DEBUG("reducing samples as stts count is less");
+						d = mp4->sttssamples - (b + c);
+					}
+					mp4->skip = b;
+					mp4->samples = d;
+				}
+			}
+		}
+
+		// read into these boxes so reduce consume
+		if (!strcmp(type, "moov") || !strcmp(type, "trak") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl") ||
+			!strcmp(type, "udta") || !strcmp(type, "ilst")) {
+			consume = 8;
+		}
+		// special cases which mix mix data in the enclosing box which we want to read into
+		if (!strcmp(type, "stsd")) consume = 16;
+		if (!strcmp(type, "mp4a")) consume = 36;
+		if (!strcmp(type, "meta")) consume = 12;
+
+		// consume rest of box if it has been parsed (all in the buffer) or is not one we want to parse
+		if (bytes >= consume) {
+			LOG_DEBUG("type: %s len: %u consume: %u", type, len, consume);
+			_buf_inc_readp(streambuf, consume);
+			mp4->pos += consume;
+			bytes -= consume;
+		} else if ( !(!strcmp(type, mp4->config_box) || !strcmp(type, "stts") || !strcmp(type, "stsc") || !strcmp(type, "----")) ) {
+			LOG_DEBUG("type: %s len: %u consume: %u - partial consume: %u", type, len, consume, bytes);
+			_buf_inc_readp(streambuf, bytes);
+			mp4->pos += bytes;
+			mp4->consume = consume - bytes;
+			break;
+		} else if (len > streambuf->size) {
+			// can't process an atom larger than streambuf!
+			LOG_ERROR("atom %s too large for buffer %u %u", type, len, streambuf->size);
+			return -1;
+		} else {
+			// make sure there is 'len' contiguous space
+			_buf_unwrap(streambuf, len);
+			break;
+		}
+	}
+
+	// box header or table entry across the end of streambuf
+	if (bytes < 8 && _buf_used(streambuf) > bytes) _buf_unwrap(streambuf, min(_buf_used(streambuf), 8));
+
+	return 0;
+}
+
+// skip data pending from header or chunk jumps, true if there is still some
+bool _mp4_consume(struct mp4 *mp4) {
+	u32_t consume;
+
+	if (!mp4->consume) return false;
+
+	consume = min(mp4->consume, _buf_used(streambuf));
+	LOG_DEBUG("consume: %u of %u", consume, mp4->consume);
+	_buf_inc_readp(streambuf, consume);
+	mp4->pos += consume;
+	mp4->consume -= consume;
+
+	return true;
+}
+
+// size of next sample from stsz, 0 when unknown or at the end
+u32_t mp4_sample_size(struct mp4 *mp4) {
+	if (mp4->size_default) return mp4->size_default;
+	if (!mp4->sizes || mp4->sample >= mp4->sizes_count) return 0;
+	return mp4->sizes32 ? ((u32_t*) mp4->sizes)[mp4->sample] : ((u16_t*) mp4->sizes)[mp4->sample];
+}
+
+// a sample of 'bytes' has been decoded, move to next one in streambuf, false if it would go backward
+bool _mp4_next_sample(struct mp4 *mp4, u32_t bytes) {
+	u32_t skip = bytes;
+
+	mp4->sample++;
+
+	// end of chunk - skip to next offset
+	if (mp4->chunk_offset && mp4->chunk_left && !--mp4->chunk_left && mp4->chunk + 1 < mp4->chunks) {
+		u32_t offset = mp4->chunk_offset[++mp4->chunk];
+
+		mp4->chunk_left = _chunk_samples(mp4, mp4->chunk);
+
+		if (offset < mp4->pos) {
+			LOG_ERROR("error: need to skip backwards!");
+			return false;
+		}
+
+		skip = offset - mp4->pos;
+		if (skip != bytes) {
+			LOG_DEBUG("skipping to next chunk pos: %u consumed: %u != skip: %u", mp4->pos, bytes, skip);
+		}
+	}
+
+	if (_buf_used(streambuf) >= skip) {
+		_buf_inc_readp(streambuf, skip);
+		mp4->pos += skip;
+	} else {
+		mp4->consume = skip;
+	}
+
+	return true;
+}
@@ -0,0 +1,282 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *  (c) Philippe, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// minimal streaming ogg demuxer shared by vorbis, opus and ogg-flac to extract packets
+
+#include "squeezelite.h"
+
+extern log_level loglevel;
+
+extern struct buffer *streambuf;
+extern struct streamstate stream;
+
+/*
+ Pages are parsed in place in streambuf and a packet that ends in the page it starts in is returned as a pointer
+ into streambuf, so the usual case costs no copy at all. The page is only consumed when the next packet is asked
+ for, so the caller can decode without holding the stream mutex: the stream thread never moves readp. Packets
+ spanning pages are gathered in a private buffer. Only one logical stream is followed, the one whose first
+ packet is recognized by the codec, and a new one starting after it ended is a chained stream.
+*/
+
+#define OGG_HEADER 27
+
+// ogg fields are little endian
+#define LE32(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (u32_t) (p)[3] << 24)
+
+static u32_t crc_table[256];
+
+static void _crc_init(void) {
+	u32_t i, j, crc;
+
+	if (crc_table[1]) return;
+
+	for (i = 0; i < 256; i++) {
+		for (crc = i << 24, j = 0; j < 8; j++) {
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+		}
+		crc_table[i] = crc;
+	}
+}
+
+// checksum is only verified when (re)synchronizing, after that the transport is reliable
+static bool _crc_check(u8_t *page, u32_t len) {
+	u32_t i, crc = 0;
+
+	for (i = 0; i < len; i++) {
+		u8_t byte = (i >= 22 && i < 26) ? 0 : page[i];
+		crc = (crc << 8) ^ crc_table[((crc >> 24) & 0xff) ^ byte];
+	}
+
+	return crc == LE32(page + 22);
+}
+
+void ogg_init(struct ogg *ogg, bool (*probe)(u8_t *packet, u32_t len)) {
+	ogg_close(ogg);
+	memset(ogg, 0, sizeof(struct ogg));
+	ogg->probe = probe;
+	_crc_init();
+}
+
+void ogg_close(struct ogg *ogg) {
+	free(ogg->packet);
+	ogg->packet = NULL;
+	ogg->packet_size = 0;
+}
+
+static bool _append(struct ogg *ogg, u8_t *data, u32_t len) {
+	if (ogg->packet_len + len > ogg->packet_size) {
+		u32_t size = ogg->packet_len + len + 1024;
+		u8_t *packet = realloc(ogg->packet, size);
+		if (!packet) return false;
+		ogg->packet = packet;
+		ogg->packet_size = size;
+	}
+	memcpy(ogg->packet + ogg->packet_len, data, len);
+	ogg->packet_len += len;
+	return true;
+}
+
+// make the next page current, 1 when found, 0 when more data is needed
+static int _next_page(struct ogg *ogg) {
+	u8_t *page;
+	size_t window;
+	u32_t i, len;
+
+	while (true) {
+		window = _buf_read_window(streambuf, OGG_HEADER);
+		if (window < OGG_HEADER) return 0;
+
+		page = streambuf->readp;
+
+		if (memcmp(page, "OggS", 4) || page[4] != 0) {
+			u8_t *p = page + 1, *end = page + min(_buf_used(streambuf), _buf_cont_read(streambuf));
+			while (p < end && *p != 'O') p++;
+			LOG_DEBUG("lost sync, skipping %u bytes", p - page);
+			_buf_inc_readp(streambuf, p - page);
+			ogg->synced = false;
+			continue;
+		}
+
+		ogg->segs = page[26];
+		if (_buf_read_window(streambuf, OGG_HEADER + ogg->segs) < OGG_HEADER + ogg->segs) return 0;
+		page = streambuf->readp;
+
+		for (len = OGG_HEADER + ogg->segs, i = 0; i < ogg->segs; i++) len += page[OGG_HEADER + i];
+		if (_buf_read_window(streambuf, len) < len) return 0;
+		page = streambuf->readp;
+
+		if (!ogg->synced) {
+			if (!_crc_check(page, len)) {
+				LOG_DEBUG("false sync");
+				_buf_inc_readp(streambuf, 1);
+				continue;
+			}
+			ogg->synced = true;
+		}
+
+		ogg->page_len = len;
+		ogg->pos = OGG_HEADER + ogg->segs;
+		ogg->seg = 0;
+		ogg->serialno = LE32(page + 14);
+
+		// first page of a logical stream, follow it if the codec recognizes it and no other one is playing
+		if (page[5] & 0x02) {
+			if ((!ogg->have_serial || ogg->ended) && ogg->segs && page[OGG_HEADER] < 255 &&
+				ogg->probe(page + ogg->pos, page[OGG_HEADER])) {
+				if (ogg->have_serial) {
+					LOG_INFO("chained stream %x", ogg->serialno);
+					ogg->chained = true;
+				}
+				ogg->serial = ogg->serialno;
+				ogg->have_serial = true;
+				ogg->ended = false;
+				ogg->packetno = 0;
+				ogg->packet_len = 0;
+				ogg->partial = false;
+			}
+		}
+
+		if (!ogg->have_serial || ogg->serialno != ogg->serial || ogg->ended) {
+			LOG_SDEBUG("skipping page of stream %x", ogg->serialno);
+			_buf_inc_readp(streambuf, len);
+			continue;
+		}
+
+		ogg->eos = page[5] & 0x04;
+
+		// a continued packet either completes the one we have or its head was lost
+		if (!(page[5] & 0x01) && ogg->partial) {
+			LOG_DEBUG("dropping incomplete packet of %u bytes", ogg->packet_len);
+			ogg->packet_len = 0;
+			ogg->partial = false;
+		} else if ((page[5] & 0x01) && !ogg->partial) {
+			while (ogg->seg < ogg->segs) {
+				u8_t lacing = page[OGG_HEADER + ogg->seg++];
+				ogg->pos += lacing;
+				if (lacing < 255) break;
+			}
+		}
+
+		return 1;
+	}
+}
+
+// next packet of followed stream, valid until next call, 1 when found, 0 when more data is needed
+int _ogg_next_packet(struct ogg *ogg, u8_t **data, u32_t *len) {
+	while (true) {
+		u8_t *page;
+		u32_t start, size = 0;
+		bool complete = false;
+
+		// release the current page once all its packets have been returned
+		if (ogg->page_len && ogg->seg == ogg->segs) {
+			_buf_inc_readp(streambuf, ogg->page_len);
+			if (ogg->eos) ogg->ended = true;
+			ogg->page_len = 0;
+		}
+
+		if (!ogg->page_len && !_next_page(ogg)) return 0;
+
+		page = streambuf->readp;
+		start = ogg->pos;
+
+		while (ogg->seg < ogg->segs) {
+			u8_t lacing = page[OGG_HEADER + ogg->seg++];
+			size += lacing;
+			if (lacing < 255) {
+				complete = true;
+				break;
+			}
+		}
+
+		ogg->pos += size;
+
+		if (!complete) {
+			// packet continues on next page
+			if (size && !_append(ogg, page + start, size)) {
+				LOG_WARN("malloc fail");
+				ogg->packet_len = 0;
+				ogg->partial = false;
+			} else {
+				ogg->partial = size || ogg->partial;
+			}
+			continue;
+		}
+
+		// granule position is the one of the last packet completed on the page
+		ogg->granule = -1;
+		if (ogg->seg == ogg->segs) ogg->granule = LE32(page + 6) | (s64_t) LE32(page + 10) << 32;
+		ogg->last = ogg->eos && ogg->seg == ogg->segs;
+
+		if (ogg->partial) {
+			if (!_append(ogg, page + start, size)) {
+				LOG_WARN("malloc fail");
+				ogg->packet_len = 0;
+				ogg->partial = false;
+				continue;
+			}
+			*data = ogg->packet;
+			*len = ogg->packet_len;
+			ogg->packet_len = 0;
+			ogg->partial = false;
+		} else {
+			*data = page + start;
+			*len = size;
+		}
+
+		ogg->packetno++;
+		return 1;
+	}
+}
+
+// vorbis comments of a chained stream are sent as icy metadata, unless stream has its own (stream mutex held)
+void _ogg_comments(u8_t *ptr, u32_t len) {
+	char artist[128] = "", title[128] = "";
+	u32_t count, n;
+	u8_t *end = ptr + len;
+
+	if (len < 8) return;
+	n = LE32(ptr);
+	if (n > len - 8) return;
+	ptr += 4 + n;
+	count = LE32(ptr);
+	ptr += 4;
+
+	while (count-- && ptr + 4 <= end) {
+		n = LE32(ptr);
+		ptr += 4;
+		if (n > end - ptr) break;
+		if (n > 7 && !strncasecmp((char *) ptr, "ARTIST=", 7)) {
+			snprintf(artist, sizeof(artist), "%.*s", (int) n - 7, ptr + 7);
+		} else if (n > 6 && !strncasecmp((char *) ptr, "TITLE=", 6)) {
+			snprintf(title, sizeof(title), "%.*s", (int) n - 6, ptr + 6);
+		}
+		ptr += n;
+	}
+
+	if (!*title || stream.meta_interval) return;
+
+	stream.header_len = snprintf(stream.header, MAX_HEADER, "StreamTitle='%s%s%s';", artist, *artist ? " - " : "", title);
+	stream.meta_send = true;
+	LOG_INFO("ogg meta: %s", stream.header);
+
+	wake_controller();
+}
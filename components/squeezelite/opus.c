@@ -23,36 +23,37 @@
 #include "squeezelite.h"
 
 /* 
-*  with some low-end CPU, the decode call takes a fair bit of time and if the outputbuf is locked during that
-*  period, the output_thread (or equivalent) will be locked although there is plenty of samples available.
-*  Normally, with PRIO_INHERIT, that thread should increase decoder priority and get the lock quickly but it
-*  seems that when the streambuf has plenty of data, the decode thread grabs the CPU to much, even it the output
-*  thread has a higher priority. Using an interim buffer where opus decoder writes the output is not great from
-*  an efficiency (one extra memory copy) point of view, but it allows the lock to not be kept for too long
+*  Ogg pages are demuxed in place from streambuf (see ogg.c) and packets go straight to the opus decoder. When
+*  there is enough contiguous room, the decoder writes directly in the free part of outputbuf without holding the
+*  lock as this thread is the only one writing there (flush and resize only happen with decode mutex held), then
+*  the lock is taken to publish the frames. Samples are 16 bits so in-place widening (if any) is done from the end
+*  backward. Otherwise (buffer wrap, pre-skip or end trimming) the packet is decoded aside then copied.
 */
-#if EMBEDDED
-#define FRAME_BUF 2048
-#endif
-
 #if BYTES_PER_FRAME == 4		
 #define ALIGN(n) 	(n)
 #else
 #define ALIGN(n) 	(n << 16)		
 #endif
 
-#include <opusfile.h>
+#include <opus.h>
+
+// 120 ms at 48 kHz is the longest packet
+#define MAX_FRAMES 5760
 
 struct opus {
-	struct OggOpusFile *of;
-#if FRAME_BUF
-	u8_t *write_buf;
-#endif
+	struct ogg ogg;
+	OpusDecoder *decoder;
+	int channels, headers;
+	u32_t skip;
+	s64_t pos;
+	s16_t *aside;
 #if !LINKALL
 	// opus symbols to be dynamically loaded
-	void (*op_free)(OggOpusFile *_of);
-	int  (*op_read)(OggOpusFile *_of, opus_int16 *_pcm, int _buf_size, int *_li);
-	const OpusHead* (*op_head)(OggOpusFile *_of, int _li);
-	OggOpusFile*  (*op_open_callbacks) (void *_source, OpusFileCallbacks *_cb, unsigned char *_initial_data, size_t _initial_bytes, int *_error);
+	OpusDecoder* (*opus_decoder_create)(opus_int32 Fs, int channels, int *error);
+	void (*opus_decoder_destroy)(OpusDecoder *st);
+	int (*opus_decoder_ctl)(OpusDecoder *st, int request, ...);
+	int (*opus_decode)(OpusDecoder *st, const unsigned char *data, opus_int32 len, opus_int16 *pcm, int frame_size, int decode_fec);
+	int (*opus_packet_get_nb_samples)(const unsigned char packet[], opus_int32 len, opus_int32 Fs);
 #endif
 };
 
@@ -88,186 +89,251 @@ extern struct processstate process;
 #endif
 
 #if LINKALL
-#define OP(h, fn, ...) (op_ ## fn)(__VA_ARGS__)
+#define OP(h, fn, ...) (opus_ ## fn)(__VA_ARGS__)
 #else
-#define OP(h, fn, ...) (h)->op_ ## fn(__VA_ARGS__)
+#define OP(h, fn, ...) (h)->opus_ ## fn(__VA_ARGS__)
 #endif
 
-// called with mutex locked within vorbis_decode to avoid locking O before S
-static int _read_cb(void *datasource, char *ptr, int size) {
-	size_t bytes;
+static bool _probe(u8_t *packet, u32_t len) {
+	return len >= 8 && !memcmp(packet, "OpusHead", 8);
+}
 
-	LOCK_S;
+// parse OpusHead and create decoder, only channel mapping family 0 (mono or stereo) is supported
+static bool _head(u8_t *packet, u32_t len) {
+	s16_t gain;
+	int err;
 
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	bytes = min(bytes, size);
-	
-	memcpy(ptr, streambuf->readp, bytes);
-	_buf_inc_readp(streambuf, bytes);
+	if (len < 19 || packet[8] >> 4) {
+		LOG_WARN("unsupported header, len: %u version: %u", len, len > 8 ? packet[8] : 0);
+		return false;
+	}
 
-	UNLOCK_S;
+	if (packet[18] || packet[9] < 1 || packet[9] > 2) {
+		LOG_WARN("unsupported mapping family: %u channels: %u", packet[18], packet[9]);
+		return false;
+	}
+
+	u->channels = packet[9];
+	u->skip = packet[10] | packet[11] << 8;
+	gain = packet[16] | packet[17] << 8;
+	u->pos = 0;
+
+	if (u->decoder) OP(u, decoder_destroy, u->decoder);
+	u->decoder = OP(u, decoder_create, 48000, u->channels, &err);
+
+	if (!u->decoder) {
+		LOG_WARN("can't create decoder: %d", err);
+		return false;
+	}
 
-	return bytes;
+	if (gain) OP(u, decoder_ctl, u->decoder, OPUS_SET_GAIN(gain));
+
+	LOG_INFO("channels: %d pre-skip: %u gain: %d", u->channels, u->skip, gain);
+	return true;
 }
 
 static decode_state opus_decompress(void) {
-	frames_t frames;
+	frames_t frames, space, skip = 0, trim = 0;
+	u8_t *data;
+	u32_t len;
+	s16_t *iptr;
+	ISAMPLE_T *optr;
+	bool eos, direct;
 	int n;
-	static int channels;
-	u8_t *write_buf;
 
 	LOCK_S;
+	eos = stream.state <= DISCONNECT;
+	n = _ogg_next_packet(&u->ogg, &data, &len);
+	UNLOCK_S;
 
-	if (stream.state <= DISCONNECT && !_buf_used(streambuf)) {
-		UNLOCK_S;
-		return DECODE_COMPLETE;
+	if (!n) {
+		if (eos) LOG_INFO("end of stream");
+		return eos ? DECODE_COMPLETE : DECODE_RUNNING;
 	}
 
-	UNLOCK_S;
-
-	if (decode.new_stream) {
-		struct OpusFileCallbacks cbs;
-		const struct OpusHead *info;
-		int err;
+	// first packet of a chained stream, headers will follow
+	if (u->ogg.chained && u->ogg.packetno == 1) {
+		u->headers = 0;
+	}
 
-		cbs.read = (op_read_func) _read_cb;
-		cbs.seek = NULL; cbs.tell = NULL; cbs.close = NULL;
+	if (u->headers == 0) {
+		if (!_head(data, len)) return DECODE_ERROR;
+		u->headers = 1;
+		return DECODE_RUNNING;
+	}
 
-		if ((u->of = OP(u, open_callbacks, streambuf, &cbs, NULL, 0, &err)) == NULL) {
-			LOG_WARN("open_callbacks error: %d", err);
-			return DECODE_COMPLETE;
+	if (u->headers == 1) {
+		// a chained stream is a new track with its own tags
+		if (u->ogg.chained) {
+			LOCK_S;
+			if (len > 8) _ogg_comments(data + 8, len - 8);
+			UNLOCK_S;
+			decode.new_stream = true;
+			u->ogg.chained = false;
 		}
 
-		info = OP(u, head, u->of, -1);
-
-		LOCK_O;
-		output.next_sample_rate = decode_newstream(48000, output.supported_rates);
-		IF_DSD(	output.next_fmt = PCM; )
-		output.track_start = outputbuf->writep;
-		if (output.fade_mode) _checkfade(true);
-		decode.new_stream = false;
-		UNLOCK_O;
+		if (decode.new_stream) {
+			LOG_INFO("setting track_start");
+			LOCK_O;
+			output.next_sample_rate = decode_newstream(48000, output.supported_rates);
+			IF_DSD(	output.next_fmt = PCM; )
+			output.track_start = outputbuf->writep;
+			if (output.fade_mode) _checkfade(true);
+			decode.new_stream = false;
+			UNLOCK_O;
+		}
 
-        channels = info->channel_count;
+		u->headers = 2;
+		return DECODE_RUNNING;
+	}
 
-		LOG_INFO("setting track_start");
+	frames = OP(u, packet_get_nb_samples, data, len, 48000);
+	if ((int) frames <= 0 || frames > MAX_FRAMES) {
+		LOG_DEBUG("invalid packet: %d", (int) frames);
+		return DECODE_RUNNING;
 	}
 
-#if FRAME_BUF
-	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		frames = min(frames, FRAME_BUF);
-		write_buf = u->write_buf;
-	);
-#else
 	LOCK_O_direct;
 	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		write_buf = outputbuf->writep;
+		space = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+		optr = (ISAMPLE_T *) outputbuf->writep;
 	);
-#endif
+	UNLOCK_O_direct;
 	IF_PROCESS(
-		frames = process.max_in_frames;
-		write_buf = process.inbuf;
+		space = process.max_in_frames;
+		optr = (ISAMPLE_T *) process.inbuf;
 	);
 
-	// write the decoded frames into outputbuf then unpack them (they are 16 bits)
-	n = OP(u, read, u->of, (opus_int16*) write_buf, frames * channels, NULL);
-			
-#if FRAME_BUF
-	LOCK_O_direct;
-#endif
+	direct = frames <= space && !u->skip && !u->ogg.last;
 
-	if (n > 0) {
-		frames_t count;
-		s16_t *iptr;
-		ISAMPLE_T *optr;
+	if (!direct && !u->aside) {
+		u->aside = malloc(MAX_FRAMES * 2 * sizeof(s16_t));
+		if (!u->aside) {
+			LOG_WARN("malloc fail");
+			return DECODE_ERROR;
+		}
+	}
 
-		frames = n;
-		count = frames * channels;
+	iptr = direct ? (s16_t *) optr : u->aside;
+	n = OP(u, decode, u->decoder, data, len, (opus_int16 *) iptr, frames, 0);
+
+	if (n < 0) {
+		LOG_DEBUG("decode error: %d", n);
+		return DECODE_RUNNING;
+	}
+
+	frames = n;
+	u->pos += n;
+
+	if (u->skip) {
+		skip = min(frames, u->skip);
+		u->skip -= skip;
+		LOG_DEBUG("pre-skip: %u frames", skip);
+	}
+
+	// granule of last page is the exact end of the stream
+	if (u->ogg.last && u->ogg.granule >= 0 && u->pos > u->ogg.granule) {
+		trim = min(frames - skip, u->pos - u->ogg.granule);
+		LOG_DEBUG("trimming %u frames from end", trim);
+	}
+
+	frames -= skip + trim;
+	iptr += skip * u->channels;
+
+	if (direct) {
+		frames_t count = frames * u->channels;
 
 		// work backward to unpack samples (if needed)
-		iptr = (s16_t *) write_buf + count;
-		optr = (ISAMPLE_T *) write_buf + frames * 2;
-		
-		if (channels == 2) {
-#if BYTES_PER_FRAME == 4
-#if FRAME_BUF
-			// copy needed only when DIRECT and FRAME_BUF
-			IF_DIRECT(
-				memcpy(outputbuf->writep, write_buf, frames * BYTES_PER_FRAME);
-			)	
-#endif			
-#else
+		iptr += count;
+		optr += frames * 2;
+
+#if BYTES_PER_FRAME == 8
+		if (u->channels == 2) {
 			while (count--) {
 				*--optr = ALIGN(*--iptr);
 			}
+		} else
 #endif
-		} else if (channels == 1) {
+		if (u->channels == 1) {
 			while (count--) {
 				*--optr = ALIGN(*--iptr);
 				*--optr = ALIGN(*iptr);
 			}
 		}
 
+		LOCK_O_direct;
 		IF_DIRECT(
 			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
 		);
+		UNLOCK_O_direct;
 		IF_PROCESS(
 			process.in_frames = frames;
 		);
+	} else {
+		LOCK_O_direct;
 
-		LOG_SDEBUG("wrote %u frames", frames);
+		while (frames > 0) {
+			frames_t f, count;
 
-	} else if (n == 0) {
+			IF_DIRECT(
+				f = min(frames, _buf_cont_write(outputbuf) / BYTES_PER_FRAME);
+				optr = (ISAMPLE_T *) outputbuf->writep;
+			);
+			IF_PROCESS(
+				f = min(frames, process.max_in_frames - process.in_frames);
+				optr = (ISAMPLE_T *)((u8_t *) process.inbuf + process.in_frames * BYTES_PER_FRAME);
+			);
 
-		if (stream.state <= DISCONNECT) {
-			LOG_INFO("partial decode");
-			UNLOCK_O_direct;
-			UNLOCK_S;
-			return DECODE_COMPLETE;
-		} else {
-			LOG_INFO("no frame decoded");
-        }
+			count = f;
 
-	} else if (n == OP_HOLE) {
+			if (u->channels == 2) {
+#if BYTES_PER_FRAME == 4
+				memcpy(optr, iptr, count * BYTES_PER_FRAME);
+				iptr += count * 2;
+#else
+				while (count--) {
+					*optr++ = ALIGN(*iptr++);
+					*optr++ = ALIGN(*iptr++);
+				}
+#endif
+			} else {
+				while (count--) {
+					*optr++ = ALIGN(*iptr);
+					*optr++ = ALIGN(*iptr++);
+				}
+			}
 
-		// recoverable hole in stream, seen when skipping
-		LOG_DEBUG("hole in stream");
+			frames -= f;
 
-	} else {
+			IF_DIRECT(
+				_buf_inc_writep(outputbuf, f * BYTES_PER_FRAME);
+			);
+			IF_PROCESS(
+				process.in_frames += f;
+			);
+		}
 
-		LOG_INFO("op_read error: %d", n);
 		UNLOCK_O_direct;
-		return DECODE_COMPLETE;
 	}
 
-	UNLOCK_O_direct;
+	LOG_SDEBUG("wrote %u frames", n - skip - trim);
 
 	return DECODE_RUNNING;
 }
 
-
 static void opus_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
-	if (!u->of) {
-#if FRAME_BUF
-		if (!u->write_buf) u->write_buf = malloc(FRAME_BUF * BYTES_PER_FRAME);
-#endif
-	} else {
-		OP(u, free, u->of);
-		u->of = NULL;
-	}	
+	u->headers = 0;
+	ogg_init(&u->ogg, _probe);
 }
 
 static void opus_close(void) {
-	if (u->of) {
-		OP(u, free, u->of);
-		u->of = NULL;
+	if (u->decoder) {
+		OP(u, decoder_destroy, u->decoder);
+		u->decoder = NULL;
 	}
-#if FRAME_BUF
-	free(u->write_buf);
-	u->write_buf = NULL;
-#endif
+	free(u->aside);
+	u->aside = NULL;
+	ogg_close(&u->ogg);
 }
 
 static bool load_opus(void) {
@@ -280,10 +346,11 @@ static bool load_opus(void) {
 		return false;
 	}
 
-	u->op_free = dlsym(handle, "op_free");
-	u->op_read = dlsym(handle, "op_read");
-	u->op_head = dlsym(handle, "op_head");
-	u->op_open_callbacks = dlsym(handle, "op_open_callbacks");
+	u->opus_decoder_create = dlsym(handle, "opus_decoder_create");
+	u->opus_decoder_destroy = dlsym(handle, "opus_decoder_destroy");
+	u->opus_decoder_ctl = dlsym(handle, "opus_decoder_ctl");
+	u->opus_decode = dlsym(handle, "opus_decode");
+	u->opus_packet_get_nb_samples = dlsym(handle, "opus_packet_get_nb_samples");
 	
 	if ((err = dlerror()) != NULL) {
 		LOG_INFO("dlerror: %s", err);
@@ -305,18 +372,14 @@ struct codec *register_opus(void) {
 		opus_open, 	  // open
 		opus_close,   // close
 		opus_decompress,  // decode
+		true,         // keep warm
 	};
 
-	u = malloc(sizeof(struct opus));
+	u = calloc(1, sizeof(struct opus));
 	if (!u) {
 		return NULL;
 	}
 
-	u->of = NULL;
-#if FRAME_BUF	
-	u->write_buf = NULL;
-#endif	
-
 	if (!load_opus()) {
 		return NULL;
 	}
@@ -324,4 +387,3 @@ struct codec *register_opus(void) {
 	LOG_INFO("using opus to decode ops");
 	return &ret;
 }
-
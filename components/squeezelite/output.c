@@ -41,12 +41,92 @@ bool user_rates = false;
 #define LOCK   mutex_lock(outputbuf->mutex)
 #define UNLOCK mutex_unlock(outputbuf->mutex)
 
+extern struct buffer *streambuf;
+extern struct decodestate decode;
+
+// below that, decoder is likely waiting for data rather than for CPU
+#define STREAM_STARVED	4096
+
+static struct {
+	frames_t lead, fade, len;	// frames to play before fading out, left to fade and fade length
+	frames_t fade_in;			// frames left to fade in after recovery
+	bool silent;
+	u32_t start;
+	u32_t count, stream, decode, total_ms, max_ms;
+} underrun;
+
 // functions starting _* are called with mutex locked
 
+static void _underrun_end(void) {
+	u32_t ms = gettime_ms() - underrun.start;
+
+	underrun.silent = false;
+	underrun.total_ms += ms;
+	if (ms > underrun.max_ms) underrun.max_ms = ms;
+	LOG_INFO("underrun over after %u ms", ms);
+}
+
+// when outputbuf is about to run dry while decoder still runs, fade out what is left, play silence until
+// enough has been buffered again and then fade back in, instead of hard cuts in and out of silence
+static frames_t _underrun_check(frames_t frames, frames_t avail) {
+	frames_t fade = output.current_sample_rate * UNDERRUN_FADE_MS / 1000;
+	frames_t ahead = avail > fade ? avail : fade;
+
+	if (output.state != OUTPUT_RUNNING || (output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS)) return frames;
+	IF_DSD(
+		if (output.outfmt != PCM) return frames;
+	)
+
+	if (underrun.silent) {
+		// decoder done means no more data will come, so play what is left
+		if (frames < output.current_sample_rate * UNDERRUN_RESUME_MS / 1000 && decode.state == DECODE_RUNNING) return 0;
+		_underrun_end();
+		underrun.fade_in = underrun.len = min(fade, frames);
+	} else if (underrun.fade == underrun.len && frames > ahead) {
+		// refilled before fade has started
+		underrun.fade = 0;
+	} else if (!underrun.fade && frames && frames <= ahead && decode.state == DECODE_RUNNING) {
+		underrun.len = underrun.fade = min(fade, frames);
+		underrun.lead = frames - underrun.fade;
+		underrun.fade_in = 0;
+		LOG_DEBUG("underrun ahead, fading out %u frames after %u", underrun.fade, underrun.lead);
+	}
+
+	return frames;
+}
+
+// fade chunk at readp, returns true when silence is reached
+static bool _underrun_fade(frames_t out_frames) {
+	ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp;
+
+	if (underrun.fade_in) {
+		frames_t n = min(out_frames, underrun.fade_in);
+		_apply_fade(ptr, n, underrun.len - underrun.fade_in, underrun.len, true);
+		underrun.fade_in -= n;
+	} else if (underrun.fade) {
+		frames_t lead = min(out_frames, underrun.lead), n = min(out_frames - lead, underrun.fade);
+		_apply_fade(ptr + lead * 2, n, underrun.len - underrun.fade, underrun.len, false);
+		underrun.lead -= lead;
+		underrun.fade -= n;
+		if (!underrun.lead && !underrun.fade) {
+			underrun.silent = true;
+			underrun.start = gettime_ms();
+			underrun.count++;
+			// streambuf is read unlocked, just to guess which stage starved
+			if (_buf_used(streambuf) < STREAM_STARVED) underrun.stream++;
+			else underrun.decode++;
+			LOG_WARN("underrun #%u, %s starved", underrun.count, _buf_used(streambuf) < STREAM_STARVED ? "stream" : "decoder");
+			return true;
+		}
+	}
+
+	return false;
+}
+
 frames_t _output_frames(frames_t avail) {
 
 	frames_t frames, size;
-	bool silence;
+	bool silence, concealed = false;
 	
 	s32_t cross_gain_in = 0, cross_gain_out = 0; ISAMPLE_T *cross_ptr = NULL;
 	
@@ -107,6 +187,8 @@ frames_t _output_frames(frames_t avail) {
 		}
 	}
 	
+	frames = _underrun_check(frames, avail);
+
 	// play silence if buffering or no frames
 	if (output.state <= OUTPUT_BUFFER || frames == 0) {
 		silence = true;
@@ -197,7 +279,7 @@ frames_t _output_frames(frames_t avail) {
 						}
 						cur_f = 0;
 					} else if (output.fade_mode == FADE_CROSSFADE) {
-						LOG_INFO("crossfade complete");
+						LOG_INFO("crossfade complete (%u us per second)", _cross_bench());
 						if (_buf_used(outputbuf) >= dur_f * BYTES_PER_FRAME) {
 							_buf_inc_readp(outputbuf, dur_f * BYTES_PER_FRAME);
 							LOG_INFO("skipped crossfaded start");
@@ -222,7 +304,7 @@ frames_t _output_frames(frames_t avail) {
 						if (output.fade_dir == FADE_DOWN) {
 							cur_f = dur_f - cur_f;
 						}
-						fade_gain = to_gain((float)cur_f / (float)dur_f);
+						fade_gain = fade_curve_gain(output.fade_curve, cur_f, dur_f);
 						gainL = gain(gainL, fade_gain);
 						gainR = gain(gainR, fade_gain);
 						if (output.invert) { gainL = -gainL; gainR = -gainR; }
@@ -231,14 +313,11 @@ frames_t _output_frames(frames_t avail) {
 						// cross fade requires special treatment - performed later based on these values
 						// support different replay gain for old and new track by retaining old value until crossfade completes
 						if (_buf_used(outputbuf) / BYTES_PER_FRAME > dur_f + size) { 
-							cross_gain_in  = to_gain((float)cur_f / (float)dur_f);
-							cross_gain_out = FIXED_ONE - cross_gain_in;
-							if (output.current_replay_gain) {
-								cross_gain_out = gain(cross_gain_out, output.current_replay_gain);
-							}
-							if (output.next_replay_gain) {
-								cross_gain_in = gain(cross_gain_in, output.next_replay_gain);
-							}
+							// fade curve is applied per frame by _apply_cross, only tracks gains are set here
+							cross_gain_in = output.next_replay_gain ? output.next_replay_gain : FIXED_ONE;
+							cross_gain_out = output.current_replay_gain ? output.current_replay_gain : FIXED_ONE;
+							output.cross_pos = cur_f;
+							output.cross_len = dur_f;
 							gainL = output.gainL;
 							gainR = output.gainR;
 							if (output.invert) { gainL = -gainL; gainR = -gainR; }
@@ -254,6 +333,8 @@ frames_t _output_frames(frames_t avail) {
 		
 		out_frames = !silence ? min(size, cont_frames) : size;
 
+		if ((underrun.fade || underrun.fade_in) && !silence) concealed = _underrun_fade(out_frames);
+
 		wrote = output.write_cb(out_frames, silence, gainL, gainR, cross_gain_in, cross_gain_out, &cross_ptr);
 
 		if (wrote <= 0) {
@@ -270,6 +351,10 @@ frames_t _output_frames(frames_t avail) {
 		if (!silence) {
 			_buf_inc_readp(outputbuf, out_frames * BYTES_PER_FRAME);
 			output.frames_played += out_frames;
+			if (concealed) {
+				frames -= size;
+				break;
+			}
 		}
 	}
 			
@@ -294,6 +379,7 @@ void _checkfade(bool start) {
 		LOG_INFO("fade IN: %u frames", bytes / BYTES_PER_FRAME);
 		output.fade = FADE_DUE;
 		output.fade_dir = FADE_UP;
+		output.fade_curve = output.fade_curves[output.fade_mode];
 		output.fade_start = outputbuf->writep;
 		output.fade_end = output.fade_start + bytes;
 		if (output.fade_end >= outputbuf->wrap) {
@@ -306,6 +392,7 @@ void _checkfade(bool start) {
 		LOG_INFO("fade %s: %u frames", output.fade_mode == FADE_INOUT ? "IN-OUT" : "OUT", bytes / BYTES_PER_FRAME);
 		output.fade = FADE_DUE;
 		output.fade_dir = FADE_DOWN;
+		output.fade_curve = output.fade_curves[output.fade_mode];
 		output.fade_start = outputbuf->writep - bytes;
 		if (output.fade_start < outputbuf->buf) {
 			output.fade_start += outputbuf->size;
@@ -324,6 +411,7 @@ void _checkfade(bool start) {
 			LOG_INFO("CROSSFADE: %u frames", bytes / BYTES_PER_FRAME);
 			output.fade = FADE_DUE;
 			output.fade_dir = FADE_CROSS;
+			output.fade_curve = output.fade_curves[FADE_CROSSFADE];
 			output.fade_start = outputbuf->writep - bytes;
 			if (output.fade_start < outputbuf->buf) {
 				output.fade_start += outputbuf->size;
@@ -378,6 +466,10 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 	output.device = device;
 	output.fade = FADE_INACTIVE;
 	output.invert = false;
+	// equal power keeps loudness constant when mixing uncorrelated tracks
+	output.fade_curves[FADE_CROSSFADE] = FADE_POWER;
+	fade_curves_init();
+	output.ramp_ms = GAIN_RAMP_MS;
 	output.error_opening = false;
 	output.idle_to = (u32_t) idle;
 
@@ -441,6 +533,8 @@ void output_flush(void) {
 	buf_flush(outputbuf);
 	LOCK;
 	output.fade = FADE_INACTIVE;
+	if (underrun.silent) _underrun_end();
+	underrun.fade = underrun.fade_in = 0;
 	if (output.state != OUTPUT_OFF) {
 		output.state = OUTPUT_STOPPED;
 		if (output.error_opening) {
@@ -451,3 +545,16 @@ void output_flush(void) {
 	output.frames_played = 0;
 	UNLOCK;
 }
+
+// lock-free snapshot of word sized counters: it is called from status.json also when the player has
+// not been started or has been closed (no outputbuf), and a stat one underrun behind is good enough
+void output_underruns(u32_t *count, u32_t *stream_count, u32_t *decode_count, u32_t *total_ms, u32_t *max_ms) {
+	bool silent = __atomic_load_n(&underrun.silent, __ATOMIC_RELAXED);
+	
+	*count = __atomic_load_n(&underrun.count, __ATOMIC_RELAXED);
+	*stream_count = __atomic_load_n(&underrun.stream, __ATOMIC_RELAXED);
+	*decode_count = __atomic_load_n(&underrun.decode, __ATOMIC_RELAXED);
+	*total_ms = __atomic_load_n(&underrun.total_ms, __ATOMIC_RELAXED);
+	if (silent) *total_ms += gettime_ms() - __atomic_load_n(&underrun.start, __ATOMIC_RELAXED);
+	*max_ms = __atomic_load_n(&underrun.max_ms, __ATOMIC_RELAXED);
+}
@@ -12,6 +12,8 @@
 #include "driver/gpio.h"
 #include "squeezelite.h"
 #include "equalizer.h"
+#include "convolver.h"
+#include "limiter.h"
 #include "perf_trace.h"
 #include "config.h"
 
@@ -76,6 +78,8 @@ void output_close_bt(void) {
 	UNLOCK;
 	hal_bluetooth_stop();
 	equalizer_close();
+	convolver_close();
+	limiter_close();
 }	
 
 static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t gainR,
@@ -83,13 +87,16 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 	
 	assert(btout != NULL);
 	
+	// positive gain is applied by limiter, after equalizer
+	_limiter_gain(&gainL, &gainR, out_frames);
+	
 	if (!silence ) {
 				
 		if (output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr) {
 			_apply_cross(outputbuf, out_frames, cross_gain_in, cross_gain_out, cross_ptr);
 		}
 
-		if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
+		if (gainL != FIXED_ONE || gainR!= FIXED_ONE || _gain_ramping(gainL, gainR)) {
 			_apply_gain(outputbuf, out_frames, gainL, gainR);
 		}
 
@@ -148,7 +155,9 @@ int32_t output_bt_data(uint8_t *data, int32_t len) {
 	}
 	output.frames_in_process = len-wanted_len;
 	
-	equalizer_process(data, (len - wanted_len) * BYTES_PER_FRAME, output.current_sample_rate);
+	equalizer_process(data, len - wanted_len, output.current_sample_rate);
+	convolver_process(data, len - wanted_len, output.current_sample_rate);
+	limiter_process(data, len - wanted_len, output.current_sample_rate);
 
 	UNLOCK;
 	SET_MIN_MAX(TIME_MEASUREMENT_GET(start_timer),lock_out_time);
@@ -181,6 +190,10 @@ void output_bt_tick(void) {
 		LOG_INFO(LINE_MIN_MAX_FORMAT,LINE_MIN_MAX("received",rec));
 		LOG_INFO(LINE_MIN_MAX_FORMAT,LINE_MIN_MAX("underrun",under));
 		LOG_INFO( "              +==========+==========+================+=====+================+");
+		u32_t count, stream_count, decode_count, total_ms, max_ms;
+		output_underruns(&count, &stream_count, &decode_count, &total_ms, &max_ms);
+		if (count) LOG_INFO("Concealed underruns: %u (stream %u, decoder %u), silence %u ms (max %u ms)", 
+							count, stream_count, decode_count, total_ms, max_ms);
 		LOG_INFO("\n");
 		LOG_INFO("              ==========+==========+===========+===========+  ");
 		LOG_INFO("              max (us)  | min (us) |   avg(us) |  count    |  ");
@@ -10,6 +10,9 @@
  */
 #include "squeezelite.h"
 #include "equalizer.h"
+#include "convolver.h"
+#include "limiter.h"
+#include "config.h"
 
 extern struct outputstate output;
 extern struct buffer *outputbuf;
@@ -44,8 +47,54 @@ static void (*close_cb)(void);
 struct eqlz_packet {
 	char  opcode[4];
 };
+
+struct chnl_packet {
+	char  opcode[4];
+	u8_t  mode;			// 0xff restores "channels" NVS parameter
+	u16_t sub_freq;
+};
 #pragma pack(pop)
 
+// "fade_curves" sets curve per transition, e.g. cross=power,in=log,out=linear,inout=log 
+static void set_fade_curves(void) {
+	static const char *modes[] = { "", "cross", "in", "out", "inout" };
+	static const char *curves[] = { "linear", "power", "log" };
+	char *config = config_alloc_get(NVS_TYPE_STR, "fade_curves"), *p = config;
+	
+	if (!config) return;
+	
+	do {
+		char mode[8], curve[8];
+		if (sscanf(p, "%7[^=]=%7[^,]", mode, curve) < 2) continue;
+		for (int i = FADE_CROSSFADE; i <= FADE_INOUT; i++) {
+			if (strcasecmp(mode, modes[i])) continue;
+			for (int j = 0; j < FADE_CURVES; j++) if (!strcasecmp(curve, curves[j])) output.fade_curves[i] = j;
+			LOG_INFO("fade %s with %s curve", modes[i], curves[output.fade_curves[i]]);
+		}
+	} while ((p = strchr(p, ',')) != NULL && p++);
+	
+	free(config);
+}
+
+// "channels" is <stereo|mono|swap|left|right|sub>[:<sub low-pass Hz>]
+static void set_channels(void) {
+	static const char *modes[] = { "stereo", "mono", "swap", "left", "right", "sub" };
+	char *config = config_alloc_get_default(NVS_TYPE_STR, "channels", "stereo", 0);
+	char *p = config ? strchr(config, ':') : NULL;
+	int mode = CHANNELS_STEREO;
+
+	if (!config) return;
+	if (p) *p++ = '\0';
+
+	for (int i = CHANNELS_STEREO; i <= CHANNELS_SUB; i++) if (!strcasecmp(config, modes[i])) mode = i;
+	LOCK;
+	_channels_set(mode, p ? atoi(p) : 0);
+	UNLOCK;
+	if (mode != CHANNELS_STEREO) LOG_INFO("channels %s", modes[mode]);
+
+	free(config);
+}
+
 static bool handler(u8_t *data, int len){
 	bool res = true;
 	
@@ -54,6 +103,16 @@ static bool handler(u8_t *data, int len){
 		LOG_INFO("got equalizer %d", len);
 		// update will be done at next opportunity
 		equalizer_update(gain);
+	} else if (!strncmp((char*) data, "chnl", 4)) {
+		struct chnl_packet *pkt = (struct chnl_packet*) data;
+		LOG_INFO("got channels %u", pkt->mode);
+		if (pkt->mode == 0xff) {
+			set_channels();
+		} else {
+			LOCK;
+			_channels_set(pkt->mode, ntohs(pkt->sub_freq));
+			UNLOCK;
+		}	
 	} else {
 		res = false;
 	}
@@ -77,6 +136,30 @@ void output_init_embedded(log_level level, char *device, unsigned output_buf_siz
 	output_init_common(level, device, output_buf_size, rates, idle);
 	output.start_frames = FRAME_BLOCK;
 	output.rate_delay = rate_delay;
+	set_fade_curves();
+	set_channels();
+	
+	char *p = config_alloc_get_default(NVS_TYPE_STR, "gain_ramp", STR(GAIN_RAMP_MS), 0);
+	if (p) output.ramp_ms = atoi(p);
+	free(p);
+	LOG_INFO("gain changes ramp over %u ms", output.ramp_ms);
+	
+	// "limiter" is <lookahead_ms>[:<release_ms>]
+	if ((p = config_alloc_get(NVS_TYPE_STR, "limiter")) != NULL) {
+		unsigned lookahead = 0, release = 150;
+		sscanf(p, "%u:%u", &lookahead, &release);
+		limiter_config(lookahead, release);
+		if (lookahead) LOG_INFO("limiter with %u ms look-ahead and %u ms release", lookahead, release);
+		free(p);
+	}	
+	
+	// "convolver" is <url of impulse response wav>[,<partition>]
+	if ((p = config_alloc_get(NVS_TYPE_STR, "convolver")) != NULL) {
+		char *partition = strchr(p, ',');
+		if (partition) *partition++ = '\0';
+		if (*p) convolver_load(p, partition ? atoi(partition) : 0);
+		free(p);
+	}	
 	
 	if (strcasestr(device, "BT ")) {
 		LOG_INFO("init Bluetooth");
@@ -113,7 +196,11 @@ void set_volume(unsigned left, unsigned right) {
 
 bool test_open(const char *device, unsigned rates[], bool userdef_rates) {
 	memset(rates, 0, MAX_SUPPORTED_SAMPLERATES * sizeof(unsigned));
-	if (!strcasecmp(device, "I2S")) {
+	if (strcasestr(device, "I2S") && strcasestr(device, "SPDIF")) {
+		// dual mode is bound by what S/PDIF can do
+		unsigned _rates[] = { 48000, 44100, 0 };	
+		memcpy(rates, _rates, sizeof(_rates));
+	} else if (!strcasecmp(device, "I2S")) {
 		unsigned _rates[] = { 192000, 176400, 96000, 88200, 48000, 
 							  44100, 32000, 24000, 22050, 16000, 
 							  12000, 11025, 8000, 0 };	
@@ -45,6 +45,9 @@ sure that using rate_delay would fix that
 #include "config.h"
 #include "accessors.h"
 #include "equalizer.h"
+#include "convolver.h"
+#include "crossover.h"
+#include "limiter.h"
 #include "globdefs.h"
 
 #define LOCK   mutex_lock(outputbuf->mutex)
@@ -52,15 +55,38 @@ sure that using rate_delay would fix that
 
 #define FRAME_BLOCK MAX_SILENCE_FRAMES
 
-// must have an integer ratio with FRAME_BLOCK (see spdif comment)
-#define DMA_BUF_LEN		512	
-#define DMA_BUF_COUNT	12
+/* 
+ DMA profiles set buffer length (so interrupt rate) and depth (so latency), the count
+ is derived from the target depth at a given rate and capped to limit internal RAM
+ use. Length must have an integer ratio with FRAME_BLOCK (see spdif comment). When 
+ DMA capable memory is short, the next smaller profile is used
+*/ 
+enum { DMA_LOW_LATENCY = 0, DMA_EFFICIENT, DMA_HIGH_RATE };
+static const struct {
+	char *name;
+	int len;
+	unsigned ms;
+	int max_count;
+} dma_profiles[] = {
+	{ "low latency", 128, 20, 24 },		// BT sink & AirPlay
+	{ "efficient", 512, 140, 12 },		// LMS
+	{ "high rate", 512, 64, 24 },		// 176.4/192 kHz
+};	
+
+#define DMA_RESERVE		(16*1024)	// DMA capable memory left for others (WiFi)
+
+// hardware volume is sent at most that often (latest value wins)
+#define HW_VOLUME_MS	50
 
 #define DECLARE_ALL_MIN_MAX 	\
 	DECLARE_MIN_MAX(o); 		\
 	DECLARE_MIN_MAX(s); 		\
 	DECLARE_MIN_MAX(rec); 		\
 	DECLARE_MIN_MAX(i2s_time); 	\
+	DECLARE_MIN_MAX(encode); 	\
+	DECLARE_MIN_MAX(gain_time);	\
+	DECLARE_MIN_MAX(dsp);		\
+	DECLARE_MIN_MAX(hw_volume);	\
 	DECLARE_MIN_MAX(buffering);
 
 #define RESET_ALL_MIN_MAX 		\
@@ -68,12 +94,17 @@ sure that using rate_delay would fix that
 	RESET_MIN_MAX(s); 			\
 	RESET_MIN_MAX(rec);	\
 	RESET_MIN_MAX(i2s_time);	\
+	RESET_MIN_MAX(encode);		\
+	RESET_MIN_MAX(gain_time);	\
+	RESET_MIN_MAX(dsp);			\
+	RESET_MIN_MAX(hw_volume);	\
 	RESET_MIN_MAX(buffering);
 	
 #define STATS_PERIOD_MS 5000
 #define STAT_STACK_SIZE	(3*1024)
 
 extern struct outputstate output;
+extern struct streamstate stream;
 extern struct buffer *streambuf;
 extern struct buffer *outputbuf;
 extern u8_t *silencebuf;
@@ -89,11 +120,28 @@ static bool running, isI2SStarted;
 static i2s_config_t i2s_config;
 static u8_t *obuf;
 static frames_t oframes;
-static bool spdif;
+static bool spdif, dual;
 static size_t dma_buf_frames;
+static struct {
+	int profile, len, count;
+	frames_t block;
+	u32_t busy_us;		// output thread adds, stats task takes, both atomically
+} dma = { -1 };
 static pthread_t thread;
 static TaskHandle_t stats_task;
 static bool stats;
+static struct {
+	bool enabled, spdif;
+	bool refused;		// can't share APLL with main port at current rate
+	i2s_port_t num;
+	u8_t *obuf;
+} aux;					// other I2S port, for crossover low band or S/PDIF in dual mode
+static struct {
+	bool enabled, pending;
+	unsigned left, right;
+	u32_t last;
+} dac_volume;			// volume applied by DAC instead of digital gain
+static u32_t gain_us;
 static struct {
 	int gpio, active;
 } amp_control = { -1, 1 },
@@ -106,6 +154,11 @@ static int _i2s_write_frames(frames_t out_frames, bool silence, s32_t gainL, s32
 static void *output_thread_i2s(void *arg);
 static void output_thread_i2s_stats(void *arg);
 static void spdif_convert(ISAMPLE_T *src, size_t frames, u32_t *dst, size_t *count);
+static int dma_profile(u32_t sample_rate);
+static bool dma_size(int profile, u32_t sample_rate);
+static void dma_apply(void);
+// in patched i2s.c
+extern esp_err_t i2s_set_dma_buf(i2s_port_t i2s_num, int dma_buf_count, int dma_buf_len);
 static void (*jack_handler_chain)(bool inserted);
 
 #define I2C_PORT	0
@@ -195,6 +248,8 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	loglevel = level;
 	int silent_do = -1;
 	char *p;
+	// dual mode drives the DAC and S/PDIF at the same time, from the same obuf
+	dual = strcasestr(device, "i2s") && strcasestr(device, "spdif");
 	esp_err_t res;
 
 	// chain SLIMP handlers
@@ -248,8 +303,9 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	i2s_config.use_apll = true;
 	i2s_config.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1; //Interrupt level 1
 	
-	if (strcasestr(device, "spdif")) {
-		spdif = true;	
+	spdif = strcasestr(device, "spdif") && !dual;
+	
+	if (spdif) {
 
 		if (i2s_spdif_pin.bck_io_num == -1 || i2s_spdif_pin.ws_io_num == -1 || i2s_spdif_pin.data_out_num == -1) {
 			LOG_WARN("Cannot initialize I2S for SPDIF bck:%d ws:%d do:%d", i2s_spdif_pin.bck_io_num, 
@@ -259,15 +315,16 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 									
 		i2s_config.sample_rate = output.current_sample_rate * 2;
 		i2s_config.bits_per_sample = 32;
+		dma_size(dma_profile(output.current_sample_rate), output.current_sample_rate);
 		// Normally counted in frames, but 16 sample are transformed into 32 bits in spdif
-		i2s_config.dma_buf_len = DMA_BUF_LEN / 2;	
-		i2s_config.dma_buf_count = DMA_BUF_COUNT * 2;
+		i2s_config.dma_buf_len = dma.len / 2;	
+		i2s_config.dma_buf_count = dma.count * 2;
 		/* 
 		   In DMA, we have room for (LEN * COUNT) frames of 32 bits samples that 
 		   we push at sample_rate * 2. Each of these peuso-frames is a single true
 		   audio frame. So the real depth is true frames is (LEN * COUNT / 2)
+		   (dma_buf_frames is set accordingly by dma_size)
 		*/   
-		dma_buf_frames = DMA_BUF_COUNT * DMA_BUF_LEN / 2;	
 		
 		// silence DAC output if sharing the same ws/bck
 		if (i2s_dac_pin.ws_io_num == i2s_spdif_pin.ws_io_num && i2s_dac_pin.bck_io_num == i2s_spdif_pin.bck_io_num)	silent_do = i2s_dac_pin.data_out_num;		
@@ -278,13 +335,9 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	} else {
 		i2s_config.sample_rate = output.current_sample_rate;
 		i2s_config.bits_per_sample = BYTES_PER_FRAME * 8 / 2;
-		// Counted in frames (but i2s allocates a buffer <= 4092 bytes)
-		i2s_config.dma_buf_len = DMA_BUF_LEN;	
-		i2s_config.dma_buf_count = DMA_BUF_COUNT;
-		dma_buf_frames = DMA_BUF_COUNT * DMA_BUF_LEN;	
 		
-		// silence SPDIF output
-		silent_do = i2s_spdif_pin.data_out_num;		
+		// silence SPDIF output (unless we use it)
+		if (!dual) silent_do = i2s_spdif_pin.data_out_num;		
 
 		char model[32] = "i2s";
 		if ((p = strcasestr(dac_config, "model")) != NULL) sscanf(p, "%*[^=]=%31[^,]", model);
@@ -297,10 +350,76 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 
 		for (int i = 0; adac == &dac_external && dac_set[i]; i++) if (strcasestr(dac_set[i]->model, model)) adac = dac_set[i];
 		res = adac->init(dac_config, I2C_PORT, &i2s_config) ? ESP_OK : ESP_FAIL;
+		
+		// crossover sends low band to the other I2S port, both use APLL so they share the same clock
+		char *crossover_config_str = dual ? NULL : config_alloc_get(NVS_TYPE_STR, "crossover");
+		bool crossover = crossover_config(crossover_config_str);
+		
+		/* DAC may have changed bits per sample, now size DMA for both ports before installing
+		   any (so profile steps down instead of other port failing). Flags are set by install */
+		aux.spdif = dual;
+		aux.enabled = dual || crossover;
+		dma_size(dma_profile(output.current_sample_rate), output.current_sample_rate);
+		aux.enabled = aux.spdif = false;
+		
+		// Counted in frames (but i2s allocates a buffer <= 4092 bytes)
+		i2s_config.dma_buf_len = dma.len;	
+		// in dual mode, S/PDIF port holds half as many true frames, so DAC must not be deeper
+		i2s_config.dma_buf_count = dual ? dma.count / 2 : dma.count;
 
 		res |= i2s_driver_install(CONFIG_I2S_NUM, &i2s_config, 0, NULL);
 		res |= i2s_set_pin(CONFIG_I2S_NUM, &i2s_dac_pin);
 		
+		// S/PDIF on the other I2S port, at twice the rate with 32 bits samples. The APLL is shared (see i2s.c patch) 
+		aux.num = CONFIG_I2S_NUM == I2S_NUM_0 ? I2S_NUM_1 : I2S_NUM_0;
+		if (res == ESP_OK && dual) {
+			i2s_config_t spdif_i2s_config = i2s_config;
+			spdif_i2s_config.sample_rate = i2s_config.sample_rate * 2;
+			spdif_i2s_config.bits_per_sample = 32;
+			spdif_i2s_config.dma_buf_len = dma.len / 2;
+			spdif_i2s_config.dma_buf_count = dma.count * 2;
+			
+			if (i2s_spdif_pin.ws_io_num == i2s_dac_pin.ws_io_num || i2s_spdif_pin.bck_io_num == i2s_dac_pin.bck_io_num) {
+				LOG_ERROR("S/PDIF and DAC can't share bck/ws in dual mode");
+			} else {
+				aux.enabled = i2s_driver_install(aux.num, &spdif_i2s_config, 0, NULL) == ESP_OK;
+				if (aux.enabled && i2s_set_pin(aux.num, &i2s_spdif_pin) != ESP_OK) {
+					i2s_driver_uninstall(aux.num);
+					aux.enabled = false;
+				}	
+			}
+			
+			if (aux.enabled) {
+				aux.spdif = true;
+				LOG_INFO("SPDIF using I2S %d bck:%d, ws:%d, do:%d", aux.num, i2s_spdif_pin.bck_io_num, i2s_spdif_pin.ws_io_num, i2s_spdif_pin.data_out_num);
+			} else {
+				LOG_ERROR("can't use I2S %d for S/PDIF", aux.num);
+			}	
+		}	
+		
+		if (res == ESP_OK && crossover) {
+			i2s_pin_config_t i2s_aux_pin;
+			set_i2s_pin(crossover_config_str, &i2s_aux_pin);
+			aux.obuf = malloc(FRAME_BLOCK * BYTES_PER_FRAME);
+			aux.enabled = aux.obuf && i2s_driver_install(aux.num, &i2s_config, 0, NULL) == ESP_OK;
+			if (aux.enabled && i2s_set_pin(aux.num, &i2s_aux_pin) != ESP_OK) {
+				i2s_driver_uninstall(aux.num);
+				aux.enabled = false;
+			}	
+			if (!aux.enabled) {
+				LOG_ERROR("can't use I2S %d for crossover", aux.num);
+				crossover_config(NULL);
+				free(aux.obuf);
+				aux.obuf = NULL;
+			} else {
+				LOG_INFO("crossover low band on I2S %d bck:%d, ws:%d, do:%d", aux.num, i2s_aux_pin.bck_io_num, 
+						 i2s_aux_pin.ws_io_num, i2s_aux_pin.data_out_num);
+			}	
+		} else if (crossover) {
+			crossover_config(NULL);
+		}	
+		free(crossover_config_str);
+		
 		if (res == ESP_OK && mute_control.gpio >= 0) {
 			gpio_pad_select_gpio(mute_control.gpio);
 			gpio_set_direction(mute_control.gpio, GPIO_MODE_OUTPUT);
@@ -314,6 +433,13 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	free(dac_config);
 	free(spdif_config);
 	
+	/* prefer DAC's own attenuator (bit-perfect output, no resolution loss) but not when the 
+	   other port also plays as it would not follow. Set it to unity to know if it can */
+	if (res == ESP_OK && !spdif && !aux.enabled && adac->volume(FIXED_ONE, FIXED_ONE)) {
+		dac_volume.enabled = true;
+		LOG_INFO("volume is handled by %s DAC", adac->model);
+	}	
+	
 	if (res != ESP_OK) {
 		LOG_WARN("no DAC configured");
 		return;
@@ -326,12 +452,16 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 		gpio_set_level(silent_do, 0);
 	}	
 
-	LOG_INFO("Initializing I2S mode %s with rate: %d, bits per sample: %d, buffer frames: %d, number of buffers: %d ", 
-			spdif ? "S/PDIF" : "normal", 
-			i2s_config.sample_rate, i2s_config.bits_per_sample, i2s_config.dma_buf_len, i2s_config.dma_buf_count);
+	LOG_INFO("Initializing I2S mode %s with rate: %d, bits per sample: %d, buffer frames: %d, number of buffers: %d (%s)", 
+			spdif ? "S/PDIF" : (aux.spdif ? "dual" : "normal"), 
+			i2s_config.sample_rate, i2s_config.bits_per_sample, i2s_config.dma_buf_len, i2s_config.dma_buf_count, dma_profiles[dma.profile].name);
 	
 	i2s_stop(CONFIG_I2S_NUM);
 	i2s_zero_dma_buffer(CONFIG_I2S_NUM);
+	if (aux.enabled) {
+		i2s_stop(aux.num);
+		i2s_zero_dma_buffer(aux.num);
+	}	
 	isI2SStarted=false;
 	
 	adac->power(ADAC_STANDBY);
@@ -347,11 +477,15 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	parse_set_GPIO(set_amp_gpio);
 		
 	esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+	task_config_t task;
+	config_task_get(&task, "output", cfg.pin_to_core, CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, 
+					PTHREAD_STACK_MIN + OUTPUT_THREAD_STACK_SIZE);
 	
     cfg.thread_name= "output_i2s";
     cfg.inherit_cfg = false;
-	cfg.prio = CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1;
-    cfg.stack_size = PTHREAD_STACK_MIN + OUTPUT_THREAD_STACK_SIZE;
+	cfg.pin_to_core = task.core;
+	cfg.prio = task.priority;
+    cfg.stack_size = task.stack_size;
     esp_pthread_set_cfg(&cfg);
 	pthread_create(&thread, NULL, output_thread_i2s, NULL);
 	
@@ -382,7 +516,18 @@ void output_close_i2s(void) {
 	i2s_driver_uninstall(CONFIG_I2S_NUM);
 	free(obuf);
 	
+	if (aux.enabled) {
+		i2s_driver_uninstall(aux.num);
+		free(aux.obuf);
+		crossover_close();
+		aux.enabled = aux.spdif = aux.refused = false;
+	}	
+	dac_volume.enabled = false;
+	dma.profile = -1;
+	
 	equalizer_close();
+	convolver_close();
+	limiter_close();
 	
 	adac->deinit();
 }
@@ -392,7 +537,17 @@ void output_close_i2s(void) {
  */
 bool output_volume_i2s(unsigned left, unsigned right) {
 	if (mute_control.gpio >= 0) gpio_set_level(mute_control.gpio, (left | right) ? !mute_control.active : mute_control.active);
-	return adac->volume(left, right);
+	if (!dac_volume.enabled) return false;
+	
+	// I2C is slow and volume comes in bursts when turning a knob, so output thread batches it
+	LOCK;
+	output.gainL = output.gainR = FIXED_ONE;
+	dac_volume.left = left;
+	dac_volume.right = right;
+	dac_volume.pending = true;
+	UNLOCK;
+	
+	return true;
 } 
 
 /****************************************************************************************
@@ -404,18 +559,33 @@ static int _i2s_write_frames(frames_t out_frames, bool silence, s32_t gainL, s32
 	s32_t *optr;
 #endif	
 	
+	// positive gain is applied by limiter, after equalizer
+	_limiter_gain(&gainL, &gainR, out_frames);
+	
 	if (!silence) {
 		if (output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr) {
 			_apply_cross(outputbuf, out_frames, cross_gain_in, cross_gain_out, cross_ptr);
 		}
 		
 #if BYTES_PER_FRAME == 4
-		if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
+		if (gainL != FIXED_ONE || gainR!= FIXED_ONE || _gain_ramping(gainL, gainR)) {
+			u32_t start;
+			TIME_MEASUREMENT_START(start);
 			_apply_gain(outputbuf, out_frames, gainL, gainR);
+			gain_us += TIME_MEASUREMENT_GET(start);
 		}
 			
 		memcpy(obuf + oframes * BYTES_PER_FRAME, outputbuf->readp, out_frames * BYTES_PER_FRAME);
 #else
+		// ramp is done in place, then packing has nothing more to scale
+#if DSD
+		if (_gain_ramping(gainL, gainR) && output.outfmt == PCM) {
+#else
+		if (_gain_ramping(gainL, gainR)) {
+#endif
+			_apply_gain(outputbuf, out_frames, gainL, gainR);
+			gainL = gainR = FIXED_ONE;
+		}
 		optr = (s32_t*) outputbuf->readp;	
 #endif		
 	} else {
@@ -449,8 +619,10 @@ static int _i2s_write_frames(frames_t out_frames, bool silence, s32_t gainL, s32
  */
 static void *output_thread_i2s(void *arg) {
 	size_t count = 0, bytes;
-	frames_t iframes = FRAME_BLOCK;
-	uint32_t timer_start = 0;
+	frames_t iframes = dma.block;
+	uint32_t timer_start = 0, encode_start, dsp_start;
+	unsigned volume[2];
+	bool volume_update;
 	int discard = 0;
 	uint32_t fullness = gettime_ms();
 	bool synced;
@@ -458,7 +630,7 @@ static void *output_thread_i2s(void *arg) {
 	char *sbuf = NULL;
 	
 	// spdif needs 16 bytes per frame : 32 bits/sample, 2 channels, BMC encoded
-	if (spdif && (sbuf = malloc(FRAME_BLOCK * 16)) == NULL) {
+	if ((spdif || aux.spdif) && (sbuf = malloc(FRAME_BLOCK * 16)) == NULL) {
 		LOG_ERROR("Cannot allocate SPDIF buffer");
 	}
 	
@@ -490,6 +662,7 @@ static void *output_thread_i2s(void *arg) {
 			if (isI2SStarted) {
 				isI2SStarted = false;
 				i2s_stop(CONFIG_I2S_NUM);
+				if (aux.enabled) i2s_stop(aux.num);
 				adac->power(ADAC_STANDBY);
 				count = 0;
 			}
@@ -503,8 +676,10 @@ static void *output_thread_i2s(void *arg) {
 		output.updated = gettime_ms();
 		output.frames_played_dmp = output.frames_played;
 		// try to estimate how much we have consumed from the DMA buffer (calculation is incorrect at the very beginning ...)
-		output.device_frames = dma_buf_frames - ((output.updated - fullness) * output.current_sample_rate) / 1000;
+		output.device_frames = dma_buf_frames - ((output.updated - fullness) * output.current_sample_rate) / 1000 + convolver_delay() + limiter_delay();
+		gain_us = 0;
 		_output_frames( iframes );
+		if (oframes) SET_MIN_MAX(gain_us, gain_time);
 		// oframes must be a global updated by the write callback
 		output.frames_in_process = oframes;
 						
@@ -512,6 +687,7 @@ static void *output_thread_i2s(void *arg) {
 		SET_MIN_MAX_SIZED(_buf_used(outputbuf),o,outputbuf->size);
 		SET_MIN_MAX_SIZED(_buf_used(streambuf),s,streambuf->size);
 		SET_MIN_MAX( TIME_MEASUREMENT_GET(timer_start),buffering);
+		__atomic_fetch_add(&dma.busy_us, buffering, __ATOMIC_RELAXED);
 		
 		/* must skip first whatever is in the pipe (but not when resuming). 
 		This test is incorrect when we pause a track that has just started, 
@@ -521,21 +697,64 @@ static void *output_thread_i2s(void *arg) {
 			synced = true;
 		} else if (discard) {
 			discard -= oframes;
-			iframes = discard ? min(FRAME_BLOCK, discard) : FRAME_BLOCK;
+			iframes = discard ? min(dma.block, discard) : dma.block;
 			UNLOCK;
 			continue;
 		}
 		
+		// take latest DAC volume, but not more often than HW_VOLUME_MS
+		volume_update = dac_volume.pending && output.updated - dac_volume.last >= HW_VOLUME_MS;
+		if (volume_update) {
+			volume[0] = dac_volume.left;
+			volume[1] = dac_volume.right;
+			dac_volume.pending = false;
+			dac_volume.last = output.updated;
+		}	
+		
 		UNLOCK;
+		
+		// I2C must be done out of lock
+		if (volume_update) {
+			TIME_MEASUREMENT_START(timer_start);
+			if (!adac->volume(volume[0], volume[1])) {
+				// retry later unless a newer one is already waiting
+				LOCK;
+				if (!dac_volume.pending) {
+					dac_volume.left = volume[0];
+					dac_volume.right = volume[1];
+					dac_volume.pending = true;
+				}	
+				UNLOCK;
+			}	
+			SET_MIN_MAX(TIME_MEASUREMENT_GET(timer_start), hw_volume);
+		}	
 				
 		// now send all the data
 		TIME_MEASUREMENT_START(timer_start);
 		
+		/* DMA profile only changes between tracks, when I2S restarts or rate changes, as DMA 
+		   is flushed then anyway. Resizing stops ports, so they are restarted right after */
+		if ((i2s_config.sample_rate != output.current_sample_rate || !isI2SStarted || output.state == OUTPUT_STOPPED) &&
+			dma_size(dma_profile(output.current_sample_rate), output.current_sample_rate)) {
+			dma_apply();
+			iframes = dma.block;
+			isI2SStarted = false;
+		}	
+		
 		if (!isI2SStarted ) {
 			isI2SStarted = true;
 			LOG_INFO("Restarting I2S.");
 			i2s_zero_dma_buffer(CONFIG_I2S_NUM);
-			i2s_start(CONFIG_I2S_NUM);
+			if (aux.enabled && !aux.refused) {
+				// start both ports back-to-back so that they stay sample-aligned
+				i2s_zero_dma_buffer(aux.num);
+				vTaskSuspendAll();
+				i2s_start(CONFIG_I2S_NUM);
+				i2s_start(aux.num);
+				xTaskResumeAll();
+			} else {
+				i2s_start(CONFIG_I2S_NUM);
+			}	
 			adac->power(ADAC_ON);	
 			if (amp_control.gpio != -1) gpio_set_level(amp_control.gpio, amp_control.active);
 		} 
@@ -546,25 +765,46 @@ static void *output_thread_i2s(void *arg) {
 			if (synced) {
 			/* 				
 				//  can sleep for a buffer_queue - 1 and then eat a buffer (discard) if we are synced
-				usleep(((DMA_BUF_COUNT - 1) * DMA_BUF_LEN * BYTES_PER_FRAME * 1000) / 44100 * 1000);
-				discard = DMA_BUF_COUNT * DMA_BUF_LEN * BYTES_PER_FRAME;
+				usleep(((dma.count - 1) * dma.len * BYTES_PER_FRAME * 1000) / 44100 * 1000);
+				discard = dma.count * dma.len * BYTES_PER_FRAME;
 			*/		
 			}	
 			i2s_config.sample_rate = output.current_sample_rate;
+			// other port is stopped so that the APLL can move, then it must follow or it stays off for that rate
+			if (aux.enabled) i2s_stop(aux.num);
 			i2s_set_sample_rates(CONFIG_I2S_NUM, spdif ? i2s_config.sample_rate * 2 : i2s_config.sample_rate);
 			i2s_zero_dma_buffer(CONFIG_I2S_NUM);
+			if (aux.enabled) {
+				aux.refused = i2s_set_sample_rates(aux.num, aux.spdif ? i2s_config.sample_rate * 2 : i2s_config.sample_rate) != ESP_OK;
+				if (aux.refused) {
+					LOG_ERROR("%s output disabled at %u, can't share clock with main port", aux.spdif ? "S/PDIF" : "crossover", i2s_config.sample_rate);
+				} else {
+					i2s_zero_dma_buffer(aux.num);
+				}	
+			}	
 			
 			equalizer_close();
+			convolver_close();
+			limiter_close();
 			equalizer_open(output.current_sample_rate);
 			//return;
 		}
 		
-		// run equalizer
+		// run equalizer, convolution and limiter
+		TIME_MEASUREMENT_START(dsp_start);
 		equalizer_process(obuf, oframes * BYTES_PER_FRAME, output.current_sample_rate);
+		convolver_process(obuf, oframes * BYTES_PER_FRAME, output.current_sample_rate);
+		limiter_process(obuf, oframes * BYTES_PER_FRAME, output.current_sample_rate);
+		if (aux.enabled && !aux.refused) crossover_process((s16_t*) obuf, (s16_t*) aux.obuf, oframes, output.current_sample_rate);
+		SET_MIN_MAX(TIME_MEASUREMENT_GET(dsp_start), dsp);
+		__atomic_fetch_add(&dma.busy_us, dsp, __ATOMIC_RELAXED);
 		
 		// we assume that here we have been able to entirely fill the DMA buffers
 		if (spdif) {
+			TIME_MEASUREMENT_START(encode_start);
 			spdif_convert((ISAMPLE_T*) obuf, oframes, (u32_t*) sbuf, &count);
+			SET_MIN_MAX(TIME_MEASUREMENT_GET(encode_start), encode);
+			__atomic_fetch_add(&dma.busy_us, encode, __ATOMIC_RELAXED);
 			i2s_write(CONFIG_I2S_NUM, sbuf, oframes * 16, &bytes, portMAX_DELAY);
 			bytes /= 4;
 #if BYTES_PER_FRAME == 4		
@@ -574,6 +814,25 @@ static void *output_thread_i2s(void *arg) {
 		} else {
 			i2s_write(CONFIG_I2S_NUM, obuf, oframes * BYTES_PER_FRAME, &bytes, portMAX_DELAY);
 		}
+		
+		// low band or S/PDIF goes to the other port, it drains at the same pace
+		if (aux.enabled && !aux.refused) {
+			size_t aux_bytes;
+			if (aux.spdif) {
+				// encoding the same obuf is the only extra work of dual mode
+				TIME_MEASUREMENT_START(encode_start);
+				if (sbuf) spdif_convert((ISAMPLE_T*) obuf, oframes, (u32_t*) sbuf, &count);
+				SET_MIN_MAX(TIME_MEASUREMENT_GET(encode_start), encode);
+				__atomic_fetch_add(&dma.busy_us, encode, __ATOMIC_RELAXED);
+				if (sbuf) i2s_write(aux.num, sbuf, oframes * 16, &aux_bytes, portMAX_DELAY);
+#if BYTES_PER_FRAME == 4		
+			} else if (i2s_config.bits_per_sample == 32) {
+				i2s_write_expand(aux.num, aux.obuf, oframes * BYTES_PER_FRAME, 16, 32, &aux_bytes, portMAX_DELAY);
+#endif			
+			} else {
+				i2s_write(aux.num, aux.obuf, oframes * BYTES_PER_FRAME, &aux_bytes, portMAX_DELAY);
+			}	
+		}	
 
 		fullness = gettime_ms();
 			
@@ -585,7 +844,7 @@ static void *output_thread_i2s(void *arg) {
 		
 	}
 	
-	if (spdif) free(sbuf);
+	free(sbuf);
 	
 	return 0;
 }
@@ -599,7 +858,16 @@ static void output_thread_i2s_stats(void *arg) {
 		output_state state = output.state;
 		
 		if(stats && state>OUTPUT_STOPPED){
+			u32_t ttfa, stream_ms, output_ms;
+			slimproto_stats(&ttfa, &stream_ms, &output_ms);
 			LOG_INFO( "Output State: %d, current sample rate: %d, bytes per frame: %d",state,output.current_sample_rate, BYTES_PER_FRAME);
+			LOG_INFO( "Network rate: %u B/s, gap: %u ms, jitter: %u ms, time to audio: %u ms", 
+					  stream.rate, stream.gap >> 3, stream.jitter >> 3, ttfa);
+			LOG_INFO( "Buffered: stream %u ms, output %u ms", stream_ms, output_ms);
+			u32_t count, stream_count, decode_count, total_ms, max_ms;
+			output_underruns(&count, &stream_count, &decode_count, &total_ms, &max_ms);
+			if (count) LOG_INFO("Concealed underruns: %u (stream %u, decoder %u), silence %u ms (max %u ms)", 
+								count, stream_count, decode_count, total_ms, max_ms);
 			LOG_INFO( LINE_MIN_MAX_FORMAT_HEAD1);
 			LOG_INFO( LINE_MIN_MAX_FORMAT_HEAD2);
 			LOG_INFO( LINE_MIN_MAX_FORMAT_HEAD3);
@@ -609,12 +877,29 @@ static void output_thread_i2s_stats(void *arg) {
 			LOG_INFO(LINE_MIN_MAX_FORMAT_FOOTER);
 			LOG_INFO(LINE_MIN_MAX_FORMAT,LINE_MIN_MAX("received",rec));
 			LOG_INFO(LINE_MIN_MAX_FORMAT_FOOTER);
+			unsigned active_ms;
+			float reduction_db;
+			if (limiter_stats(&active_ms, &reduction_db)) {
+				LOG_INFO("Limiter: active %u ms, max reduction %.1f dB", active_ms, reduction_db);
+			}	
+			// S/PDIF port is fed 4 times more buffers than DAC (twice the rate, half the length)
+			u32_t rate = output.current_sample_rate, irq = (spdif ? 4 : 1) * rate / dma.len;
+			u32_t busy_us = __atomic_exchange_n(&dma.busy_us, 0, __ATOMIC_RELAXED);
+			if (aux.enabled && !aux.refused) irq += (aux.spdif ? 4 : 1) * rate / dma.len;
+			LOG_INFO("DMA %s: %d x %d frames, %u interrupts/s, latency %u ms (+%u ms block), output CPU %u.%u%%", 
+					 dma_profiles[dma.profile].name, dma.count, dma.len, irq, 
+					 (u32_t) (dma_buf_frames * 1000 / rate), dma.block * 1000 / rate, 
+					 busy_us / (STATS_PERIOD_MS * 10), (busy_us / STATS_PERIOD_MS) % 10);
 			LOG_INFO("");
 			LOG_INFO("              ----------+----------+-----------+-----------+  ");
 			LOG_INFO("              max (us)  | min (us) |   avg(us) |  count    |  ");
 			LOG_INFO("              ----------+----------+-----------+-----------+  ");
 			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("Buffering(us)",buffering));
 			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("i2s tfr(us)",i2s_time));
+			if (spdif || aux.spdif) LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("spdif enc(us)",encode));
+			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("gain(us)",gain_time));
+			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("dsp(us)",dsp));
+			if (dac_volume.enabled) LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("dac vol(us)",hw_volume));
 			LOG_INFO("              ----------+----------+-----------+-----------+");
 			RESET_ALL_MIN_MAX;
 		}
@@ -622,6 +907,77 @@ static void output_thread_i2s_stats(void *arg) {
 	}
 }
 
+/****************************************************************************************
+ * DMA profile for a sample rate and a source
+ */
+static int dma_profile(u32_t sample_rate) {
+	if (sample_rate >= 176400) return DMA_HIGH_RATE;
+	// BT sink and AirPlay are live sources, keep the pipe short
+	if (output.external) return DMA_LOW_LATENCY;
+	return DMA_EFFICIENT;
+}
+
+/****************************************************************************************
+ * DMA memory of all ports for a count and length (DAC values), see dma_apply
+ */
+static size_t dma_bytes(int count, int len) {
+	size_t frame = i2s_config.bits_per_sample == 32 ? 8 : 4;
+	// S/PDIF is 32 bits stereo at twice the length (so 8 bytes per true frame)
+	size_t bytes = spdif ? count * len * 8 : (aux.spdif ? count / 2 : count) * len * frame;
+	
+	if (aux.spdif) bytes += count * len * 8;
+	else if (aux.enabled) bytes += count * len * frame;
+	
+	return bytes;
+}
+
+/****************************************************************************************
+ * Set DMA buffers count and length (DAC values), returns true if they changed
+ */
+static bool dma_size(int profile, u32_t sample_rate) {
+	// new buffers are allocated before old ones are released
+	size_t avail = heap_caps_get_free_size(MALLOC_CAP_DMA);
+	int len, count;
+	
+	for (; ; profile--) {
+		len = dma_profiles[profile].len;
+		count = (dma_profiles[profile].ms * sample_rate / 1000 + len - 1) / len;
+		count = min(count, dma_profiles[profile].max_count);
+		// S/PDIF & dual mode split it in half
+		count = count < 2 ? 2 : count + (count & 1);
+		
+		if (profile == dma.profile && len == dma.len && count == dma.count) return false;
+		if (profile == DMA_LOW_LATENCY || dma_bytes(count, len) + DMA_RESERVE <= avail) break;
+		
+		LOG_WARN("DMA profile %s needs %u bytes, only %u available", dma_profiles[profile].name, (unsigned) dma_bytes(count, len), (unsigned) avail);
+	}	
+	
+	dma.profile = profile;
+	dma.len = len;
+	dma.count = count;
+	// S/PDIF (and DAC in dual mode) holds half of the true frames
+	dma_buf_frames = (spdif || dual) ? len * count / 2 : len * count;
+	// output thread should not write more than what DMA can hold
+	dma.block = min(FRAME_BLOCK, dma_buf_frames / 2);
+	
+	LOG_INFO("DMA profile %s for %u Hz: %d x %d frames", dma_profiles[profile].name, sample_rate, count, len);
+	return true;
+}
+
+/****************************************************************************************
+ * Resize DMA buffers of all ports (they are stopped)
+ */
+static void dma_apply(void) {
+	if (spdif) i2s_set_dma_buf(CONFIG_I2S_NUM, dma.count * 2, dma.len / 2);
+	else i2s_set_dma_buf(CONFIG_I2S_NUM, aux.spdif ? dma.count / 2 : dma.count, dma.len);
+	
+	if (aux.spdif) i2s_set_dma_buf(aux.num, dma.count * 2, dma.len / 2);
+	else if (aux.enabled) i2s_set_dma_buf(aux.num, dma.count, dma.len);
+	
+	// resizing restarts the port, keep it silent while it can't run at that rate
+	if (aux.refused) i2s_stop(aux.num);
+}
+
 /****************************************************************************************
  * SPDIF support
  */
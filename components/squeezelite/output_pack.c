@@ -22,6 +22,9 @@
 // Scale and pack functions
 
 #include "squeezelite.h"
+#include <math.h>
+
+static log_level loglevel = lINFO;
 
 #if BYTES_PER_FRAM == 4
 #define MAX_VAL16 0x7fffffffLL
@@ -341,32 +344,336 @@ void _scale_and_pack_frames(void *outputptr, s32_t *inputptr, frames_t cnt, s32_
 	}
 }
 
-#if !WIN
-inline 
+/*
+ Fade gains come from a table of the incoming gain over the fade, the outgoing gain being the same curve read
+ backward. The table is interpolated every CROSS_STEP frames and gains are stepped linearly in between, so they
+ change at every frame. The incoming track is read in at most two contiguous segments (before and after outputbuf
+ wrap) so the mixing loop has no per-sample test.
+*/
+#define CURVE_BITS	8
+#define CURVE_SIZE	(1 << CURVE_BITS)
+#define LOG_RANGE	60.0		// dB covered by logarithmic curve
+#define CROSS_STEP	32
+
+#if BYTES_PER_FRAME == 4
+#define ISAMPLE_MAX	0x7fff
+#else
+#define ISAMPLE_MAX	0x7fffffff
 #endif
+
+extern struct outputstate output;
+
+// last entry is repeated so that interpolation at the end of the fade needs no test
+static s32_t curves[FADE_CURVES][CURVE_SIZE + 2];
+
+static struct {
+	u32_t us;
+	u64_t frames;
+} bench;
+
+void fade_curves_init(void) {
+	int i;
+
+	for (i = 0; i <= CURVE_SIZE; i++) {
+		double x = (double) i / CURVE_SIZE;
+		curves[FADE_LINEAR][i] = x * FIXED_ONE + 0.5;
+		curves[FADE_POWER][i] = sin(x * M_PI / 2) * FIXED_ONE + 0.5;
+		curves[FADE_LOG][i] = i ? pow(10, (x - 1) * LOG_RANGE / 20) * FIXED_ONE + 0.5 : 0;
+	}
+
+	for (i = 0; i < FADE_CURVES; i++) curves[i][CURVE_SIZE + 1] = curves[i][CURVE_SIZE];
+}
+
+static inline s32_t _curve(s32_t *curve, u32_t pos) {
+	s32_t *p = curve + (pos >> 16);
+	return p[0] + (((p[1] - p[0]) * (s32_t) ((pos & 0xffff) >> 1)) >> 15);
+}
+
+// position in curve table with 16 bits fraction
+static inline u32_t _curve_pos(frames_t pos, frames_t len) {
+	return ((u64_t) min(pos, len) << (CURVE_BITS + 16)) / len;
+}
+
+s32_t fade_curve_gain(fade_curve curve, frames_t pos, frames_t len) {
+	return len ? _curve(curves[curve], _curve_pos(pos, len)) : FIXED_ONE;
+}
+
+// gains are exact every CROSS_STEP frames and linearly stepped in between
+static void _cross_block(ISAMPLE_T *ptr, ISAMPLE_T *cross, frames_t frames, s32_t *curve, u32_t pos, u32_t step,
+						 s32_t gain_in, s32_t gain_out) {
+	u32_t p = min(pos, CURVE_SIZE << 16);
+	s32_t in = ((s64_t) _curve(curve, p) * gain_in) >> 16;
+	s32_t out = ((s64_t) _curve(curve, (CURVE_SIZE << 16) - p) * gain_out) >> 16;
+
+	while (frames) {
+		frames_t n = min(frames, CROSS_STEP);
+		s32_t in_end, out_end, in_step, out_step;
+
+		// fade may be a bit shorter than what is mixed when it ends across outputbuf wrap
+		pos += n * step;
+		p = min(pos, CURVE_SIZE << 16);
+		in_end = ((s64_t) _curve(curve, p) * gain_in) >> 16;
+		out_end = ((s64_t) _curve(curve, (CURVE_SIZE << 16) - p) * gain_out) >> 16;
+		in_step = (in_end - in) / (s32_t) n;
+		out_step = (out_end - out) / (s32_t) n;
+		frames -= n;
+
+		while (n--) {
+			s64_t l = ((s64_t) out * ptr[0] + (s64_t) in * cross[0]) >> 16;
+			s64_t r = ((s64_t) out * ptr[1] + (s64_t) in * cross[1]) >> 16;
+
+			ptr[0] = l > ISAMPLE_MAX ? ISAMPLE_MAX : (l < -ISAMPLE_MAX ? -ISAMPLE_MAX : l);
+			ptr[1] = r > ISAMPLE_MAX ? ISAMPLE_MAX : (r < -ISAMPLE_MAX ? -ISAMPLE_MAX : r);
+
+			ptr += 2;
+			cross += 2;
+			in += in_step;
+			out += out_step;
+		}
+
+		in = in_end;
+		out = out_end;
+	}
+}
+
+// mix incoming track at cross_ptr in outgoing one at readp, cross gains are the tracks replay gains
 void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr) {
 	ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp;
-	frames_t count = out_frames * 2;
-	while (count--) {
-		if (*cross_ptr > (ISAMPLE_T *)outputbuf->wrap) {
-			*cross_ptr -= outputbuf->size / BYTES_PER_FRAME * 2;
+	ISAMPLE_T *wrap = (ISAMPLE_T *)(void *)outputbuf->wrap;
+	s32_t *curve = curves[output.fade_curve];
+	frames_t len = output.cross_len ? output.cross_len : 1;
+	u32_t pos = _curve_pos(output.cross_pos, len);
+	u32_t step = ((u64_t) CURVE_SIZE << 16) / len;
+	u64_t start = gettime_us();
+
+	bench.frames += out_frames;
+
+	while (out_frames) {
+		frames_t frames;
+
+		if (*cross_ptr >= wrap) {
+			*cross_ptr -= outputbuf->size / sizeof(ISAMPLE_T);
 		}
-		*ptr = gain(cross_gain_out, *ptr) + gain(cross_gain_in, **cross_ptr);
-		ptr++; (*cross_ptr)++;
+
+		frames = min(out_frames, (frames_t) (wrap - *cross_ptr) / 2);
+		_cross_block(ptr, *cross_ptr, frames, curve, pos, step, cross_gain_in, cross_gain_out);
+
+		ptr += frames * 2;
+		*cross_ptr += frames * 2;
+		pos += frames * step;
+		out_frames -= frames;
 	}
+
+	bench.us += gettime_us() - start;
 }
 
-#if !WIN
-inline 
+// processing time of crossfade in us per second of audio mixed since last call
+u32_t _cross_bench(void) {
+	u32_t us = bench.frames ? (u64_t) bench.us * output.current_sample_rate / bench.frames : 0;
+	bench.us = bench.frames = 0;
+	return us;
+}
+
+/*
+ Channel matrix is fused in the gain stage: each output channel is a Q16 weighted sum of input channels, then
+ scaled by its gain, in the same pass. In sub mode, right output is the mono sum through a 2nd order butterworth
+ low-pass (Q28 coefficients, samples with 12 extra fractional bits, as crossover does).
+*/
+#define LP_COEF_BITS	28
+#if BYTES_PER_FRAME == 4
+#define LP_FRAC_BITS	12
+#else
+#define LP_FRAC_BITS	0
 #endif
+
+struct matrix {
+	bool enabled;
+	channels_mode mode;
+	s32_t ll, lr, rl, rr;
+	struct {
+		unsigned freq;
+		u32_t rate;
+		s32_t b0, b1, b2, a1, a2;
+		s32_t x1, x2, y1, y2;
+	} lp;
+};
+
+static struct matrix matrix;
+
+static void _matrix_set(struct matrix *m, channels_mode mode, unsigned sub_freq) {
+	static const s32_t coefs[][4] = {
+		{ FIXED_ONE, 0, 0, FIXED_ONE }, { FIXED_ONE / 2, FIXED_ONE / 2, FIXED_ONE / 2, FIXED_ONE / 2 },
+		{ 0, FIXED_ONE, FIXED_ONE, 0 }, { FIXED_ONE, 0, FIXED_ONE, 0 }, { 0, FIXED_ONE, 0, FIXED_ONE },
+		{ FIXED_ONE / 2, FIXED_ONE / 2, FIXED_ONE / 2, FIXED_ONE / 2 },
+	};
+
+	if (mode > CHANNELS_SUB) mode = CHANNELS_STEREO;
+	m->mode = mode;
+	m->enabled = mode != CHANNELS_STEREO;
+	m->ll = coefs[mode][0];
+	m->lr = coefs[mode][1];
+	m->rl = coefs[mode][2];
+	m->rr = coefs[mode][3];
+	m->lp.freq = sub_freq ? sub_freq : CHANNELS_SUB_FREQ;
+	m->lp.rate = 0;
+}
+
+static void _lowpass_open(struct matrix *m, u32_t sample_rate) {
+	double w0 = 2 * M_PI * m->lp.freq / sample_rate, cosw = cos(w0), alpha = sin(w0) / (2 * M_SQRT1_2);
+	double scale = (1 << LP_COEF_BITS) / (1 + alpha);
+
+	m->lp.b0 = m->lp.b2 = lround((1 - cosw) / 2 * scale);
+	m->lp.b1 = lround((1 - cosw) * scale);
+	m->lp.a1 = lround(-2 * cosw * scale);
+	m->lp.a2 = lround((1 - alpha) * scale);
+	m->lp.x1 = m->lp.x2 = m->lp.y1 = m->lp.y2 = 0;
+	m->lp.rate = sample_rate;
+}
+
+static inline s32_t _lowpass(struct matrix *m, s32_t sample) {
+	s32_t x = sample << LP_FRAC_BITS, y;
+	s64_t acc = (s64_t) m->lp.b0 * x + (s64_t) m->lp.b1 * m->lp.x1 + (s64_t) m->lp.b2 * m->lp.x2 -
+				(s64_t) m->lp.a1 * m->lp.y1 - (s64_t) m->lp.a2 * m->lp.y2;
+
+	y = acc >> LP_COEF_BITS;
+	m->lp.x2 = m->lp.x1; m->lp.x1 = x;
+	m->lp.y2 = m->lp.y1; m->lp.y1 = y;
+	y >>= LP_FRAC_BITS;
+
+	return y > ISAMPLE_MAX ? ISAMPLE_MAX : (y < -ISAMPLE_MAX ? -ISAMPLE_MAX : y);
+}
+
+static inline void _mix_frame(struct matrix *m, ISAMPLE_T *ptr, s32_t gainL, s32_t gainR) {
+	s32_t l = ptr[0], r = ptr[1];
+	s32_t mixR = ((s64_t) m->rl * l + (s64_t) m->rr * r) >> 16;
+
+	ptr[0] = gain(gainL, ((s64_t) m->ll * l + (s64_t) m->lr * r) >> 16);
+	ptr[1] = gain(gainR, m->mode == CHANNELS_SUB ? _lowpass(m, mixR) : mixR);
+}
+
+static void _gain_block(struct matrix *m, ISAMPLE_T *ptr, frames_t count, s32_t gainL, s32_t gainR) {
+	if (m->enabled) {
+		for (; count--; ptr += 2) _mix_frame(m, ptr, gainL, gainR);
+	} else {
+		for (; count--; ptr += 2) {
+			ptr[0] = gain(gainL, ptr[0]);
+			ptr[1] = gain(gainR, ptr[1]);
+		}
+	}
+}
+
+// called with outputbuf mutex locked
+void _channels_set(channels_mode mode, unsigned sub_freq) {
+	_matrix_set(&matrix, mode, sub_freq);
+}
+
+/*
+ Gain changes are ramped over output.ramp_ms from the gain applied to last frame, with a per-frame fixed point
+ increment, so volume sweeps don't produce zipper noise. Once the target is reached the constant gain loop is used.
+*/
+#define RAMP_SHIFT	8		// extra fractional bits while ramping
+
+static struct {
+	s32_t gainL, gainR;		// applied to last frame
+	s32_t targetL, targetR;
+	s32_t rampL, rampR;		// applied to last frame with RAMP_SHIFT more bits, so chunks don't drop the remainder
+	s32_t stepL, stepR;		// with RAMP_SHIFT more bits
+	frames_t frames;		// left before target is reached
+} ramp = { FIXED_ONE, FIXED_ONE, FIXED_ONE, FIXED_ONE, FIXED_ONE << RAMP_SHIFT, FIXED_ONE << RAMP_SHIFT };
+
+// true when frames need scaling even if gain is FIXED_ONE (ramp or channel matrix)
+bool _gain_ramping(s32_t gainL, s32_t gainR) {
+	return gainL != ramp.gainL || gainR != ramp.gainR || matrix.enabled;
+}
+
 void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR) {
-	ISAMPLE_T *ptrL = (ISAMPLE_T *)(void *)outputbuf->readp;
-	ISAMPLE_T *ptrR = (ISAMPLE_T *)(void *)outputbuf->readp + 1;
-	while (count--) {
-		*ptrL = gain(gainL, *ptrL);
-		*ptrR = gain(gainR, *ptrR);
-		ptrL += 2;
-		ptrR += 2;
+	ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp;
+
+	if (matrix.mode == CHANNELS_SUB && matrix.lp.rate != output.current_sample_rate) {
+		_lowpass_open(&matrix, output.current_sample_rate);
+	}
+
+	if (gainL != ramp.targetL || gainR != ramp.targetR) {
+		ramp.frames = (u64_t) output.current_sample_rate * output.ramp_ms / 1000;
+		if (!ramp.frames) ramp.frames = 1;
+		ramp.stepL = (gainL * (1 << RAMP_SHIFT) - ramp.rampL) / (s32_t) ramp.frames;
+		ramp.stepR = (gainR * (1 << RAMP_SHIFT) - ramp.rampR) / (s32_t) ramp.frames;
+		ramp.targetL = gainL;
+		ramp.targetR = gainR;
+	}
+
+	if (ramp.frames) {
+		frames_t n = min(count, ramp.frames);
+		s32_t rampL = ramp.rampL, rampR = ramp.rampR;
+
+		count -= n;
+		ramp.frames -= n;
+
+		for (; n--; ptr += 2) {
+			rampL += ramp.stepL;
+			rampR += ramp.stepR;
+			if (matrix.enabled) {
+				_mix_frame(&matrix, ptr, rampL >> RAMP_SHIFT, rampR >> RAMP_SHIFT);
+			} else {
+				ptr[0] = gain(rampL >> RAMP_SHIFT, ptr[0]);
+				ptr[1] = gain(rampR >> RAMP_SHIFT, ptr[1]);
+			}
+		}
+
+		// integer steps leave a remainder, so land exactly on target
+		ramp.rampL = ramp.frames ? rampL : gainL * (1 << RAMP_SHIFT);
+		ramp.rampR = ramp.frames ? rampR : gainR * (1 << RAMP_SHIFT);
+		ramp.gainL = ramp.rampL >> RAMP_SHIFT;
+		ramp.gainR = ramp.rampR >> RAMP_SHIFT;
+	}
+
+	_gain_block(&matrix, ptr, count, gainL, gainR);
+}
+
+// linear fade of count frames in place, pos is position of first frame in a fade of len frames
+void _apply_fade(ISAMPLE_T *ptr, frames_t count, frames_t pos, frames_t len, bool up) {
+	for (; count--; pos++, ptr += 2) {
+		s32_t g = ((s64_t) FIXED_ONE * (up ? pos : len - pos)) / len;
+		ptr[0] = gain(g, ptr[0]);
+		ptr[1] = gain(g, ptr[1]);
+	}
+}
+
+// time a kernel over a second of 44.1kHz noise fed by chunks from a private buffer, returns us spent
+u32_t kernel_bench(void (*kernel)(void *ctx, ISAMPLE_T *ptr, frames_t count), void *ctx) {
+	ISAMPLE_T *buf = malloc(BENCH_CHUNK * 2 * sizeof(ISAMPLE_T));
+	u64_t start, us = 0;
+
+	if (!buf) return 0;
+
+	for (frames_t n = 0; n < BENCH_FRAMES; n += BENCH_CHUNK) {
+		for (int i = 0; i < BENCH_CHUNK * 2; i++) buf[i] = rand() % 20001 - 10000;
+		start = gettime_us();
+		kernel(ctx, buf, BENCH_CHUNK);
+		us += gettime_us() - start;
 	}
+
+	free(buf);
+	return us;
+}
+
+static void _gain_kernel(void *ctx, ISAMPLE_T *ptr, frames_t count) {
+	_gain_block(ctx, ptr, count, FIXED_ONE / 2, FIXED_ONE / 2);
 }
 
+// cost of the gain stage per frame, without and with channel matrix, on a private matrix
+void channels_bench(void) {
+	static const char *modes[] = { "stereo", "mono", "swap", "left", "right", "sub" };
+	struct matrix m = { 0 };
+
+	for (int mode = CHANNELS_STEREO; mode <= CHANNELS_SUB; mode++) {
+		u32_t us;
+
+		_matrix_set(&m, mode, 0);
+		_lowpass_open(&m, 44100);
+		us = kernel_bench(_gain_kernel, &m);
+
+		LOG_INFO("gain with %s channels: %u ns per frame (%u us per second at 44.1kHz)", modes[mode], 
+				 (u32_t) ((u64_t) us * 1000 / BENCH_FRAMES), us);
+	}
+}
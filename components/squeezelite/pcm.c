@@ -66,6 +66,11 @@ static u32_t sample_rates[] = {
 	11025, 22050, 32000, 44100, 48000, 8000, 12000, 16000, 24000, 96000, 88200, 176400, 192000, 352800, 384000, 705600, 768000
 };
 
+// slimproto rate code to Hz, 0 when unknown ('?')
+u32_t pcm_sample_rate(u8_t rate) {
+	return rate >= '0' && rate < '0' + sizeof(sample_rates) / sizeof(sample_rates[0]) ? sample_rates[rate - '0'] : 0;
+}
+
 static u32_t sample_rate;
 static u32_t sample_size;
 static u32_t channels;
@@ -48,10 +48,39 @@ extern struct codec *codec;
 #endif
 
 
+/*
+ Decoding and processing are pipelined: the codec fills a block, the decode thread queues it and moves on to the
+ next block while the process thread, pinned on the other core when the platform has one, resamples queued blocks
+ into outputbuf. The queue is single producer / single consumer so it needs no lock, head is only moved by the
+ decode thread and tail by the process thread. Resampler state is only touched by the decode thread (newstream,
+ drain, flush) once the queue is empty, so these wait for the process thread to catch up.
+ Without threads the blocks are processed in line by the decode thread, as before.
+*/
+
+#ifndef PROCESS_BLOCKS
+#define PROCESS_BLOCKS	3
+#endif
+
+#ifndef PROCESS_THREAD_CORE
+#define PROCESS_THREAD_CORE	0
+#endif
+
+static struct {
+	u8_t *buf[PROCESS_BLOCKS];
+	frames_t frames[PROCESS_BLOCKS];
+	unsigned head, tail;
+	bool flush;
+} queue;
+
+static bool running;
+static thread_type thread;
+
+#define QUEUED() (__atomic_load_n(&queue.head, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE))
+
 // transfer all processed frames to the output buf
-static void _write_samples(void) {
-	frames_t frames = process.out_frames;
-	ISAMPLE_T *iptr   = (ISAMPLE_T *) process.outbuf;
+static void _write_samples(struct processstate *p) {
+	frames_t frames = p->out_frames;
+	ISAMPLE_T *iptr   = (ISAMPLE_T *) p->outbuf;
 	unsigned cnt  = 10;
 
 	LOCK_O;
@@ -91,12 +120,75 @@ static void _write_samples(void) {
 	UNLOCK_O;
 }
 
+static void _process_block(struct processstate *p) {
+	u64_t start = gettime_us();
+
+	SAMPLES_FUNC(p);
+
+	_write_samples(p);
+
+	stage_load(&process.load, gettime_us() - start, p->in_frames, process.in_sample_rate);
+}
+
+// wait for process thread to empty the queue - called with decode mutex set
+static void _process_wait(void) {
+	while (running && QUEUED()) usleep(1000);
+}
+
+static void *process_thread() {
+
+	while (running) {
+		// block queued by decode thread, with buffers and rates of current stream
+		struct processstate p = { 0 };
+		unsigned slot = queue.tail % PROCESS_BLOCKS;
+
+		if (!QUEUED()) {
+			usleep(1000);
+			continue;
+		}
+
+		if (!queue.flush) {
+			p.inbuf = queue.buf[slot];
+			p.in_frames = queue.frames[slot];
+			p.outbuf = process.outbuf;
+			p.max_out_frames = process.max_out_frames;
+
+			_process_block(&p);
+
+			process.total_in += p.total_in;
+			process.total_out += p.total_out;
+		}
+
+		__atomic_store_n(&queue.tail, queue.tail + 1, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+// outputbuf space needed to decode one more block, including the ones still queued - called with decode mutex set
+size_t process_min_space(void) {
+	unsigned queued = running ? QUEUED() : 0;
+
+	// no free block to decode into
+	if (queued == PROCESS_BLOCKS) return SIZE_MAX;
+
+	return (queued + 1) * process.max_out_frames * BYTES_PER_FRAME;
+}
+
 // process samples - called with decode mutex set
 void process_samples(void) {
 
-	SAMPLES_FUNC(&process);
+	if (running) {
+		unsigned head = queue.head;
+
+		queue.frames[head % PROCESS_BLOCKS] = process.in_frames;
+		__atomic_store_n(&queue.head, head + 1, __ATOMIC_RELEASE);
 
-	_write_samples();
+		// process_min_space makes sure codec only decodes when that block is free
+		process.inbuf = queue.buf[(head + 1) % PROCESS_BLOCKS];
+	} else {
+		_process_block(&process);
+	}
 
 	process.in_frames = 0;
 }
@@ -105,11 +197,13 @@ void process_samples(void) {
 void process_drain(void) {
 	bool done;
 
+	_process_wait();
+
 	do {
 
 		done = DRAIN_FUNC(&process);
 
-		_write_samples();
+		_write_samples(&process);
 
 	} while (!done);
 
@@ -119,7 +213,12 @@ void process_drain(void) {
 // new stream - called with decode mutex set
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]) {
 
-	bool active = NEWSTREAM_FUNC(&process, raw_sample_rate, supported_rates);
+	bool active;
+
+	// blocks of previous stream must be processed with its own settings
+	_process_wait();
+
+	active = NEWSTREAM_FUNC(&process, raw_sample_rate, supported_rates);
 
 	LOG_INFO("processing: %s", active ? "active" : "inactive");
 
@@ -128,6 +227,8 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 	if (active) {
 
 		unsigned max_in_frames, max_out_frames;
+		int i, blocks = running ? PROCESS_BLOCKS : 1;
+		bool fail = false;
 
 		process.in_frames = process.out_frames = 0;
 		process.total_in = process.total_out = 0;
@@ -142,12 +243,18 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 		}
 
 		if (process.max_in_frames != max_in_frames) {
-			LOG_DEBUG("creating process buf in frames: %u", max_in_frames);
-			if (process.inbuf) free(process.inbuf);
-			process.inbuf = malloc(max_in_frames * BYTES_PER_FRAME);
-			process.max_in_frames = max_in_frames;
+			LOG_DEBUG("creating %d process buf in frames: %u", blocks, max_in_frames);
+			for (i = 0; i < blocks; i++) {
+				free(queue.buf[i]);
+				queue.buf[i] = malloc(max_in_frames * BYTES_PER_FRAME);
+				fail |= !queue.buf[i];
+			}
+			// make sure they are re-created next time
+			process.max_in_frames = fail ? 0 : max_in_frames;
 		}
 		
+		process.inbuf = queue.buf[queue.head % PROCESS_BLOCKS];
+		
 		if (process.max_out_frames != max_out_frames) {
 			LOG_DEBUG("creating process buf out frames: %u", max_out_frames);
 			if (process.outbuf) free(process.outbuf);
@@ -155,7 +262,7 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 			process.max_out_frames = max_out_frames;
 		}
 		
-		if (!process.inbuf || !process.outbuf) {
+		if (fail || !process.inbuf || !process.outbuf) {
 			LOG_ERROR("malloc fail creating process buffers");
 			*direct = true;
 			return raw_sample_rate;
@@ -172,6 +279,11 @@ void process_flush(void) {
 
 	LOG_INFO("process flush");
 
+	// queued blocks are dropped, not processed
+	queue.flush = true;
+	_process_wait();
+	queue.flush = false;
+
 	FLUSH_FUNC();
 
 	process.in_frames = 0;
@@ -183,12 +295,52 @@ void process_init(char *opt) {
 	bool enabled = INIT_FUNC(opt);
 
 	memset(&process, 0, sizeof(process));
+	process.load.name = "process";
 
 	if (enabled) {
 		LOCK_D;
 		decode.process = true;
 		UNLOCK_D;
+	} else {
+		return;
 	}
+
+#if LINUX || OSX || FREEBSD || EMBEDDED
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+#ifdef PTHREAD_STACK_MIN
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + PROCESS_THREAD_STACK_SIZE);
+#endif
+	running = true;
+	if (pthread_create_pinned(&thread, &attr, process_thread, NULL, "process", PROCESS_THREAD_CORE)) {
+		LOG_WARN("can't create process thread, processing in decode thread");
+		running = false;
+	}
+	pthread_attr_destroy(&attr);
+#endif
+
+	LOG_INFO("processing %s", running ? "pipelined in its own thread" : "in decode thread");
+}
+
+// close - called with no mutex
+void process_close(void) {
+	int i;
+
+	if (running) {
+		running = false;
+#if LINUX || OSX || FREEBSD || EMBEDDED
+		pthread_join(thread, NULL);
+#endif
+	}
+
+	for (i = 0; i < PROCESS_BLOCKS; i++) {
+		free(queue.buf[i]);
+		queue.buf[i] = NULL;
+	}
+
+	free(process.outbuf);
+	process.outbuf = process.inbuf = NULL;
+	process.max_in_frames = process.max_out_frames = 0;
 }
 
 #endif // #if PROCESS
@@ -89,8 +89,28 @@ static struct {
 	u32_t current_sample_rate;
 	u32_t last;
 	stream_state stream_state;
+	u32_t stream_open;
+	u32_t output_threshold;
+	u32_t ttfa;
+	u32_t stream_ms, output_ms;
 } status;
 
+/*
+ streambuf and outputbuf share a single memory budget which is re-partitioned at each track start when
+ both are idle. A byte of compressed data holds more audio than a byte of pcm for lossy codecs and the
+ other way round for hi-res lossless, so once each stage has its minimum, the remainder goes to the stage
+ with the lowest byte rate which maximizes the total buffered duration. Bitrate is not known at strm
+ time so compressed rates are estimates (upper end of what each codec usually produces)
+*/
+#define BUDGET_STREAM_MIN	(128 * 1024)
+#define BUDGET_OUTPUT_SECS	3
+#define BUDGET_LOSSY_RATE	(320000 / 8)
+
+static struct {
+	unsigned total;
+	u32_t stream_rate;		// estimated bytes/s of compressed data
+} budget;
+
 static int autostart;
 static bool sentSTMu, sentSTMo, sentSTMl;
 static u32_t new_server;
@@ -295,6 +315,80 @@ void sendIR(u32_t code, u32_t ts) {
 }
 #endif
 
+static void budget_partition(struct strm_packet *strm) {
+	unsigned stream_size, output_size, stream_min, output_min, spare;
+	u32_t rate = pcm_sample_rate(strm->pcm_sample_rate), output_rate;
+	unsigned sample_size = strm->pcm_sample_size != '?' ? strm->pcm_sample_size - '0' + 1 : 2;
+	unsigned channels = strm->pcm_channels != '?' ? strm->pcm_channels - '0' : 2;
+
+	if (!rate) rate = status.current_sample_rate ? status.current_sample_rate : 44100;
+	output_rate = rate * BYTES_PER_FRAME;
+
+	switch (strm->format) {
+	case 'p':
+		budget.stream_rate = rate * sample_size * channels;
+		break;
+	case 'f':
+	case 'l':
+	case '?':
+		budget.stream_rate = rate * sample_size * channels * 6 / 10;
+		break;
+	default:
+		budget.stream_rate = BUDGET_LOSSY_RATE;
+		break;
+	}
+
+	stream_min = max(BUDGET_STREAM_MIN, strm->threshold * 1024 * 2);
+	output_min = BUDGET_OUTPUT_SECS * output_rate;
+	if (strm->transition_type - '0' == FADE_CROSSFADE) output_min += strm->transition_period * output_rate;
+
+	if (!budget.total) return;
+
+	// minimums don't fit (e.g. long crossfade at high rate), keep smallest streambuf and give the rest to outputbuf
+	if (stream_min + output_min > budget.total) {
+		LOG_WARN("budget %u below minimums (stream %u, output %u), clamping", budget.total, stream_min, output_min);
+		stream_min = BUDGET_STREAM_MIN;
+		output_min = min(output_min, budget.total - stream_min);
+	}
+
+	// whatever is left above minimums goes where it holds the most seconds
+	spare = budget.total - stream_min - output_min;
+	if (budget.stream_rate < output_rate) {
+		stream_size = stream_min + spare;
+		output_size = output_min;
+	} else {
+		stream_size = stream_min;
+		output_size = output_min + spare;
+	}
+	output_size -= output_size % (BYTES_PER_FRAME * 1024);
+	stream_size = budget.total - output_size;
+	stream_size -= stream_size % 1024;
+
+	LOCK_D;
+	// only when nothing is being decoded or played (not during gapless)
+	if (decode.state != DECODE_RUNNING) {
+		LOCK_S;
+		LOCK_O;
+		if (!output.external && output.state <= OUTPUT_STOPPED && !_buf_used(outputbuf) &&
+			(stream_size != streambuf->base_size || output_size != outputbuf->size)) {
+			// release memory first so that peak stays within budget
+			if (output_size < outputbuf->size) {
+				_buf_resize(outputbuf, output_size);
+				_buf_resize(streambuf, stream_size);
+			} else {
+				_buf_resize(streambuf, stream_size);
+				_buf_resize(outputbuf, output_size);
+			}
+			output.init_size = outputbuf->size;
+			LOG_INFO("budget %u: streambuf %u (%u s) outputbuf %u (%u s) for '%c' at %u Hz", budget.total,
+					 streambuf->size, streambuf->size / budget.stream_rate, outputbuf->size, outputbuf->size / output_rate, strm->format, rate);
+		}
+		UNLOCK_O;
+		UNLOCK_S;
+	}
+	UNLOCK_D;
+}
+
 static void process_strm(u8_t *pkt, int len) {
 	struct strm_packet *strm = (struct strm_packet *)pkt;
 
@@ -369,6 +463,9 @@ static void process_strm(u8_t *pkt, int len) {
 				LOG_WARN("header too long: %u", header_len);
 				break;
 			}
+			budget_partition(strm);
+			// read by stream thread once the new socket is polled
+			stream.bitrate = budget.stream_rate;
 			if (strm->format != '?') {
 				codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
 			} else if (autostart >= 2) {
@@ -387,6 +484,7 @@ static void process_strm(u8_t *pkt, int len) {
 			}
 			sendSTAT("STMc", 0);
 			sentSTMu = sentSTMo = sentSTMl = false;
+			status.stream_open = gettime_ms();
 			LOCK_O;
 #if EMBEDDED
 			if (output.external) decode_restore(output.external);
@@ -662,7 +760,9 @@ static void slimproto_run() {
 			status.stream_full = _buf_used(streambuf);
 			status.stream_size = streambuf->size;
 			status.stream_bytes = stream.bytes;
+			status.stream_ms = budget.stream_rate ? (u64_t) status.stream_full * 1000 / budget.stream_rate : 0;
 			status.stream_state = stream.state;
+			status.output_threshold = stream.dyn_output_threshold;
 						
 			if (stream.state == DISCONNECT) {
 				disconnect_code = stream.disconnect;
@@ -717,6 +817,8 @@ static void slimproto_run() {
 				status.current_sample_rate = output.current_sample_rate;
 				status.updated = output.updated;
 				status.device_frames = output.device_frames;
+				status.output_ms = status.current_sample_rate ? 
+								   (u64_t) status.output_full * 1000 / (status.current_sample_rate * BYTES_PER_FRAME) : 0;
 									
 				if (output.track_started) {
 					_sendSTMs = true;
@@ -732,6 +834,16 @@ static void slimproto_run() {
 				if (_start_output && (output.state == OUTPUT_STOPPED || output.state == OUTPUT_OFF)) {
 					output.state = OUTPUT_BUFFER;
 				}
+				// stream layer has measured network well enough to lower the output threshold
+				if (output.state == OUTPUT_BUFFER && status.output_threshold && status.output_threshold < output.threshold) {
+					LOG_INFO("lowering output threshold from %u to %u", output.threshold, status.output_threshold);
+					output.threshold = status.output_threshold;
+				}
+				if (status.stream_open && output.state == OUTPUT_RUNNING) {
+					status.ttfa = now - status.stream_open;
+					status.stream_open = 0;
+					LOG_INFO("time to first audio: %u ms", status.ttfa);
+				}
 				if (output.state == OUTPUT_RUNNING && !sentSTMu && status.output_full == 0 && status.stream_state <= DISCONNECT &&
 					_decode_state == DECODE_STOPPED) {
 
@@ -788,6 +900,13 @@ static void slimproto_run() {
 	}
 }
 
+// time to first audio of last stream (underruns are counted by output, see output_underruns)
+void slimproto_stats(u32_t *ttfa, u32_t *stream_ms, u32_t *output_ms) {
+	*ttfa = status.ttfa;
+	*stream_ms = status.stream_ms;
+	*output_ms = status.output_ms;
+}
+
 // called from other threads to wake state machine above
 void wake_controller(void) {
 	wake_signal(wake_e);
@@ -868,6 +987,11 @@ void slimproto(log_level level, char *server, u8_t mac[6], const char *name, con
 
 	memset(&status, 0, sizeof(status));
 
+#if EMBEDDED
+	// elastic buffers are for memory constrained platforms, others keep user-defined sizes
+	budget.total = streambuf->base_size + output.init_size;
+#endif
+
 	wake_create(wake_e);
 
 	loglevel = level;
@@ -196,7 +196,7 @@
 #define LIBMAD  "libmad.so.0"
 #define LIBMPG "libmpg123.so.0"
 #define LIBVORBIS "libvorbisfile.so.3"
-#define LIBOPUS "libopusfile.so.0"
+#define LIBOPUS "libopus.so.0"
 #define LIBTREMOR "libvorbisidec.so.1"
 #define LIBFAAD "libfaad.so.2"
 #define LIBAVUTIL   "libavutil.so.%d"
@@ -212,7 +212,7 @@
 #define LIBMPG "libmpg123.0.dylib"
 #define LIBVORBIS "libvorbisfile.3.dylib"
 #define LIBTREMOR "libvorbisidec.1.dylib"
-#define LIBOPUS "libopusfile.0.dylib"
+#define LIBOPUS "libopus.0.dylib"
 #define LIBFAAD "libfaad.2.dylib"
 #define LIBAVUTIL   "libavutil.%d.dylib"
 #define LIBAVCODEC  "libavcodec.%d.dylib"
@@ -225,7 +225,7 @@
 #define LIBMAD  "libmad-0.dll"
 #define LIBMPG "libmpg123-0.dll"
 #define LIBVORBIS "libvorbisfile.dll"
-#define LIBOPUS "libopusfile-0.dll"
+#define LIBOPUS "libopus-0.dll"
 #define LIBTREMOR "libvorbisidec.dll"
 #define LIBFAAD "libfaad2.dll"
 #define LIBAVUTIL   "avutil-%d.dll"
@@ -240,7 +240,7 @@
 #define LIBMPG "libmpg123.so.0"
 #define LIBVORBIS "libvorbisfile.so.3"
 #define LIBTREMOR "libvorbisidec.so.1"
-#define LIBOPUS "libopusfile.so.1"
+#define LIBOPUS "libopus.so.0"
 #define LIBFAAD "libfaad.so.2"
 #define LIBAVUTIL   "libavutil.so.%d"
 #define LIBAVCODEC  "libavcodec.so.%d"
@@ -309,6 +309,7 @@
 #define DECODE_THREAD_STACK_SIZE 128 * 1024
 #define OUTPUT_THREAD_STACK_SIZE  64 * 1024
 #define IR_THREAD_STACK_SIZE      64 * 1024
+#define PROCESS_THREAD_STACK_SIZE 64 * 1024
 #ifdef SUN
 typedef uint8_t  u8_t;
 typedef uint16_t u16_t;
@@ -336,6 +337,7 @@ typedef int64_t   s64_t;
 #define thread_type pthread_t
 #if !EMBEDDED
 #define pthread_create_name(t,a,f,p,n) pthread_create(t,a,f,p)
+#define pthread_create_pinned(t,a,f,p,n,c) pthread_create(t,a,f,p)
 #endif
 #endif
 
@@ -473,6 +475,18 @@ void _wake_create(event_event*);
 
 #define FIXED_ONE 0x10000
 
+// default duration of gain changes, avoids zipper noise during volume sweeps
+#define GAIN_RAMP_MS	20
+
+// underruns are concealed by fading out what is left in outputbuf, then back in once it has refilled
+#define UNDERRUN_FADE_MS	5
+#define UNDERRUN_RESUME_MS	50
+
+// default low-pass of the mono sub output of channel matrix
+#define CHANNELS_SUB_FREQ	80
+
+// outputbuf sample container is chosen at build time: 8 keeps 24 bits sources intact, 4 stores 16 bits 
+// frames which doubles buffered duration and halves memory traffic (default for EMBEDDED, see component.mk)
 #ifndef BYTES_PER_FRAME
 #define BYTES_PER_FRAME 8
 #endif
@@ -484,6 +498,9 @@ void _wake_create(event_event*);
 #endif
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
 
 // utils.c (non logging)
 typedef enum { EVENT_TIMEOUT = 0, EVENT_READ, EVENT_WAKE } event_type;
@@ -493,6 +510,7 @@ char* strcasestr(const char *haystack, const char *needle);
 
 char *next_param(char *src, char c);
 u32_t gettime_ms(void);
+u64_t gettime_us(void);
 void get_mac(u8_t *mac);
 void set_nonblock(sockfd s);
 int connect_timeout(sockfd sock, const struct sockaddr *addr, socklen_t addrlen, int timeout);
@@ -545,6 +563,7 @@ void _buf_inc_writep(struct buffer *buf, unsigned by);
 void buf_flush(struct buffer *buf);
 void _buf_flush(struct buffer *buf);
 void _buf_unwrap(struct buffer *buf, size_t cont);
+size_t _buf_read_window(struct buffer *buf, size_t want);
 void buf_adjust(struct buffer *buf, size_t mod);
 void _buf_resize(struct buffer *buf, size_t size);
 void buf_init(struct buffer *buf, size_t size);
@@ -553,6 +572,7 @@ void buf_destroy(struct buffer *buf);
 // slimproto.c
 void slimproto(log_level level, char *server, u8_t mac[6], const char *name, const char *namefile, const char *modelname, int maxSampleRate);
 void slimproto_stop(void);
+void slimproto_stats(u32_t *ttfa, u32_t *stream_ms, u32_t *output_ms);
 void wake_controller(void);
 void send_packet(u8_t *packet, size_t len);
 
@@ -574,6 +594,11 @@ struct streamstate {
 	u32_t meta_next;
 	u32_t meta_left;
 	bool  meta_send;
+	u32_t rate;				// EWMA of receive throughput in bytes/s
+	u32_t bitrate;			// estimated bytes/s of the stream, set by slimproto (0 = unknown)
+	u32_t gap, jitter;		// EWMA of time between receive and its mean deviation, in 1/8 ms
+	unsigned dyn_threshold;	// start threshold in bytes computed from the above (0 = not enough samples)
+	unsigned dyn_output_threshold; // same for output, in tenths of second
 };
 
 void stream_init(log_level level, unsigned stream_buf_size);
@@ -582,13 +607,36 @@ void stream_file(const char *header, size_t header_len, unsigned threshold);
 void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait);
 bool stream_disconnect(void);
 
+#define STREAM_BENCH_BUCKETS 10	// recv size histogram: < 256, < 512 ... < 64k, >= 64k
+
+struct stream_bench {
+	u64_t bytes;
+	u32_t duration_ms;
+	u32_t recv_count;
+	u32_t hist[STREAM_BENCH_BUCKETS];
+	u64_t poll_us, recv_us, lock_us, tls_us;
+	bool tls;
+};
+
+bool stream_bench(const char *url, unsigned seconds, struct stream_bench *result);
+void stream_bench_report(struct stream_bench *result);
+
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
 
+// cpu time spent by a pipeline stage against the duration of audio it handled
+struct stageload {
+	char *name;
+	u64_t busy_us, frames;
+	unsigned rate;
+	unsigned percent;	// of real time over last report period, above 100 the stage can't keep up
+};
+
 struct decodestate {
 	decode_state state;
 	bool new_stream;
 	mutex_type mutex;
+	struct stageload load;
 #if PROCESS
 	bool direct;
 	bool process;
@@ -602,6 +650,7 @@ struct processstate {
 	unsigned in_frames, out_frames;
 	unsigned in_sample_rate, out_sample_rate;
 	unsigned long total_in, total_out;
+	struct stageload load;
 };
 #endif
 
@@ -613,14 +662,74 @@ struct codec {
 	void (*open)(u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
 	void (*close)(void);
 	decode_state (*decode)(void);
+	bool keep;	// state can stay allocated while another codec is in use
+	// measured by decode.c, in bytes: allocated at register, left allocated by open and highest while decoding
+	struct {
+		int resident, open, peak;
+	} mem;
 };
 
 void decode_init(log_level level, const char *include_codecs, const char *exclude_codecs);
 void decode_close(void);
 void decode_flush(void);
 unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]);
+void stage_load(struct stageload *load, u32_t us, frames_t frames, unsigned rate);
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
 
+// mp4.c
+struct mp4 {
+	u32_t pos, consume;
+	unsigned trak, play;
+	// gapless from stts and iTunSMPB
+	u32_t skip;
+	u64_t samples, sttssamples;
+	// chunk offsets (stco) and sample to chunk runs (stsc)
+	u32_t *chunk_offset, chunks, chunk, chunk_left;
+	u32_t *stsc, stsc_entries, stsc_index;
+	// sample sizes (stsz), 16 bits unless one does not fit
+	void *sizes;
+	u32_t sizes_count, size_default, sample;
+	bool sizes32, want_sizes;
+	// table being read incrementally
+	int table;
+	u32_t table_left, table_index;
+	// codec config box and its parser
+	const char *config_box;
+	bool (*config)(u8_t *box, u32_t len);
+};
+
+void mp4_init(struct mp4 *mp4, const char *config_box, bool (*config)(u8_t *box, u32_t len), bool want_sizes);
+void mp4_close(struct mp4 *mp4);
+int  mp4_read_header(struct mp4 *mp4);
+u32_t mp4_sample_size(struct mp4 *mp4);
+bool _mp4_consume(struct mp4 *mp4);
+bool _mp4_next_sample(struct mp4 *mp4, u32_t bytes);
+
+// ogg.c
+struct ogg {
+	// logical stream followed, identified by codec's probe of its first packet
+	u32_t serial, serialno;
+	bool (*probe)(u8_t *packet, u32_t len);
+	bool synced, have_serial, ended, chained;
+	// current page in streambuf, consumed once all its packets are returned
+	u32_t page_len, pos;
+	u8_t segs, seg;
+	bool eos;
+	// packet spanning pages
+	u8_t *packet;
+	u32_t packet_len, packet_size;
+	bool partial;
+	// last returned packet
+	u32_t packetno;
+	s64_t granule;
+	bool last;
+};
+
+void ogg_init(struct ogg *ogg, bool (*probe)(u8_t *packet, u32_t len));
+void ogg_close(struct ogg *ogg);
+int  _ogg_next_packet(struct ogg *ogg, u8_t **data, u32_t *len);
+void _ogg_comments(u8_t *ptr, u32_t len);
+
 #if PROCESS
 // process.c
 void process_samples(void);
@@ -628,6 +737,8 @@ void process_drain(void);
 void process_flush(void);
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]);
 void process_init(char *opt);
+void process_close(void);
+size_t process_min_space(void);
 #endif
 
 #if RESAMPLE || RESAMPLE16
@@ -653,6 +764,8 @@ typedef enum { S32_LE, S24_LE, S24_3LE, S16_LE, S24_BE, S24_3BE, S16_BE, S8_BE }
 typedef enum { FADE_INACTIVE = 0, FADE_DUE, FADE_ACTIVE } fade_state;
 typedef enum { FADE_UP = 1, FADE_DOWN, FADE_CROSS } fade_dir;
 typedef enum { FADE_NONE = 0, FADE_CROSSFADE, FADE_IN, FADE_OUT, FADE_INOUT } fade_mode;
+typedef enum { FADE_LINEAR = 0, FADE_POWER, FADE_LOG, FADE_CURVES } fade_curve;
+typedef enum { CHANNELS_STEREO = 0, CHANNELS_MONO, CHANNELS_SWAP, CHANNELS_LEFT, CHANNELS_RIGHT, CHANNELS_SUB } channels_mode;
 
 #define MAX_SUPPORTED_SAMPLERATES 18
 #define TEST_RATES = { 768000, 705600, 384000, 352800, 192000, 176400, 96000, 88200, 48000, 44100, 32000, 24000, 22500, 16000, 12000, 11025, 8000, 0 }
@@ -704,6 +817,10 @@ struct outputstate {
 	fade_dir fade_dir;
 	fade_mode fade_mode;       // set by slimproto
 	unsigned fade_secs;        // set by slimproto
+	fade_curve fade_curves[FADE_INOUT + 1];	// curve of each fade mode
+	fade_curve fade_curve;     // curve of current fade, chosen when it is set
+	frames_t cross_pos, cross_len;	// position in crossfade of next frames to write
+	unsigned ramp_ms;          // duration of gain changes
 	unsigned rate_delay;
 	bool delay_active;
 	u32_t stop_time;
@@ -719,6 +836,7 @@ struct outputstate {
 void output_init_common(log_level level, const char *device, unsigned output_buf_size, unsigned rates[], unsigned idle);
 void output_close_common(void);
 void output_flush(void);
+void output_underruns(u32_t *count, u32_t *stream_count, u32_t *decode_count, u32_t *total_ms, u32_t *max_ms);
 // _* called with mutex locked
 frames_t _output_frames(frames_t avail);
 void _checkfade(bool);
@@ -758,7 +876,18 @@ void output_close_stdout(void);
 // output_pack.c
 void _scale_and_pack_frames(void *outputptr, s32_t *inputptr, frames_t cnt, s32_t gainL, s32_t gainR, output_format format);
 void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr);
+void fade_curves_init(void);
+s32_t fade_curve_gain(fade_curve curve, frames_t pos, frames_t len);
+u32_t _cross_bench(void);
 void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR);
+bool _gain_ramping(s32_t gainL, s32_t gainR);
+void _channels_set(channels_mode mode, unsigned sub_freq);
+void channels_bench(void);
+// kernel benches run a second of audio at 44.1kHz, by chunks
+#define BENCH_FRAMES	44100
+#define BENCH_CHUNK		512
+u32_t kernel_bench(void (*kernel)(void *ctx, ISAMPLE_T *ptr, frames_t count), void *ctx);
+void _apply_fade(ISAMPLE_T *ptr, frames_t count, frames_t pos, frames_t len, bool up);
 s32_t gain(s32_t gain, s32_t sample);
 s32_t to_gain(float f);
 
@@ -786,12 +915,16 @@ void dsd_init(dsd_format format, unsigned delay);
 
 struct codec *register_flac(void);
 struct codec *register_pcm(void);
+u32_t pcm_sample_rate(u8_t rate);
 struct codec *register_mad(void);
 struct codec *register_mpg(void);
 struct codec *register_vorbis(void);
 struct codec *register_faad(void);
 struct codec *register_helixaac(void);
 struct codec *register_dsd(void);
+#if !DSD
+struct codec *register_dsd2pcm(void);
+#endif
 struct codec *register_alac(void);
 struct codec *register_ff(const char *codec);
 struct codec *register_opus(void);
@@ -61,6 +61,45 @@ static sockfd fd;
 
 struct streamstate stream;
 
+/*
+Adaptive start threshold. The time between two receive (gap) and its mean 
+deviation (jitter) are tracked the same way TCP does for RTT, and throughput
+is an EWMA over RATE_WINDOW_MS windows. Decoder consumes the stream at its
+bitrate, so having bitrate * (gap + k * jitter) bytes buffered covers a 
+network stall with the probability set by the user (k is the matching 
+one-sided normal quantile). A link slower than the bitrate can't refill that 
+much in time, so measured throughput is only a ceiling. We never wait for 
+more than what the server asked.
+*/
+#define RATE_WINDOW_MS		50
+#define MIN_RATE_WINDOWS	4
+#define MIN_STALL_MS		100
+#define MIN_DYN_THRESHOLD	(16 * 1024)
+
+float stream_confidence;	// in %, 0 = disabled, set by main
+static u32_t confidence_k;	// quantile x 100
+
+static struct {
+	u32_t last, start, bytes, windows;
+} measure;
+
+/*
+Throughput bench: stream_bench() opens any http url through the normal path
+of stream_sock() and data is discarded as soon as it has been written in 
+streambuf, so that only network, lwIP/TLS and stream thread are measured. 
+Instrumentation costs nothing more than a test when not active. It refuses to 
+start while a stream is open and a stream opened by server aborts it. A timer 
+only counts if the bench was already active when it started (t is 0 otherwise)
+and 'measuring' tells the bench's own stream_sock() to time the TLS handshake.
+*/
+static struct {
+	bool active, aborted, measuring;
+	struct stream_bench *result;
+} bench;
+
+#define BENCH_START(t) t = bench.active ? gettime_us() : 0
+#define BENCH_ADD(x, t) if (t && bench.active) bench.result->x += gettime_us() - t
+
 #if USE_SSL
 static SSL_CTX *SSLctx;
 SSL *ssl;
@@ -145,6 +184,63 @@ static bool send_header(void) {
 
 static bool running = true;
 
+static u32_t quantile(float confidence) {
+	// one-sided normal quantiles, x 100
+	static const struct { float p; u32_t k; } table[] = {
+		{ 50, 0 }, { 80, 84 }, { 90, 128 }, { 95, 164 }, { 99, 233 }, 
+		{ 99.9, 309 }, { 99.99, 372 }, { 99.999, 427 }, { 0, 0 } };
+	int i;
+	
+	if (confidence <= table[0].p) return 0;
+	for (i = 1; table[i].p; i++) {
+		if (confidence <= table[i].p) {
+			return table[i-1].k + (table[i].k - table[i-1].k) * (confidence - table[i-1].p) / (table[i].p - table[i-1].p);
+		}	
+	}
+	return table[i-1].k;
+}
+
+static void _measure_reset(void) {
+	memset(&measure, 0, sizeof(measure));
+	stream.rate = stream.gap = stream.jitter = 0;
+	stream.dyn_threshold = stream.dyn_output_threshold = 0;
+}
+
+static void _measure(unsigned n) {
+	u32_t now = gettime_ms();
+	s32_t err;
+
+	// first chunk only sets the reference (includes headers & connection time)
+	if (!measure.last) {
+		measure.last = measure.start = now;
+		return;
+	}
+
+	// gap and its mean deviation (all scaled by 8)
+	err = ((now - measure.last) << 3) - stream.gap;
+	stream.gap += err >> 3;
+	stream.jitter += ((err < 0 ? -err : err) - (s32_t) stream.jitter) >> 2;
+	measure.last = now;
+
+	// throughput over windows
+	measure.bytes += n;
+	if (now - measure.start >= RATE_WINDOW_MS) {
+		u32_t rate = (u64_t) measure.bytes * 1000 / (now - measure.start);
+		stream.rate = measure.windows++ ? stream.rate - (stream.rate >> 3) + (rate >> 3) : rate;
+		measure.start = now;
+		measure.bytes = 0;
+	}
+
+	if (confidence_k && measure.windows >= MIN_RATE_WINDOWS) {
+		u32_t stall = (stream.gap + stream.jitter * confidence_k / 100) >> 3;
+		stall = stall > MIN_STALL_MS ? stall : MIN_STALL_MS;
+		u32_t rate = stream.bitrate && stream.bitrate < stream.rate ? stream.bitrate : stream.rate;
+		stream.dyn_threshold = (u64_t) rate * stall / 1000;
+		if (stream.dyn_threshold < MIN_DYN_THRESHOLD) stream.dyn_threshold = MIN_DYN_THRESHOLD;
+		stream.dyn_output_threshold = (stall + 99) / 100;
+	}
+}
+
 static void _disconnect(stream_state state, disconnect_code disconnect) {
 	stream.state = state;
 	stream.disconnect = disconnect;
@@ -166,8 +262,11 @@ static void *stream_thread() {
 
 		struct pollfd pollinfo;
 		size_t space;
+		u64_t t = 0;
 
+		BENCH_START(t);
 		LOCK;
+		BENCH_ADD(lock_us, t);
 
 		space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
 
@@ -210,10 +309,15 @@ static void *stream_thread() {
 		// no mutex needed - we just want to know if we are inside poll()
 		polling = true;
 		
+		BENCH_START(t);
 		if (_poll(ssl, &pollinfo, 100)) {
 
 			polling = false;
+			BENCH_ADD(poll_us, t);
+			
+			BENCH_START(t);
 			LOCK;
+			BENCH_ADD(lock_us, t);
 
 			// check socket has not been closed while in poll
 			if (fd < 0) {
@@ -332,7 +436,9 @@ static void *stream_thread() {
 						space = min(space, stream.meta_next);
 					}
 					
+					BENCH_START(t);
 					n = _recv(ssl, fd, streambuf->writep, space, 0);
+					BENCH_ADD(recv_us, t);
 					if (n == 0) {
 						LOG_INFO("end of stream");
 						_disconnect(DISCONNECT, DISCONNECT_OK);
@@ -348,12 +454,25 @@ static void *stream_thread() {
 						if (stream.meta_interval) {
 							stream.meta_next -= n;
 						}
+						_measure(n);
+						if (bench.active) {
+							int i;
+							for (i = 0; i < STREAM_BENCH_BUCKETS - 1 && n >= (256 << i); i++);
+							bench.result->hist[i]++;
+							bench.result->recv_count++;
+							_buf_inc_readp(streambuf, n);
+						}	
 					} else {
 						UNLOCK;
 						continue;
 					}
 
-					if (stream.state == STREAMING_BUFFERING && stream.bytes > stream.threshold) {
+					if (stream.state == STREAMING_BUFFERING && (stream.bytes > stream.threshold ||
+						(stream.dyn_threshold && stream.bytes > stream.dyn_threshold))) {
+						if (stream.bytes <= stream.threshold) {
+							LOG_INFO("early start at %u bytes (threshold %u, rate %u B/s, gap %u ms, jitter %u ms)", (u32_t) stream.bytes,
+									 stream.threshold, stream.rate, stream.gap >> 3, stream.jitter >> 3);
+						}
 						stream.state = STREAMING_HTTP;
 						wake_controller();
 					}
@@ -366,6 +485,7 @@ static void *stream_thread() {
 			
 		} else {
 			polling = false;
+			BENCH_ADD(poll_us, t);
 			LOG_SDEBUG("poll timeout");
 		}
 	}
@@ -418,6 +538,9 @@ void stream_init(log_level level, unsigned stream_buf_size) {
 	*stream.header = '\0';
 
 	fd = -1;
+	
+	confidence_k = quantile(stream_confidence);
+	if (confidence_k) LOG_INFO("adaptive threshold with %.3f%% confidence (k=%u.%02u)", stream_confidence, confidence_k / 100, confidence_k % 100);
 
 #if LINUX || FREEBSD
 	touch_memory(streambuf->buf, streambuf->size);
@@ -481,17 +604,35 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 	stream.sent_headers = false;
 	stream.bytes = 0;
 	stream.threshold = threshold;
+	_measure_reset();
 
 	UNLOCK;
 }
 
 void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait) {
 	struct sockaddr_in addr;
+#if USE_SSL
+	bool measuring;
+#endif	
 
 #if EMBEDDED
 	// wait till we are not polling anymore
 	while (polling && running) { usleep(10000);	}	
 #endif	
+
+	// server stream takes over socket and streambuf
+	LOCK;
+	if (bench.active) {
+		LOG_WARN("stream bench aborted by new stream");
+		bench.active = false;
+		bench.aborted = true;
+	}
+	// only the first call after stream_bench() armed it is the bench's own
+#if USE_SSL
+	measuring = bench.measuring;
+#endif	
+	bench.measuring = false;
+	UNLOCK;
 	
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -522,6 +663,7 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 #if USE_SSL
 	if (ntohs(port) == 443) {
 		char *server = strcasestr(header, "Host:");
+		u64_t t = measuring ? gettime_us() : 0;
 
 		ssl = SSL_new(SSLctx);
 		SSL_set_fd(ssl, sock);
@@ -543,7 +685,13 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 			status = SSL_connect(ssl);
 
 			// successful negotiation
-			if (status == 1) break;
+			if (status == 1) {
+				if (t) {
+					bench.result->tls_us += gettime_us() - t;
+					bench.result->tls = true;
+				}
+				break;
+			}	
 
 			// error or non-blocking requires more time
 			if (status < 0) {
@@ -587,6 +735,7 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 	stream.sent_headers = false;
 	stream.bytes = 0;
 	stream.threshold = threshold;
+	_measure_reset();
 
 	UNLOCK;
 }
@@ -610,3 +759,123 @@ bool stream_disconnect(void) {
 	UNLOCK;
 	return disc;
 }
+
+bool stream_bench(const char *url, unsigned seconds, struct stream_bench *result) {
+	char host[256] = "", *path = "/";
+	const char *p;
+	unsigned port = 80;
+	in_addr_t ip = 0;
+	u32_t start;
+	char *header;
+	int len;
+	bool busy;
+	
+	memset(result, 0, sizeof(struct stream_bench));
+	
+	if (!streambuf->buf) {
+		LOG_ERROR("stream not initialized");
+		return false;
+	}
+
+	LOCK;
+	busy = stream.state > DISCONNECT;
+	UNLOCK;
+	
+	if (busy) {
+		LOG_ERROR("a stream is active, stop playback first");
+		return false;
+	}
+
+	if (!strncasecmp(url, "https://", 8)) {
+#if USE_SSL		
+		port = 443;
+		p = url + 8;
+#else
+		LOG_ERROR("no SSL support for %s", url);
+		return false;
+#endif		
+	} else if (!strncasecmp(url, "http://", 7)) {
+		p = url + 7;
+	} else {
+		LOG_ERROR("unsupported url %s", url);
+		return false;
+	}
+
+	// host[:port] then path	
+	len = strcspn(p, "/");
+	if (len >= sizeof(host)) len = sizeof(host) - 1;
+	memcpy(host, p, len);
+	if (p[len]) path = (char*) p + len;
+	
+	header = malloc(MAX_HEADER);
+	len = snprintf(header, MAX_HEADER, "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
+	
+	server_addr(host, &ip, &port);
+	if (!ip) {
+		LOG_ERROR("can't resolve %s", host);
+		free(header);
+		return false;
+	}
+	
+	stream_disconnect();
+	
+	LOCK;
+	bench.result = result;
+	bench.aborted = false;
+	bench.measuring = true;
+	UNLOCK;
+	
+	stream_sock(ip, htons(port), header, len, 0, false);
+	free(header);
+	
+	start = gettime_ms();
+	
+	LOCK;
+	// never leave it armed for the next server stream
+	bench.measuring = false;
+	// stream_sock does not raise any flag when it fails
+	bench.active = stream.state != DISCONNECT;
+	// no need to send headers to server
+	stream.sent_headers = true;
+	UNLOCK;
+	
+	while (bench.active && gettime_ms() - start < seconds * 1000) {
+		usleep(100000);
+		LOCK;
+		if (stream.state <= DISCONNECT) bench.active = false;
+		UNLOCK;
+	}
+	
+	LOCK;
+	bench.active = false;
+	busy = bench.aborted;
+	result->duration_ms = gettime_ms() - start;
+	if (!busy) result->bytes = stream.bytes;
+	UNLOCK;
+	
+	// socket and streambuf now belong to the server's stream
+	if (busy) return false;
+	
+	stream_disconnect();
+	buf_flush(streambuf);
+	
+	return result->bytes != 0;
+}
+
+void stream_bench_report(struct stream_bench *result) {
+	char hist[STREAM_BENCH_BUCKETS * 24] = "";
+	int i;
+	
+	for (i = 0; i < STREAM_BENCH_BUCKETS; i++) {
+		sprintf(hist + strlen(hist), " %s%u:%u", i == STREAM_BENCH_BUCKETS - 1 ? ">=" : "<", 
+				256 << (i == STREAM_BENCH_BUCKETS - 1 ? i - 1 : i), result->hist[i]);
+	}	
+	
+	logprint("stream bench: %u bytes in %u ms => %.3f MB/s\n", (u32_t) result->bytes, result->duration_ms, 
+			 result->duration_ms ? result->bytes / (result->duration_ms * 1000.0) : 0.0);
+	logprint("  recv: %u calls, avg %u bytes, histogram%s\n", result->recv_count, 
+			 result->recv_count ? (u32_t) (result->bytes / result->recv_count) : 0, hist);
+	logprint("  time (ms) poll: %u, recv: %u, lock: %u, TLS handshake: %u%s\n", (u32_t) (result->poll_us / 1000), 
+			 (u32_t) (result->recv_us / 1000), (u32_t) (result->lock_us / 1000), (u32_t) (result->tls_us / 1000), 
+			 result->tls ? " (recv includes TLS decryption)" : " (no TLS)");
+}
@@ -10,6 +10,7 @@
  */
  
 #include <string.h>
+#include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/i2s.h"
@@ -62,7 +63,7 @@ static const struct tas57xx_cmd_s tas57xx_cmd[] = {
 static uint8_t tas57_addr;
 static int i2c_port;
 
-static void dac_cmd(dac_cmd_e cmd, ...);
+static esp_err_t dac_cmd(dac_cmd_e cmd, ...);
 static int tas57_detect(void);
 
 /****************************************************************************************
@@ -132,7 +133,8 @@ static void deinit(void)	{
  * change volume
  */
 static bool volume(unsigned left, unsigned right) { 
-	return false; 
+	// DAC soft-ramps volume changes itself
+	return dac_cmd(TAS57_VOLUME, left, right) == ESP_OK; 
 }
 
 /****************************************************************************************
@@ -171,7 +173,7 @@ static void headset(bool active) { }
 /****************************************************************************************
  * DAC specific commands
  */
-void dac_cmd(dac_cmd_e cmd, ...) {
+esp_err_t dac_cmd(dac_cmd_e cmd, ...) {
 	va_list args;
 	esp_err_t ret = ESP_OK;
 	
@@ -180,7 +182,17 @@ void dac_cmd(dac_cmd_e cmd, ...) {
 
 	switch(cmd) {
 	case TAS57_VOLUME:
-		ESP_LOGE(TAG, "DAC volume not handled yet");
+		// digital volume is 0.5 dB steps from +24 dB (0x00), 0 dB is 0x30 and 0xff is mute (gain is 16.16)
+		for (int reg = 0x3d; reg <= 0x3e; reg++) {
+			unsigned gain = va_arg(args, unsigned);
+			int value = gain ? 0x30 - lround(40 * log10(gain / 65536.0)) : 0xff;
+			i2c_master_start(i2c_cmd);
+			i2c_master_write_byte(i2c_cmd, tas57_addr | I2C_MASTER_WRITE, I2C_MASTER_NACK);
+			i2c_master_write_byte(i2c_cmd, reg, I2C_MASTER_NACK);
+			i2c_master_write_byte(i2c_cmd, value < 0 ? 0 : (value > 0xff ? 0xff : value), I2C_MASTER_NACK);
+		}	
+		i2c_master_stop(i2c_cmd);	
+		ret	= i2c_master_cmd_begin(i2c_port, i2c_cmd, 50 / portTICK_RATE_MS);
 		break;
 	default:
 		i2c_master_start(i2c_cmd);
@@ -198,6 +210,7 @@ void dac_cmd(dac_cmd_e cmd, ...) {
 	}
 
 	va_end(args);
+	return ret;
 }
 
 /****************************************************************************************
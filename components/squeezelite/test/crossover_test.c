@@ -0,0 +1,160 @@
+/* 
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include "squeezelite.h"
+#include "crossover.h"
+
+/*
+ Feeds the crossover by odd sized chunks like the output thread does for the two I2S ports and checks 
+ that LR4 bands add up flat, stay in phase with each other, that band delays shift by exact frames 
+ whatever the chunking and that 2.1 low band is mono. Then runs the on-target "xover_bench" on host.
+*/
+
+#define RATE	44100
+#define FRAMES	16384
+#define FREQ	2000
+#define LEVEL	8000
+
+struct outputstate output;
+
+const char *logtime(void) { return ""; }
+void logprint(const char *fmt, ...) { va_list args; va_start(args, fmt); vprintf(fmt, args); va_end(args); }
+
+u64_t gettime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static s16_t in[FRAMES * 2], hi[FRAMES * 2], lo[FRAMES * 2];
+static int failed;
+
+#define CHECK(cond, fmt, ...) do { if (!(cond)) { printf("FAIL %s: " fmt "\n", __FUNCTION__, ##__VA_ARGS__); failed++; return; } } while (0)
+
+static void sine(unsigned freq) {
+	for (int i = 0; i < FRAMES; i++) in[i * 2] = in[i * 2 + 1] = lround(LEVEL * sin(2 * M_PI * freq * i / RATE));
+}
+
+static void noise(void) {
+	u32_t seed = 1;
+	for (int i = 0; i < FRAMES * 2; i++) {
+		seed = seed * 1103515245 + 12345;
+		in[i] = (s16_t) (seed >> 16) / 4;
+	}
+}
+
+// simulated output thread: high band is done in place in the main port buffer, low band goes to the other
+static void run(char *config, const frames_t *chunks) {
+	crossover_config(config);
+	memcpy(hi, in, sizeof(hi));
+
+	for (frames_t i = 0, n, c = 0; i < FRAMES; i += n, c++) {
+		n = min(chunks[c % 3], FRAMES - i);
+		crossover_process(hi + i * 2, lo + i * 2, n, RATE);
+	}
+}
+
+// level in dB of a channel over the second half (filters have settled), optionally summed with another buffer
+static double level(s16_t *a, s16_t *b, int ch) {
+	double sum = 0;
+	for (int i = FRAMES / 2; i < FRAMES; i++) {
+		double v = a[i * 2 + ch] + (b ? b[i * 2 + ch] : 0);
+		sum += v * v;
+	}
+	return 10 * log10(sum / (FRAMES / 2));
+}
+
+static double correlation(s16_t *a, s16_t *b, int ch) {
+	double ab = 0, aa = 0, bb = 0;
+	for (int i = FRAMES / 2; i < FRAMES; i++) {
+		ab += (double) a[i * 2 + ch] * b[i * 2 + ch];
+		aa += (double) a[i * 2 + ch] * a[i * 2 + ch];
+		bb += (double) b[i * 2 + ch] * b[i * 2 + ch];
+	}
+	return ab / sqrt(aa * bb);
+}
+
+static void test_flat(void) {
+	static const unsigned freqs[] = { 50, 200, 1000, FREQ, 4000, 12000 };
+	static const frames_t chunks[] = { 512, 512, 512 };
+
+	for (int f = 0; f < sizeof(freqs) / sizeof(*freqs); f++) {
+		sine(freqs[f]);
+		run("freq=" STR(FREQ), chunks);
+		for (int ch = 0; ch < 2; ch++) {
+			double delta = level(hi, lo, ch) - level(in, NULL, ch);
+			CHECK(fabs(delta) < 0.1, "band sum at %u Hz is %+.3f dB", freqs[f], delta);
+		}
+	}
+}
+
+static void test_aligned(void) {
+	static const unsigned freqs[] = { FREQ / 2, FREQ, FREQ * 2 };
+	static const frames_t chunks[] = { 100, 7, 333 };
+
+	for (int f = 0; f < sizeof(freqs) / sizeof(*freqs); f++) {
+		sine(freqs[f]);
+		run("freq=" STR(FREQ), chunks);
+		for (int ch = 0; ch < 2; ch++) {
+			double c = correlation(hi, lo, ch);
+			CHECK(c > 0.99, "bands at %u Hz correlate at %.3f", freqs[f], c);
+		}
+	}
+
+	// both bands are 6 dB down at crossover frequency
+	sine(FREQ);
+	run("freq=" STR(FREQ), chunks);
+	for (int ch = 0; ch < 2; ch++) {
+		double ref = level(in, NULL, ch), h = level(hi, NULL, ch) - ref, l = level(lo, NULL, ch) - ref;
+		CHECK(fabs(h + 6.02) < 0.2 && fabs(l + 6.02) < 0.2, "bands at crossover are %+.2f/%+.2f dB", h, l);
+	}
+}
+
+static void test_delay(void) {
+	static const frames_t whole[] = { FRAMES, FRAMES, FRAMES }, chunks[] = { 100, 7, 333 };
+	static s16_t hi_ref[FRAMES * 2], lo_ref[FRAMES * 2];
+	frames_t shift = (u64_t) 1000 * RATE / 1000000;
+
+	noise();
+	run("freq=" STR(FREQ), whole);
+	memcpy(hi_ref, hi, sizeof(hi));
+	memcpy(lo_ref, lo, sizeof(lo));
+
+	// low band delayed by 1 ms, high band must not move
+	run("freq=" STR(FREQ) ",delay_lo=1000", chunks);
+	CHECK(!memcmp(hi, hi_ref, sizeof(hi)), "high band moved");
+	for (int i = 0; i < shift * 2; i++) CHECK(!lo[i], "sample %d not silent before delay", i);
+	CHECK(!memcmp(lo + shift * 2, lo_ref, (FRAMES - shift) * BYTES_PER_FRAME), "low band not shifted by %u frames", shift);
+}
+
+static void test_sub(void) {
+	static const frames_t chunks[] = { 512, 100, 7 };
+
+	noise();
+	run("freq=100,mode=2.1", chunks);
+	for (int i = 0; i < FRAMES; i++) CHECK(lo[i * 2] == lo[i * 2 + 1], "2.1 low band frame %d is not mono", i);
+}
+
+int main(void) {
+	test_flat();
+	test_aligned();
+	test_delay();
+	test_sub();
+	crossover_close();
+
+	printf("crossover: %s\n", failed ? "FAILED" : "passed");
+	crossover_bench();
+
+	return failed ? 1 : 0;
+}
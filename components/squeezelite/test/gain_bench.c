@@ -0,0 +1,36 @@
+/* 
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "squeezelite.h"
+
+/*
+ Host run of the on-target "chan_bench": cost of the gain stage with channel matrix off (stereo) 
+ and on (other modes). Host figures only compare modes with each other, not with the esp32.
+*/
+
+struct outputstate output;
+
+const char *logtime(void) { return ""; }
+void logprint(const char *fmt, ...) { va_list args; va_start(args, fmt); vprintf(fmt, args); va_end(args); }
+
+u64_t gettime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(void) {
+	output.current_sample_rate = 44100;
+	channels_bench();
+	return 0;
+}
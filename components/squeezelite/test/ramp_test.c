@@ -0,0 +1,115 @@
+/* 
+ *  Squeezelite for esp32
+ *
+ *  (c) Philippe G. 2020, philippe_44@outlook.com
+ *
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "squeezelite.h"
+
+/*
+ Checks the gain ramp of _apply_gain on a constant signal: no frame may jump by more than
+ one ramp step, the ramp must be monotonic and land exactly on target, whatever the chunking.
+*/
+
+#define LEVEL	16384
+#define RATE	44100
+#define FRAMES	4096
+
+struct outputstate output;
+
+const char *logtime(void) { return ""; }
+void logprint(const char *fmt, ...) { va_list args; va_start(args, fmt); vfprintf(stderr, fmt, args); va_end(args); }
+u64_t gettime_us(void) { return 0; }
+
+static ISAMPLE_T samples[FRAMES * 2];
+static int failed;
+
+#define CHECK(cond, fmt, ...) do { if (!(cond)) { printf("FAIL %s: " fmt "\n", __FUNCTION__, ##__VA_ARGS__); failed++; return; } } while (0)
+
+// run count frames in chunks through the gain stage, targets switch at frame 'at'
+static void run(frames_t count, frames_t chunk, s32_t from, s32_t to, frames_t at) {
+	struct buffer buf = { .readp = (u8_t*) samples };
+	frames_t i;
+
+	for (i = 0; i < count * 2; i++) samples[i] = LEVEL;
+
+	for (i = 0; i < count; i += chunk) {
+		frames_t n = min(chunk, count - i);
+		buf.readp = (u8_t*) (samples + i * 2);
+		_apply_gain(&buf, n, i < at ? from : to, i < at ? from : to);
+	}
+}
+
+// largest step between successive frames for a ramp between two gains
+static int step_max(s32_t from, s32_t to) {
+	frames_t frames = (u64_t) RATE * output.ramp_ms / 1000;
+	int delta = abs(gain(from, LEVEL) - gain(to, LEVEL));
+	return frames ? delta / frames + 2 : delta;
+}
+
+// settle on a gain so that next test starts without a ramp
+static void settle(s32_t g) {
+	run(FRAMES, FRAMES, g, g, 0);
+	run(16, 16, g, g, 0);
+}
+
+static void test_down(frames_t chunk) {
+	s32_t to = FIXED_ONE / 4;
+	int i, bound = step_max(FIXED_ONE, to);
+
+	settle(FIXED_ONE);
+	run(FRAMES, chunk, to, to, 0);
+
+	CHECK(samples[0] <= LEVEL && samples[0] >= LEVEL - bound, "first frame %d", samples[0]);
+	for (i = 1; i < FRAMES; i++) {
+		int delta = samples[i * 2 - 2] - samples[i * 2];
+		CHECK(delta >= 0 && delta <= bound, "frame %d jumps by %d (chunk %u)", i, delta, chunk);
+		CHECK(samples[i * 2] == samples[i * 2 + 1], "frame %d channels differ", i);
+	}
+	CHECK(samples[FRAMES * 2 - 1] == gain(to, LEVEL), "ends on %d instead of %d (chunk %u)",
+		  samples[FRAMES * 2 - 1], gain(to, LEVEL), chunk);
+}
+
+static void test_reverse(void) {
+	s32_t to = FIXED_ONE / 8;
+	int i, bound = step_max(FIXED_ONE, to);
+
+	// reverse halfway through ramp, it must restart from where it is
+	settle(FIXED_ONE);
+	run(FRAMES, 64, to, FIXED_ONE, 192);
+
+	for (i = 1; i < FRAMES; i++) {
+		int delta = abs(samples[i * 2 - 2] - samples[i * 2]);
+		CHECK(delta <= bound, "frame %d jumps by %d", i, delta);
+	}
+	CHECK(samples[FRAMES * 2 - 1] == LEVEL, "ends on %d", samples[FRAMES * 2 - 1]);
+}
+
+static void test_immediate(void) {
+	output.ramp_ms = 0;
+	settle(FIXED_ONE);
+	run(64, 64, FIXED_ONE / 2, FIXED_ONE / 2, 0);
+	output.ramp_ms = 10;
+	CHECK(samples[2] == gain(FIXED_ONE / 2, LEVEL), "second frame is %d", samples[2]);
+}
+
+int main(void) {
+	output.current_sample_rate = RATE;
+	output.ramp_ms = 10;
+
+	test_down(FRAMES);
+	test_down(100);
+	test_down(1);
+	test_reverse();
+	test_immediate();
+
+	printf("gain ramp: %s\n", failed ? "FAILED" : "passed");
+	return failed ? 1 : 0;
+}
@@ -122,6 +122,31 @@ u32_t gettime_ms(void) {
 }
 #endif
 
+#if !defined(gettime_us)
+u64_t gettime_us(void) {
+#if WIN
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return count.QuadPart * 1000000 / freq.QuadPart;
+#else
+#if LINUX || FREEBSD
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+#else
+	if (!clock_gettime(CLOCK_REALTIME, &ts)) {
+#endif
+		return (u64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+#endif
+
 // mac address
 #if LINUX && !defined(SUN)
 // search first 4 interfaces returned by IFCONF
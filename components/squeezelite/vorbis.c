@@ -22,49 +22,42 @@
 #include "squeezelite.h"
 
 /* 
-*  with some low-end CPU, the decode call takes a fair bit of time and if the outputbuf is locked during that
-*  period, the output_thread (or equivalent) will be locked although there is plenty of samples available.
-*  Normally, with PRIO_INHERIT, that thread should increase decoder priority and get the lock quickly but it
-*  seems that when the streambuf has plenty of data, the decode thread grabs the CPU to much, even it the output
-*  thread has a higher priority. Using an interim buffer where vorbis decoder writes the output is not great from
-*  an efficiency (one extra memory copy) point of view, but it allows the lock to not be kept for too long
+*  Ogg pages are demuxed in place from streambuf (see ogg.c) and packets go straight to tremor's synthesis, so
+*  there is no intermediate buffering. The decoder writes directly in the free part of outputbuf without holding
+*  the lock as this thread is the only one writing there (flush and resize only happen with decode mutex held),
+*  then the lock is taken to publish the frames.
 */
-#if EMBEDDED
-#define FRAME_BUF 2048
-#endif
-
 #if BYTES_PER_FRAME == 4		
 #define ALIGN(n) 	(n)
 #else
 #define ALIGN(n) 	(n << 16)		
 #endif
 
-// automatically select between floating point (preferred) and fixed point libraries:
-// NOTE: works with Tremor version here: http://svn.xiph.org/trunk/Tremor, not vorbisidec.1.0.2 currently in ubuntu
-
-// we take common definations from <vorbis/vorbisfile.h> even though we can use tremor at run time
-// tremor's OggVorbis_File struct is normally smaller so this is ok, but padding added to malloc in case it is bigger
-#define OV_EXCLUDE_STATIC_CALLBACKS
-
-#ifdef TREMOR_ONLY
-#include <ivorbisfile.h>
-#else
-#include <vorbis/vorbisfile.h>
-#endif
+// tremor (fixed point) is used for its integer synthesis output, whatever the platform
+#include <ivorbiscodec.h>
 
 struct vorbis {
-	OggVorbis_File *vf;
-	bool opened;
-#if FRAME_BUF	
-	u8_t *write_buf;
-#endif	
+	struct ogg ogg;
+	vorbis_info vi;
+	vorbis_comment vc;
+	vorbis_dsp_state vd;
+	vorbis_block vb;
+	int headers;
 #if !LINKALL
-	// vorbis symbols to be dynamically loaded - from either vorbisfile or vorbisidec (tremor) version of library
-	vorbis_info *(* ov_info)(OggVorbis_File *vf, int link);
-	int (* ov_clear)(OggVorbis_File *vf);
-	long (* ov_read)(OggVorbis_File *vf, char *buffer, int length, int bigendianp, int word, int sgned, int *bitstream);
-	long (* ov_read_tremor)(OggVorbis_File *vf, char *buffer, int length, int *bitstream);
-	int (* ov_open_callbacks)(void *datasource, OggVorbis_File *vf, const char *initial, long ibytes, ov_callbacks callbacks);
+	// tremor symbols to be dynamically loaded
+	void (* vorbis_info_init)(vorbis_info *vi);
+	void (* vorbis_info_clear)(vorbis_info *vi);
+	void (* vorbis_comment_init)(vorbis_comment *vc);
+	void (* vorbis_comment_clear)(vorbis_comment *vc);
+	int (* vorbis_block_init)(vorbis_dsp_state *v, vorbis_block *vb);
+	int (* vorbis_block_clear)(vorbis_block *vb);
+	void (* vorbis_dsp_clear)(vorbis_dsp_state *v);
+	int (* vorbis_synthesis_headerin)(vorbis_info *vi, vorbis_comment *vc, ogg_packet *op);
+	int (* vorbis_synthesis_init)(vorbis_dsp_state *v, vorbis_info *vi);
+	int (* vorbis_synthesis)(vorbis_block *vb, ogg_packet *op);
+	int (* vorbis_synthesis_blockin)(vorbis_dsp_state *v, vorbis_block *vb);
+	int (* vorbis_synthesis_pcmout)(vorbis_dsp_state *v, ogg_int32_t ***pcm);
+	int (* vorbis_synthesis_read)(vorbis_dsp_state *v, int samples);
 #endif
 };
 
@@ -100,255 +93,217 @@ extern struct processstate process;
 #endif
 
 #if LINKALL
-#define OV(h, fn, ...) (ov_ ## fn)(__VA_ARGS__)
-#define TREMOR(h)      0
-#if !WIN
-extern int ov_read_tremor(); // needed to enable compilation, not linked
-#endif
+#define VORBIS(h, fn, ...) (vorbis_ ## fn)(__VA_ARGS__)
 #else
-#define OV(h, fn, ...) (h)->ov_##fn(__VA_ARGS__)
-#define TREMOR(h)      (h)->ov_read_tremor
+#define VORBIS(h, fn, ...) (h)->vorbis_##fn(__VA_ARGS__)
 #endif
 
-// called with mutex locked within vorbis_decode to avoid locking O before S
-static size_t _read_cb(void *ptr, size_t size, size_t nmemb, void *datasource) {
-	size_t bytes;
-
-	LOCK_S;
-
-	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
-	bytes = min(bytes, size * nmemb);
-
-	memcpy(ptr, streambuf->readp, bytes);
-	_buf_inc_readp(streambuf, bytes);
+// tremor samples have 9 fractional bits more than 16 bits pcm
+static inline s16_t _clip(ogg_int32_t sample) {
+	sample >>= 9;
+	return sample > 32767 ? 32767 : (sample < -32768 ? -32768 : sample);
+}
 
-	UNLOCK_S;
+static bool _probe(u8_t *packet, u32_t len) {
+	return len >= 7 && packet[0] == 1 && !memcmp(packet + 1, "vorbis", 6);
+}
 
-	return bytes / size;
+static void _clear(void) {
+	if (v->headers == 3) {
+		VORBIS(v, block_clear, &v->vb);
+		VORBIS(v, dsp_clear, &v->vd);
+	}
+	VORBIS(v, comment_clear, &v->vc);
+	VORBIS(v, info_clear, &v->vi);
+	VORBIS(v, info_init, &v->vi);
+	VORBIS(v, comment_init, &v->vc);
+	v->headers = 0;
 }
 
-// these are needed for older versions of tremor, later versions and libvorbis allow NULL to be used
-static int _seek_cb(void *datasource, ogg_int64_t offset, int whence) {  return -1; }
-static int _close_cb(void *datasource) { return 0; }
-static long _tell_cb(void *datasource) { return 0; }
+// move synthesized pcm to outputbuf, as much as fits
+static void _write_pcm(void) {
+	ogg_int32_t **pcm;
+	frames_t frames, count;
+	ISAMPLE_T *optr;
+	int n;
 
-static decode_state vorbis_decode(void) {
-	static int channels;
-	frames_t frames;
-	int bytes, s, n;
-	u8_t *write_buf;
+	n = VORBIS(v, synthesis_pcmout, &v->vd, &pcm);
+	if (n <= 0) return;
 
-	LOCK_S;
-
-	if (stream.state <= DISCONNECT && !_buf_used(streambuf)) {
-		UNLOCK_S;
-		return DECODE_COMPLETE;
-	}
-	
-	UNLOCK_S;
-	
-	if (decode.new_stream) {
-		ov_callbacks cbs;
-		int err;
-		struct vorbis_info *info;
+	LOCK_O_direct;
+	IF_DIRECT(
+		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+		optr = (ISAMPLE_T *) outputbuf->writep;
+	);
+	UNLOCK_O_direct;
+	IF_PROCESS(
+		frames = process.max_in_frames;
+		optr = (ISAMPLE_T *) process.inbuf;
+	);
 
-		cbs.read_func = _read_cb;
+	frames = min(frames, n);
+	count = frames;
 
-		if (TREMOR(v)) {
-			cbs.seek_func = _seek_cb; cbs.close_func = _close_cb; cbs.tell_func = _tell_cb;
-		} else {
-			cbs.seek_func = NULL; cbs.close_func = NULL; cbs.tell_func = NULL;
+	if (v->vi.channels == 2) {
+		ogg_int32_t *lptr = pcm[0], *rptr = pcm[1];
+		while (count--) {
+			*optr++ = ALIGN(_clip(*lptr++));
+			*optr++ = ALIGN(_clip(*rptr++));
 		}
-
-		if ((err = OV(v, open_callbacks, streambuf, v->vf, NULL, 0, cbs)) < 0) {
-			LOG_WARN("open_callbacks error: %d", err);
-			return DECODE_COMPLETE;
+	} else {
+		ogg_int32_t *iptr = pcm[0];
+		while (count--) {
+			*optr = ALIGN(_clip(*iptr++));
+			optr[1] = *optr;
+			optr += 2;
 		}
+	}
 
-		v->opened = true;
-		info = OV(v, info, v->vf, -1);
-
-		LOG_INFO("setting track_start");
-		LOCK_O;
-		output.next_sample_rate = decode_newstream(info->rate, output.supported_rates);
-		IF_DSD(	output.next_fmt = PCM; )
-		output.track_start = outputbuf->writep;
-		if (output.fade_mode) _checkfade(true);
-		decode.new_stream = false;
-		UNLOCK_O;
-
-		channels = info->channels;
+	VORBIS(v, synthesis_read, &v->vd, frames);
 
-		if (channels > 2) {
-			LOG_WARN("too many channels: %d", channels);
-			return DECODE_ERROR;
-		}
-	}
-	
-#if FRAME_BUF
-	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		frames = min(frames, FRAME_BUF);
-		write_buf = v->write_buf;
-	);
-#else
 	LOCK_O_direct;
 	IF_DIRECT(
-		frames = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
-		write_buf = outputbuf->writep;
+		_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
 	);
-#endif
+	UNLOCK_O_direct;
 	IF_PROCESS(
-		frames = process.max_in_frames;
-		write_buf = process.inbuf;
+		process.in_frames = frames;
 	);
-	
-	bytes = frames * 2 * channels; // samples returned are 16 bits
 
-	// write the decoded frames into outputbuf even though they are 16 bits per sample, then unpack them
-#ifdef TREMOR_ONLY	
-	n = OV(v, read, v->vf, (char *)write_buf, bytes, &s);
-#else
-	if (!TREMOR(v)) {
-#if SL_LITTLE_ENDIAN
-		n = OV(v, read, v->vf, (char *)write_buf, bytes, 0, 2, 1, &s);
-#else
-		n = OV(v, read, v->vf, (char *)write_buf, bytes, 1, 2, 1, &s);
-#endif
-#if !WIN
-	} else {
-		n = OV(v, read_tremor, v->vf, (char *)write_buf, bytes, &s);
-#endif
+	LOG_SDEBUG("wrote %u frames", frames);
+}
+
+static decode_state vorbis_decode(void) {
+	ogg_packet op;
+	u8_t *data;
+	u32_t len;
+	bool eos;
+	int n;
+
+	// pcm of previous packet has to be drained first
+	if (v->headers == 3 && VORBIS(v, synthesis_pcmout, &v->vd, NULL) > 0) {
+		_write_pcm();
+		return DECODE_RUNNING;
 	}
-#endif	
 
-#if FRAME_BUF
-	LOCK_O_direct;
-#endif	
-
-	if (n > 0) {
-		frames_t count;
-		s16_t *iptr;
-		ISAMPLE_T *optr;
-
-		frames = n / 2 / channels;
-		count = frames * channels;
-
-		// work backward to unpack samples (if needed)
-		iptr = (s16_t *) write_buf + count;
-		optr = (ISAMPLE_T *) write_buf + frames * 2;
-
-		if (channels == 2) {
-#if BYTES_PER_FRAME == 4
-#if FRAME_BUF
-			// copy needed only when DIRECT and FRAME_BUF
-			IF_DIRECT(
-				memcpy(outputbuf->writep, write_buf, frames * BYTES_PER_FRAME);
-			)
-#endif			
-#else
-			while (count--) {
-				*--optr = ALIGN(*--iptr);
-			}
-#endif
-		} else if (channels == 1) {
-			while (count--) {
-				*--optr = ALIGN(*--iptr);
-				*--optr = ALIGN(*iptr);
-			}
+	LOCK_S;
+	eos = stream.state <= DISCONNECT;
+	n = _ogg_next_packet(&v->ogg, &data, &len);
+	UNLOCK_S;
+
+	if (!n) {
+		if (eos) LOG_INFO("end of stream");
+		return eos ? DECODE_COMPLETE : DECODE_RUNNING;
+	}
+
+	// first packet of a chained stream, headers will follow
+	if (v->ogg.chained && v->ogg.packetno == 1) {
+		_clear();
+	}
+
+	op.packet = data;
+	op.bytes = len;
+	op.b_o_s = v->ogg.packetno == 1;
+	op.e_o_s = v->ogg.last;
+	op.granulepos = v->ogg.granule;
+	op.packetno = v->ogg.packetno - 1;
+
+	if (v->headers < 3) {
+		if ((n = VORBIS(v, synthesis_headerin, &v->vi, &v->vc, &op)) < 0) {
+			LOG_WARN("header %d error: %d", v->headers, n);
+			return DECODE_ERROR;
 		}
-		
-		IF_DIRECT(
-			_buf_inc_writep(outputbuf, frames * BYTES_PER_FRAME);
-		);
-		IF_PROCESS(
-			process.in_frames = frames;
-		);
 
-		LOG_SDEBUG("wrote %u frames", frames);
+		if (v->headers == 1 && v->ogg.chained) {
+			LOCK_S;
+			_ogg_comments(data + 7, len - 7);
+			UNLOCK_S;
+		}
 
-	} else if (n == 0) {
+		if (++v->headers < 3) {
+			return DECODE_RUNNING;
+		}
 
-		if (stream.state <= DISCONNECT) {
-			LOG_INFO("partial decode");
-			UNLOCK_O_direct;
-			return DECODE_COMPLETE;
-		} else {
-			LOG_INFO("no frame decoded");
-        }
+		if (v->vi.channels > 2) {
+			LOG_WARN("too many channels: %d", v->vi.channels);
+			v->headers = 0;
+			return DECODE_ERROR;
+		}
 
-	} else if (n == OV_HOLE) {
+		VORBIS(v, synthesis_init, &v->vd, &v->vi);
+		VORBIS(v, block_init, &v->vd, &v->vb);
 
-		// recoverable hole in stream, seen when skipping
-		LOG_DEBUG("hole in stream");
+		// a chained stream is a new track whose format may differ
+		if (v->ogg.chained) {
+			decode.new_stream = true;
+			v->ogg.chained = false;
+		}
 
-	} else {
+		if (decode.new_stream) {
+			LOG_INFO("setting track_start");
+			LOCK_O;
+			output.next_sample_rate = decode_newstream(v->vi.rate, output.supported_rates);
+			IF_DSD(	output.next_fmt = PCM; )
+			output.track_start = outputbuf->writep;
+			if (output.fade_mode) _checkfade(true);
+			decode.new_stream = false;
+			UNLOCK_O;
+		}
 
-		LOG_INFO("ov_read error: %d", n);
-		UNLOCK_O_direct;
-		return DECODE_COMPLETE;
+		return DECODE_RUNNING;
+	}
+
+	if ((n = VORBIS(v, synthesis, &v->vb, &op)) == 0) {
+		VORBIS(v, synthesis_blockin, &v->vd, &v->vb);
+		_write_pcm();
+	} else {
+		// not an audio packet or corrupted one, just skip it
+		LOG_DEBUG("synthesis error: %d", n);
 	}
 
-	UNLOCK_O_direct;
 	return DECODE_RUNNING;
 }
 
 static void vorbis_open(u8_t size, u8_t rate, u8_t chan, u8_t endianness) {
-	if (!v->vf) {
-		v->vf = malloc(sizeof(OggVorbis_File) + 128); // add some padding as struct size may be larger
-		memset(v->vf, 0, sizeof(OggVorbis_File) + 128);
-#if FRAME_BUF		
-		v->write_buf = malloc(FRAME_BUF * BYTES_PER_FRAME);
-#endif		
-	} else {
-		if (v->opened) {
-			OV(v, clear, v->vf);
-			v->opened = false;
-		}
-	}
+	_clear();
+	ogg_init(&v->ogg, _probe);
 }
 
 static void vorbis_close(void) {
-	if (v->opened) {
-		OV(v, clear, v->vf);
-		v->opened = false;
-	}
-	free(v->vf);
-#if FRAME_BUF	
-	free(v->write_buf);
-	v->write_buf = NULL;
-#endif	
-	v->vf = NULL;
+	_clear();
+	ogg_close(&v->ogg);
 }
 
 static bool load_vorbis() {
 #if !LINKALL
-	void *handle = dlopen(LIBVORBIS, RTLD_NOW);
+	void *handle = dlopen(LIBTREMOR, RTLD_NOW);
 	char *err;
-	bool tremor = false;
 
 	if (!handle) {
-		handle = dlopen(LIBTREMOR, RTLD_NOW);
-		if (handle) {
-			tremor = true;
-		} else {
-			LOG_INFO("dlerror: %s", dlerror());
-			return false;
-		}
+		LOG_INFO("dlerror: %s", dlerror());
+		return false;
 	}
 
-	v->ov_read = tremor ? NULL : dlsym(handle, "ov_read");
-	v->ov_read_tremor = tremor ? dlsym(handle, "ov_read") : NULL;
-	v->ov_info = dlsym(handle, "ov_info");
-	v->ov_clear = dlsym(handle, "ov_clear");
-	v->ov_open_callbacks = dlsym(handle, "ov_open_callbacks");
+	v->vorbis_info_init = dlsym(handle, "vorbis_info_init");
+	v->vorbis_info_clear = dlsym(handle, "vorbis_info_clear");
+	v->vorbis_comment_init = dlsym(handle, "vorbis_comment_init");
+	v->vorbis_comment_clear = dlsym(handle, "vorbis_comment_clear");
+	v->vorbis_block_init = dlsym(handle, "vorbis_block_init");
+	v->vorbis_block_clear = dlsym(handle, "vorbis_block_clear");
+	v->vorbis_dsp_clear = dlsym(handle, "vorbis_dsp_clear");
+	v->vorbis_synthesis_headerin = dlsym(handle, "vorbis_synthesis_headerin");
+	v->vorbis_synthesis_init = dlsym(handle, "vorbis_synthesis_init");
+	v->vorbis_synthesis = dlsym(handle, "vorbis_synthesis");
+	v->vorbis_synthesis_blockin = dlsym(handle, "vorbis_synthesis_blockin");
+	v->vorbis_synthesis_pcmout = dlsym(handle, "vorbis_synthesis_pcmout");
+	v->vorbis_synthesis_read = dlsym(handle, "vorbis_synthesis_read");
 	
 	if ((err = dlerror()) != NULL) {
 		LOG_INFO("dlerror: %s", err);		
 		return false;
 	}
 	
-	LOG_INFO("loaded %s", tremor ? LIBTREMOR : LIBVORBIS);
+	LOG_INFO("loaded "LIBTREMOR);
 #endif
 
 	return true;
@@ -363,20 +318,21 @@ struct codec *register_vorbis(void) {
 		vorbis_open,  // open
 		vorbis_close, // close
 		vorbis_decode,// decode
+		true,         // keep warm
 	};
 
-	v = malloc(sizeof(struct vorbis));
+	v = calloc(1, sizeof(struct vorbis));
 	if (!v) {
 		return NULL;
 	}
 
-	v->vf = NULL;
-	v->opened = false;
-
 	if (!load_vorbis()) {
 		return NULL;
 	}
 
+	VORBIS(v, info_init, &v->vi);
+	VORBIS(v, comment_init, &v->vc);
+
 	LOG_INFO("using vorbis to decode ogg");
 	return &ret;
 }
@@ -72,6 +72,11 @@ Contains the freeRTOS task and all necessary support
 #define SQUEEZELITE_ESP32_RELEASE_URL "https://github.com/sle118/squeezelite-esp32/releases"
 #endif
 
+#if !RECOVERY_APPLICATION
+// from squeezelite's output
+extern void output_underruns(uint32_t *count, uint32_t *stream_count, uint32_t *decode_count, uint32_t *total_ms, uint32_t *max_ms);
+#endif
+
 #define STR_OR_BLANK(p) p==NULL?"":p
 #define FREE_AND_NULL(p) if(p!=NULL){ free(p); p=NULL;}
 /* objects used to manipulate the main queue of events */
@@ -459,6 +464,17 @@ cJSON * wifi_manager_get_basic_info(cJSON **old){
 	cJSON_AddNumberToObject(root,"Voltage",	battery_value_svc());
 	cJSON_AddNumberToObject(root,"disconnect_count", num_disconnect	);
 	cJSON_AddNumberToObject(root,"avg_conn_time", num_disconnect>0?(total_connected_time/num_disconnect):0	);
+#if !RECOVERY_APPLICATION
+	uint32_t count, stream_count, decode_count, total_ms, max_ms;
+	output_underruns(&count, &stream_count, &decode_count, &total_ms, &max_ms);
+	cJSON *underruns = cJSON_CreateObject();
+	cJSON_AddNumberToObject(underruns, "count", count);
+	cJSON_AddNumberToObject(underruns, "stream", stream_count);
+	cJSON_AddNumberToObject(underruns, "decode", decode_count);
+	cJSON_AddNumberToObject(underruns, "total_ms", total_ms);
+	cJSON_AddNumberToObject(underruns, "max_ms", max_ms);
+	cJSON_AddItemToObject(root, "underruns", underruns);
+#endif
 
 	ESP_LOGV(TAG,  "wifi_manager_get_basic_info done");
 	return root;
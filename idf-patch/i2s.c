@@ -90,6 +90,11 @@ typedef struct {
     bool tx_desc_auto_clear;    /*!< I2S auto clear tx descriptor on underflow */
     int fixed_mclk;             /*!< I2S fixed MLCK clock */
     double real_rate;
+    int apll_req;               /*!< fi2s this port needs at its base bck divider */
+    int apll_scale;             /*!< base bck divider */
+    int apll_clk;               /*!< fi2s the APLL runs at (can be a multiple of apll_req when shared) */
+    double apll_rate;           /*!< actual APLL fi2s */
+    bool running;               /*!< started, APLL can't be moved under it unless it can follow */
 #ifdef CONFIG_PM_ENABLE
     esp_pm_lock_handle_t pm_lock;
 #endif
@@ -519,16 +524,60 @@ esp_err_t i2s_set_clk(i2s_port_t i2s_num, uint32_t rate, i2s_bits_per_sample_t b
         fi2s_clk = p_i2s_obj[i2s_num]->fixed_mclk;
         m_scale = fi2s_clk/bits/rate/channel;
     }
-    if(p_i2s_obj[i2s_num]->use_apll && i2s_apll_calculate_fi2s(fi2s_clk, bits, &sdm0, &sdm1, &sdm2, &odir) == ESP_OK) {
-        ESP_LOGD(I2S_TAG, "sdm0=%d, sdm1=%d, sdm2=%d, odir=%d", sdm0, sdm1, sdm2, odir);
-        rtc_clk_apll_enable(1, sdm0, sdm1, sdm2, odir);
+
+    // there is only one APLL: when the other port already runs it at a multiple of what we need, just divide more
+    i2s_obj_t *peer = p_i2s_obj[i2s_num == I2S_NUM_0 ? I2S_NUM_1 : I2S_NUM_0];
+    bool apll_shared = false;
+    if(p_i2s_obj[i2s_num]->use_apll) {
+        p_i2s_obj[i2s_num]->apll_req = fi2s_clk;
+        p_i2s_obj[i2s_num]->apll_scale = m_scale;
+        if (peer && peer->use_apll && peer->apll_clk && peer->apll_clk % fi2s_clk == 0 && m_scale * (peer->apll_clk / fi2s_clk) < 64) {
+            m_scale *= peer->apll_clk / fi2s_clk;
+            fi2s_clk = peer->apll_clk;
+            apll_shared = true;
+        }
+    }
+    // moving the APLL is refused when the other port is running and can't divide from the new clock
+    bool peer_follows = peer && peer->use_apll && peer->apll_req && fi2s_clk % peer->apll_req == 0 && peer->apll_scale * (fi2s_clk / peer->apll_req) < 64;
+    if (p_i2s_obj[i2s_num]->use_apll && !apll_shared && peer && peer->use_apll && peer->apll_req && peer->running && !peer_follows) {
+        ESP_LOGE(I2S_TAG, "APLL can't move to %d, running port %d can't follow (needs %d)", fi2s_clk, peer->i2s_num, peer->apll_req);
+        if ((p_i2s_obj[i2s_num]->mode & I2S_MODE_TX) && p_i2s_obj[i2s_num]->tx) {
+            xSemaphoreGive(p_i2s_obj[i2s_num]->tx->mux);
+        }
+        if ((p_i2s_obj[i2s_num]->mode & I2S_MODE_RX) && p_i2s_obj[i2s_num]->rx) {
+            xSemaphoreGive(p_i2s_obj[i2s_num]->rx->mux);
+        }
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if(p_i2s_obj[i2s_num]->use_apll && (apll_shared || i2s_apll_calculate_fi2s(fi2s_clk, bits, &sdm0, &sdm1, &sdm2, &odir) == ESP_OK)) {
+        double fi2s_rate;
+        if (apll_shared) {
+            fi2s_rate = peer->apll_rate;
+        } else {
+            ESP_LOGD(I2S_TAG, "sdm0=%d, sdm1=%d, sdm2=%d, odir=%d", sdm0, sdm1, sdm2, odir);
+            rtc_clk_apll_enable(1, sdm0, sdm1, sdm2, odir);
+            fi2s_rate = i2s_apll_get_fi2s(bits, sdm0, sdm1, sdm2, odir);
+            // APLL has moved, re-align the other port if it can still divide from there
+            if (peer_follows) {
+                int peer_scale = peer->apll_scale * (fi2s_clk / peer->apll_req);
+                I2S[peer->i2s_num]->sample_rate_conf.tx_bck_div_num = peer_scale;
+                I2S[peer->i2s_num]->sample_rate_conf.rx_bck_div_num = peer_scale;
+                peer->apll_clk = fi2s_clk;
+                peer->apll_rate = fi2s_rate;
+                peer->real_rate = fi2s_rate/peer->bits_per_sample/peer->channel_num/peer_scale;
+            } else if (peer && peer->use_apll && peer->apll_req) {
+                // stopped, it must be set again before being restarted
+                peer->apll_clk = 0;
+            }
+        }
+        p_i2s_obj[i2s_num]->apll_clk = fi2s_clk;
+        p_i2s_obj[i2s_num]->apll_rate = fi2s_rate;
         I2S[i2s_num]->clkm_conf.clkm_div_num = 1;
         I2S[i2s_num]->clkm_conf.clkm_div_b = 0;
         I2S[i2s_num]->clkm_conf.clkm_div_a = 1;
         I2S[i2s_num]->sample_rate_conf.tx_bck_div_num = m_scale;
         I2S[i2s_num]->sample_rate_conf.rx_bck_div_num = m_scale;
         I2S[i2s_num]->clkm_conf.clka_en = 1;
-        double fi2s_rate = i2s_apll_get_fi2s(bits, sdm0, sdm1, sdm2, odir);
         p_i2s_obj[i2s_num]->real_rate = fi2s_rate/bits/channel/m_scale;
         ESP_LOGI(I2S_TAG, "APLL: Req RATE: %d, real rate: %0.3f, BITS: %u, CLKM: %u, BCK_M: %u, MCLK: %0.3f, SCLK: %f, diva: %d, divb: %d",
             rate, fi2s_rate/bits/channel/m_scale, bits, 1, m_scale, fi2s_rate, fi2s_rate/8, 1, 0);
@@ -751,6 +800,7 @@ esp_err_t i2s_start(i2s_port_t i2s_num)
         I2S[i2s_num]->conf.rx_start = 1;
     }
     esp_intr_enable(p_i2s_obj[i2s_num]->i2s_isr_handle);
+    p_i2s_obj[i2s_num]->running = true;
     I2S_EXIT_CRITICAL();
     return ESP_OK;
 }
@@ -771,6 +821,7 @@ esp_err_t i2s_stop(i2s_port_t i2s_num)
         i2s_disable_rx_intr(i2s_num);
     }
     I2S[i2s_num]->int_clr.val = I2S[i2s_num]->int_st.val; //clear pending interrupt
+    p_i2s_obj[i2s_num]->running = false;
     I2S_EXIT_CRITICAL();
     return ESP_OK;
 }
@@ -1115,6 +1166,55 @@ esp_err_t i2s_zero_dma_buffer(i2s_port_t i2s_num)
     return ESP_OK;
 }
 
+/**
+ * Resize TX DMA buffers of an installed TX-only port. Port is stopped and must be 
+ * zeroed/restarted by caller. On allocation failure, previous buffers are kept
+ */
+esp_err_t i2s_set_dma_buf(i2s_port_t i2s_num, int dma_buf_count, int dma_buf_len)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num] != NULL), "Not initialized yet", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((dma_buf_count >= 2 && dma_buf_count <= 128), "I2S buffer count less than 128 and more than 2", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((dma_buf_len >= 8 && dma_buf_len <= 1024), "I2S buffer length at most 1024 and more than 8", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num]->tx && !(p_i2s_obj[i2s_num]->mode & I2S_MODE_RX)), "Only for TX ports", ESP_ERR_INVALID_STATE);
+
+    i2s_obj_t *obj = p_i2s_obj[i2s_num];
+
+    // Because limited of DMA buffer is 4092 bytes
+    if (dma_buf_len * obj->bytes_per_sample * obj->channel_num > 4092) {
+        dma_buf_len = 4092 / obj->bytes_per_sample / obj->channel_num;
+    }
+    if (dma_buf_count == obj->dma_buf_count && dma_buf_len == obj->dma_buf_len) {
+        return ESP_OK;
+    }
+
+    i2s_dma_t *save_tx = obj->tx;
+    int save_count = obj->dma_buf_count, save_len = obj->dma_buf_len;
+
+    xSemaphoreTake(save_tx->mux, (portTickType)portMAX_DELAY);
+    i2s_stop(i2s_num);
+
+    obj->dma_buf_count = dma_buf_count;
+    obj->dma_buf_len = dma_buf_len;
+    obj->tx = i2s_create_dma_queue(i2s_num, dma_buf_count, dma_buf_len);
+    if (obj->tx == NULL) {
+        ESP_LOGE(I2S_TAG, "Failed to resize tx dma buffer, keeping %d x %d", save_count, save_len);
+        obj->tx = save_tx;
+        obj->dma_buf_count = save_count;
+        obj->dma_buf_len = save_len;
+        xSemaphoreGive(save_tx->mux);
+        return ESP_ERR_NO_MEM;
+    }
+    I2S[i2s_num]->out_link.addr = (uint32_t) obj->tx->desc[0];
+
+    // old queue was allocated with previous count (its mutex goes with it, as in i2s_set_clk)
+    obj->dma_buf_count = save_count;
+    i2s_destroy_dma_queue(i2s_num, save_tx);
+    obj->dma_buf_count = dma_buf_count;
+
+    return ESP_OK;
+}
+
 esp_err_t i2s_driver_install(i2s_port_t i2s_num, const i2s_config_t *i2s_config, int queue_size, void* i2s_queue)
 {
     esp_err_t err;
@@ -1221,7 +1321,9 @@ esp_err_t i2s_driver_uninstall(i2s_port_t i2s_num)
         p_i2s_obj[i2s_num]->i2s_queue = NULL;
     }
 
-    if(p_i2s_obj[i2s_num]->use_apll) {
+    // APLL might still be clocking the other port
+    i2s_obj_t *peer = p_i2s_obj[i2s_num == I2S_NUM_0 ? I2S_NUM_1 : I2S_NUM_0];
+    if(p_i2s_obj[i2s_num]->use_apll && !(peer && peer->use_apll)) {
         rtc_clk_apll_enable(0, 0, 0, 0, 0);
     }
 #ifdef CONFIG_PM_ENABLE
@@ -18,6 +18,10 @@
 static const char * TAG = "squeezelite_cmd";
 #define SQUEEZELITE_THREAD_STACK_SIZE (6*1024)
 extern int main(int argc, char **argv);
+extern int stream_bench_run(const char *url, unsigned seconds);
+extern void convolver_bench(unsigned partition);
+extern void crossover_bench(void);
+extern void channels_bench(void);
 static int launchsqueezelite(int argc, char **argv);
 pthread_t thread_squeezelite;
 pthread_t thread_squeezelite_runner;
@@ -26,6 +30,17 @@ static struct {
     struct arg_str *parameters;
     struct arg_end *end;
 } squeezelite_args;
+/** Arguments used by 'stream_bench' function */
+static struct {
+    struct arg_str *url;
+    struct arg_int *duration;
+    struct arg_end *end;
+} stream_bench_args;
+/** Arguments used by 'conv_bench' function */
+static struct {
+    struct arg_int *partition;
+    struct arg_end *end;
+} conv_bench_args;
 static struct {
 	int argc;
 	char ** argv;
@@ -113,6 +128,87 @@ static int launchsqueezelite(int argc, char **argv)
 	ESP_LOGD(TAG ,"Back to console thread!");
     return 0;
 }
+static int stream_bench(int argc, char **argv)
+{
+	int nerrors = arg_parse(argc, argv, (void **) &stream_bench_args);
+	if (nerrors != 0) {
+		arg_print_errors(stderr, stream_bench_args.end, argv[0]);
+		return 1;
+	}
+	// squeezelite must be running, as we use its stream thread
+	return stream_bench_run(stream_bench_args.url->sval[0], stream_bench_args.duration->count ? stream_bench_args.duration->ival[0] : 10);
+}
+
+static void register_stream_bench(){
+	stream_bench_args.url = arg_str1(NULL, NULL, "<url>", "http(s) url to stream from");
+	stream_bench_args.duration = arg_int0("t", "time", "<seconds>", "Duration of the test (default 10s)");
+	stream_bench_args.end = arg_end(2);
+	const esp_console_cmd_t cmd = {
+		.command = "stream_bench",
+		.help = "Measures streaming throughput from an url, data is discarded (refused while playing)",
+		.hint = NULL,
+		.func = &stream_bench,
+		.argtable = &stream_bench_args
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static int conv_bench(int argc, char **argv)
+{
+	int nerrors = arg_parse(argc, argv, (void **) &conv_bench_args);
+	if (nerrors != 0) {
+		arg_print_errors(stderr, conv_bench_args.end, argv[0]);
+		return 1;
+	}
+	convolver_bench(conv_bench_args.partition->count ? conv_bench_args.partition->ival[0] : 0);
+	return 0;
+}
+
+static void register_conv_bench(){
+	conv_bench_args.partition = arg_int0("p", "partition", "<frames>", "Partition size (default 256)");
+	conv_bench_args.end = arg_end(1);
+	const esp_console_cmd_t cmd = {
+		.command = "conv_bench",
+		.help = "Measures convolution cycles per frame for several impulse response lengths",
+		.hint = NULL,
+		.func = &conv_bench,
+		.argtable = &conv_bench_args
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static int xover_bench(int argc, char **argv)
+{
+	crossover_bench();
+	return 0;
+}
+
+static void register_xover_bench(){
+	const esp_console_cmd_t cmd = {
+		.command = "xover_bench",
+		.help = "Measures crossover filtering cost for 2-way and 2.1 modes",
+		.hint = NULL,
+		.func = &xover_bench,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+static int chan_bench(int argc, char **argv)
+{
+	channels_bench();
+	return 0;
+}
+
+static void register_chan_bench(){
+	const esp_console_cmd_t cmd = {
+		.command = "chan_bench",
+		.help = "Measures gain stage cost per frame for each channel matrix mode",
+		.hint = NULL,
+		.func = &chan_bench,
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
 void register_squeezelite(){
 
 	squeezelite_args.parameters = arg_str0(NULL, NULL, "<parms>", "command line for squeezelite. -h for help, --defaults to launch with default values.");
@@ -125,5 +221,9 @@ void register_squeezelite(){
 		.argtable = &squeezelite_args
 	};
 	ESP_ERROR_CHECK( esp_console_cmd_register(&launch_squeezelite) );
+	register_stream_bench();
+	register_conv_bench();
+	register_xover_bench();
+	register_chan_bench();
 
 }
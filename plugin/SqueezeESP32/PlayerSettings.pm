@@ -30,7 +30,7 @@ sub page {
 
 sub prefs {
 	my ($class, $client) = @_;
-	my @prefs;
+	my @prefs = qw(channels sub_freq);
 	push @prefs, qw(width small_VU) if defined $client->displayWidth;
 	return ($prefs->client($client), @prefs);
 }
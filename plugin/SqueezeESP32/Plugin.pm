@@ -28,6 +28,10 @@ $prefs->setChange(sub {
 	send_equalizer($_[2]);
 }, 'equalizer');
 
+$prefs->setChange(sub {
+	send_channels($_[2]);
+}, 'channels', 'sub_freq');
+
 sub initPlugin {
 	my $class = shift;
 
@@ -73,8 +77,11 @@ sub onPlayer {
 
 		$prefs->client($client)->init( {
 			equalizer => [(0) x 10],
+			channels => 255,
+			sub_freq => 80,
 		} );
 		send_equalizer($client);
+		send_channels($client);
 	}
 }
 
@@ -118,4 +125,15 @@ sub send_equalizer {
 	}
 }
 
+# 0 = stereo, 1 = mono, 2 = swap, 3 = left, 4 = right, 5 = sub (right is low-passed mono), 255 = device setting
+sub send_channels {
+	my ($client) = @_;
+
+	if ($client->model eq 'squeezeesp32') {
+		my $cprefs = $prefs->client($client);
+		my $data = pack('Cn', $cprefs->get('channels') // 255, $cprefs->get('sub_freq') || 80);
+		$client->sendFrame( chnl => \$data );
+	}
+}
+
 1;